@@ -0,0 +1,220 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Times checking a Desktop's worth of desktop files for shortcuts to the wrapper,
+// with and without the scan that rejects most of them before GKeyFile sees them.
+// Each file is checked both from memory, which is the cost of the check itself,
+// and from disk the way flextop-init does it, which adds mapping the file. Listing
+// the files with their stat info is timed separately with each backend the
+// Desktop sweep can use.
+//
+// Usage: bench-desktop-scan [files] [repeats]
+
+#include "flextop-dir-scan.h"
+#include "flextop-utils.h"
+
+#include <glib/gstdio.h>
+#include <stdlib.h>
+
+#define WRAPPER "/app/bin/chromium"
+#define DEFAULT_FILES 10000
+#define DEFAULT_REPEATS 5
+
+// Like the Desktop benchmarks/generate-home.py creates: mostly unrelated launchers,
+// with a shortcut to a PWA every fourth file.
+static char *generate_desktop_file(int index) {
+  if (index % 4 == 0) {
+    return g_strdup_printf("#!/usr/bin/env xdg-open\n"
+                           "[Desktop Entry]\n"
+                           "Version=1.0\n"
+                           "Terminal=false\n"
+                           "Type=Application\n"
+                           "Name=Web App %d\n"
+                           "Name[de]=Web-App %d\n"
+                           "Exec=" WRAPPER " --profile-directory=Default --app-id=%032d\n"
+                           "Icon=chrome-%032d-Default\n"
+                           "StartupWMClass=crx_%032d\n",
+                           index, index, index, index, index);
+  }
+
+  return g_strdup_printf("[Desktop Entry]\n"
+                         "Type=Application\n"
+                         "Name=Unrelated %d\n"
+                         "Exec=/usr/bin/unrelated-%d --flag \"quoted arg\" %%f\n"
+                         "Icon=text-editor\n",
+                         index, index);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double get_median(double *values, int n) {
+  qsort(values, n, sizeof(double), compare_doubles);
+  return values[n / 2];
+}
+
+static void check(const char *data, gsize length, gboolean allow_scan,
+                  guint *wrappers) {
+  g_autoptr(GError) error = NULL;
+  gboolean is_wrapper;
+  if (!desktop_file_exec_is_wrapper(data, length, WRAPPER, allow_scan, &is_wrapper,
+                                    &error)) {
+    g_error("Failed to check generated file: %s", error->message);
+  }
+
+  *wrappers += is_wrapper;
+}
+
+// Returns the time taken per file in nanoseconds.
+static double time_memory(GPtrArray *contents, gboolean allow_scan, guint *wrappers) {
+  gint64 start = g_get_monotonic_time();
+  for (guint i = 0; i < contents->len; i++) {
+    const char *data = g_ptr_array_index(contents, i);
+    check(data, strlen(data), allow_scan, wrappers);
+  }
+
+  return (g_get_monotonic_time() - start) * 1000.0 / contents->len;
+}
+
+static double time_files(GPtrArray *paths, gboolean allow_scan, guint *wrappers) {
+  gint64 start = g_get_monotonic_time();
+  for (guint i = 0; i < paths->len; i++) {
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GMappedFile) mapped =
+        g_mapped_file_new(g_ptr_array_index(paths, i), FALSE, &error);
+    if (mapped == NULL) {
+      g_error("%s", error->message);
+    }
+
+    check(g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped),
+          allow_scan, wrappers);
+  }
+
+  return (g_get_monotonic_time() - start) * 1000.0 / paths->len;
+}
+
+// Returns the time taken per file in nanoseconds, or a negative number if the
+// backend can't be used here.
+static double time_dir_scan(const char *dir, DirScanBackend backend, guint *listed) {
+  g_autoptr(GError) error = NULL;
+  gint64 start = g_get_monotonic_time();
+  g_autoptr(GPtrArray) entries =
+      dir_scan_regular_files_with_backend(dir, ".desktop", backend, &error);
+  gint64 elapsed = g_get_monotonic_time() - start;
+  if (entries == NULL) {
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED)) {
+      g_error("%s", error->message);
+    }
+
+    g_debug("%s", error->message);
+    return -1;
+  }
+
+  *listed = entries->len;
+  return elapsed * 1000.0 / MAX(entries->len, 1);
+}
+
+int main(int argc, char **argv) {
+  int n_files = argc > 1 ? atoi(argv[1]) : DEFAULT_FILES;
+  int repeats = argc > 2 ? atoi(argv[2]) : DEFAULT_REPEATS;
+  if (n_files <= 0 || repeats <= 0) {
+    g_printerr("usage: %s [files] [repeats]\n", argv[0]);
+    return 1;
+  }
+
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = g_dir_make_tmp("flextop-bench-XXXXXX", &error);
+  if (dir == NULL) {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+
+  g_autoptr(GPtrArray) contents = g_ptr_array_new_with_free_func(g_free);
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func(g_free);
+  for (int i = 0; i < n_files; i++) {
+    char *data = generate_desktop_file(i);
+    g_autofree char *filename = g_strdup_printf("file-%d.desktop", i);
+    char *path = g_build_filename(dir, filename, NULL);
+    if (!g_file_set_contents(path, data, -1, &error)) {
+      g_printerr("%s\n", error->message);
+      return 1;
+    }
+
+    g_ptr_array_add(contents, data);
+    g_ptr_array_add(paths, path);
+  }
+
+  static const struct {
+    const char *name;
+    gboolean from_files;
+    gboolean allow_scan;
+  } variants[] = {
+      {"memory, GKeyFile only", FALSE, FALSE},
+      {"memory, scan first", FALSE, TRUE},
+      {"files, GKeyFile only", TRUE, FALSE},
+      {"files, scan first", TRUE, TRUE},
+  };
+
+  g_print("%d files, median of %d runs\n", n_files, repeats);
+  g_print("%-24s %10s %10s\n", "variant", "ns/file", "removed");
+  for (gsize i = 0; i < G_N_ELEMENTS(variants); i++) {
+    g_autofree double *times = g_new(double, repeats);
+    guint wrappers = 0;
+    for (int j = 0; j < repeats; j++) {
+      wrappers = 0;
+      times[j] = variants[i].from_files
+                     ? time_files(paths, variants[i].allow_scan, &wrappers)
+                     : time_memory(contents, variants[i].allow_scan, &wrappers);
+    }
+
+    g_print("%-24s %10.0f %10u\n", variants[i].name, get_median(times, repeats),
+            wrappers);
+  }
+
+  static const struct {
+    const char *name;
+    DirScanBackend backend;
+  } backends[] = {
+      {"list, auto", DIR_SCAN_BACKEND_AUTO},
+      {"list, io_uring", DIR_SCAN_BACKEND_URING},
+      {"list, statx", DIR_SCAN_BACKEND_STATX},
+      {"list, GIO", DIR_SCAN_BACKEND_GIO},
+  };
+
+  g_print("\n%-24s %10s %10s\n", "backend", "ns/file", "listed");
+  for (gsize i = 0; i < G_N_ELEMENTS(backends); i++) {
+    g_autofree double *times = g_new(double, repeats);
+    guint listed = 0;
+    for (int j = 0; j < repeats; j++) {
+      times[j] = time_dir_scan(dir, backends[i].backend, &listed);
+    }
+
+    if (times[0] < 0) {
+      g_print("%-24s %10s\n", backends[i].name, "-");
+    } else {
+      g_print("%-24s %10.0f %10u\n", backends[i].name, get_median(times, repeats),
+              listed);
+    }
+  }
+
+  for (guint i = 0; i < paths->len; i++) {
+    g_unlink(g_ptr_array_index(paths, i));
+  }
+  g_rmdir(dir);
+
+  return 0;
+}
@@ -0,0 +1,187 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Times scaling an icon down to each of the usual hicolor sizes with
+// icon_scale_png, against loading, scaling and saving it with gdk-pixbuf the way
+// a GTK tool would. Both go from file to file, so PNG decoding and encoding are
+// included. The diff column is the mean difference per channel from gdk-pixbuf's
+// GDK_INTERP_HYPER result, to show the two filters agree.
+//
+// Usage: bench-icon-scale [source size] [repeats]
+
+#include "flextop-icon-scale.h"
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib/gstdio.h>
+#include <math.h>
+#include <stdlib.h>
+
+#define DEFAULT_SOURCE_SIZE 512
+#define DEFAULT_REPEATS 20
+
+static const int target_sizes[] = {16, 24, 32, 48, 64, 128, 256};
+
+// A rounded square with a gradient and a translucent edge, which is roughly what
+// Chromium's generated icons look like, and exercises the alpha handling.
+static GdkPixbuf *generate_icon(int size) {
+  GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, size, size);
+  guint8 *pixels = gdk_pixbuf_get_pixels(pixbuf);
+  int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+  double radius = size / 2.0;
+
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      guint8 *pixel = pixels + y * rowstride + x * 4;
+      double dx = MAX(fabs(x + 0.5 - radius) - radius / 2, 0);
+      double dy = MAX(fabs(y + 0.5 - radius) - radius / 2, 0);
+      double edge = radius / 2 - sqrt(dx * dx + dy * dy);
+
+      pixel[0] = x * 255 / size;
+      pixel[1] = y * 255 / size;
+      pixel[2] = (x ^ y) & 0xff;
+      pixel[3] = CLAMP(edge * 8, 0, 255);
+    }
+  }
+
+  return pixbuf;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double get_median(double *values, int n) {
+  qsort(values, n, sizeof(double), compare_doubles);
+  return values[n / 2];
+}
+
+static void scale_with_flextop(const char *source, const char *dest, int size) {
+  g_autoptr(GError) error = NULL;
+  if (!icon_scale_png(source, dest, size, &error)) {
+    g_error("%s", error->message);
+  }
+}
+
+static void scale_with_pixbuf(const char *source, const char *dest, int size,
+                              GdkInterpType interp) {
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GdkPixbuf) pixbuf = gdk_pixbuf_new_from_file(source, &error);
+  if (pixbuf == NULL) {
+    g_error("%s", error->message);
+  }
+
+  g_autoptr(GdkPixbuf) scaled = gdk_pixbuf_scale_simple(pixbuf, size, size, interp);
+  if (!gdk_pixbuf_save(scaled, dest, "png", &error, NULL)) {
+    g_error("%s", error->message);
+  }
+}
+
+// Returns the mean absolute difference per channel between two equally sized
+// RGBA images.
+static double compare_images(const char *a_path, const char *b_path) {
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GdkPixbuf) a = gdk_pixbuf_new_from_file(a_path, &error);
+  g_autoptr(GdkPixbuf) b = a != NULL ? gdk_pixbuf_new_from_file(b_path, &error) : NULL;
+  if (b == NULL) {
+    g_error("%s", error->message);
+  }
+
+  int size = gdk_pixbuf_get_width(a);
+  const guint8 *a_pixels = gdk_pixbuf_get_pixels(a);
+  const guint8 *b_pixels = gdk_pixbuf_get_pixels(b);
+  guint64 total = 0;
+  for (int y = 0; y < size; y++) {
+    const guint8 *a_row = a_pixels + y * gdk_pixbuf_get_rowstride(a);
+    const guint8 *b_row = b_pixels + y * gdk_pixbuf_get_rowstride(b);
+    for (int x = 0; x < size * 4; x++) {
+      total += abs(a_row[x] - b_row[x]);
+    }
+  }
+
+  return (double)total / (size * size * 4);
+}
+
+int main(int argc, char **argv) {
+  int source_size = argc > 1 ? atoi(argv[1]) : DEFAULT_SOURCE_SIZE;
+  int repeats = argc > 2 ? atoi(argv[2]) : DEFAULT_REPEATS;
+  if (source_size <= target_sizes[G_N_ELEMENTS(target_sizes) - 1] || repeats <= 0) {
+    g_printerr("usage: %s [source size > %d] [repeats]\n", argv[0],
+               target_sizes[G_N_ELEMENTS(target_sizes) - 1]);
+    return 1;
+  }
+
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = g_dir_make_tmp("flextop-bench-XXXXXX", &error);
+  if (dir == NULL) {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+
+  g_autofree char *source = g_build_filename(dir, "source.png", NULL);
+  g_autofree char *flextop_dest = g_build_filename(dir, "flextop.png", NULL);
+  g_autofree char *pixbuf_dest = g_build_filename(dir, "pixbuf.png", NULL);
+
+  g_autoptr(GdkPixbuf) icon = generate_icon(source_size);
+  if (!gdk_pixbuf_save(icon, source, "png", &error, NULL)) {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+
+  static const struct {
+    const char *name;
+    gboolean use_pixbuf;
+    GdkInterpType interp;
+  } variants[] = {
+      {"icon_scale_png", FALSE, 0},
+      {"pixbuf bilinear", TRUE, GDK_INTERP_BILINEAR},
+      {"pixbuf hyper", TRUE, GDK_INTERP_HYPER},
+  };
+
+  g_print("%dx%d source, median of %d runs\n", source_size, source_size, repeats);
+  g_print("%-6s %-16s %10s %8s\n", "size", "variant", "us/icon", "diff");
+  for (gsize i = 0; i < G_N_ELEMENTS(target_sizes); i++) {
+    int size = target_sizes[i];
+
+    for (gsize j = 0; j < G_N_ELEMENTS(variants); j++) {
+      const char *dest = variants[j].use_pixbuf ? pixbuf_dest : flextop_dest;
+      g_autofree double *times = g_new(double, repeats);
+      for (int k = 0; k < repeats; k++) {
+        gint64 start = g_get_monotonic_time();
+        if (variants[j].use_pixbuf) {
+          scale_with_pixbuf(source, dest, size, variants[j].interp);
+        } else {
+          scale_with_flextop(source, dest, size);
+        }
+        times[k] = g_get_monotonic_time() - start;
+      }
+
+      // The last variant is the reference, and leaves its result in pixbuf_dest.
+      g_print("%-6d %-16s %10.0f", size, variants[j].name, get_median(times, repeats));
+      if (j == G_N_ELEMENTS(variants) - 1) {
+        g_print(" %8.2f\n", compare_images(flextop_dest, pixbuf_dest));
+      } else {
+        g_print(" %8s\n", "");
+      }
+    }
+  }
+
+  g_unlink(source);
+  g_unlink(flextop_dest);
+  g_unlink(pixbuf_dest);
+  g_rmdir(dir);
+
+  return 0;
+}
@@ -0,0 +1,203 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Times the pieces of installing a desktop file that run for every Chromium entry,
+// and counts their allocations with tests/alloc-counter.c, which is linked in:
+//
+//   exec      desktop_file_build_exec_command() on every Exec key of the entry.
+//   suffixes  drop_expected_path_suffixes() on the app path, as done to find the
+//             installation root.
+//   rewrite   desktop_file_rewrite_data() on the whole entry, for scale.
+//
+// With GLib older than 2.76, run it with G_SLICE=always-malloc, or allocations
+// from GLib's slice allocator aren't counted.
+//
+// Usage: bench-rewrite [files] [repeats]
+
+#include "flextop-desktop-rewrite.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define APP "org.chromium.Chromium"
+#define ARCH "x86_64"
+#define BRANCH "stable"
+#define COMMIT "4f1e0c6b2d8a9e7f3c5b1a0d9e8f7c6b5a4d3e2f1a0b9c8d7e6f5a4b3c2d1e0f"
+#define APP_PATH "/var/lib/flatpak/app/" APP "/" ARCH "/" BRANCH "/" COMMIT "/files"
+#define WRAPPER "/app/bin/chromium"
+#define DEFAULT_FILES 10000
+#define DEFAULT_REPEATS 5
+
+unsigned long alloc_counter_get_allocations();
+
+typedef struct {
+  char *contents;
+  // The Exec values in the entry, NULL-terminated.
+  GStrv execs;
+} Entry;
+
+// Like the PWAs benchmarks/generate-home.py creates: every other one has shortcut
+// menu actions, and some of the URLs need quoting.
+static void generate_entry(GRand *rand, int index, Entry *out_entry) {
+  // Chromium's app IDs are 32 characters from a-p.
+  char crx_id[33] = {0};
+  for (int i = 0; i < 32; i++) {
+    crx_id[i] = 'a' + g_rand_int_range(rand, 0, 16);
+  }
+
+  g_autoptr(GPtrArray) execs = g_ptr_array_new_with_free_func(g_free);
+  g_ptr_array_add(execs, g_strdup_printf(
+                             WRAPPER " --profile-directory=Default --app-id=%s", crx_id));
+
+  g_autoptr(GString) contents = g_string_new(NULL);
+  g_string_append_printf(contents,
+                         "#!/usr/bin/env xdg-open\n"
+                         "[Desktop Entry]\n"
+                         "Version=1.0\n"
+                         "Terminal=false\n"
+                         "Type=Application\n"
+                         "Name=Web App %d\n"
+                         "Name[de]=Web-App %d\n"
+                         "Exec=%s\n"
+                         "Icon=chrome-%s-Default\n"
+                         "StartupWMClass=crx_%s\n",
+                         index, index, (char *)execs->pdata[0], crx_id, crx_id);
+
+  if (index % 2 == 0) {
+    g_ptr_array_add(execs, g_strdup_printf(
+                               WRAPPER " --profile-directory=Default --app-id=%s "
+                                       "--app-launch-url-for-shortcuts-menu-item="
+                                       "\"https://example.com/%d/new?a=1&b=it's\"",
+                               crx_id, index));
+    g_ptr_array_add(execs, g_strdup_printf(
+                               WRAPPER " --profile-directory=Default --app-id=%s %%U",
+                               crx_id));
+    g_string_append_printf(contents,
+                           "MimeType=text/plain;application/x-flextop-benchmark;\n"
+                           "Actions=New;Open;\n"
+                           "\n"
+                           "[Desktop Action New]\n"
+                           "Name=New Window\n"
+                           "Exec=%s\n"
+                           "\n"
+                           "[Desktop Action Open]\n"
+                           "Name=Open\n"
+                           "Exec=%s\n",
+                           (char *)execs->pdata[1], (char *)execs->pdata[2]);
+  }
+
+  g_ptr_array_add(execs, NULL);
+  out_entry->contents = g_string_free(g_steal_pointer(&contents), FALSE);
+  out_entry->execs = (GStrv)g_ptr_array_free(g_steal_pointer(&execs), FALSE);
+}
+
+static void run_exec(Entry *entry, FlatpakInfo *info, GPtrArray *warnings) {
+  for (char **exec = entry->execs; *exec != NULL; exec++) {
+    g_autoptr(GError) error = NULL;
+    g_autofree char *command = NULL;
+    if (!desktop_file_build_exec_command(*exec, G_KEY_FILE_DESKTOP_GROUP, info, warnings,
+                                         &command, &error)) {
+      g_error("%s", error->message);
+    }
+  }
+}
+
+static void run_suffixes(Entry *entry, FlatpakInfo *info, GPtrArray *warnings) {
+  g_autofree char *root = drop_expected_path_suffixes(
+      APP_PATH, "app", APP, ARCH, BRANCH, COMMIT, "files", NULL);
+  if (root == NULL) {
+    g_error("Failed to find the installation root");
+  }
+}
+
+static void run_rewrite(Entry *entry, FlatpakInfo *info, GPtrArray *warnings) {
+  g_auto(DesktopFileRewrite) rewrite = {NULL};
+  g_autoptr(GError) error = NULL;
+  if (!desktop_file_rewrite_data("bench.desktop", entry->contents,
+                                 strlen(entry->contents), info, TRUE, &rewrite,
+                                 warnings, NULL, &error)) {
+    g_error("%s", error->message);
+  }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double get_median(double *values, int n) {
+  qsort(values, n, sizeof(double), compare_doubles);
+  return values[n / 2];
+}
+
+int main(int argc, char **argv) {
+  int n_files = argc > 1 ? atoi(argv[1]) : DEFAULT_FILES;
+  int repeats = argc > 2 ? atoi(argv[2]) : DEFAULT_REPEATS;
+  if (n_files <= 0 || repeats <= 0) {
+    g_printerr("usage: %s [files] [repeats]\n", argv[0]);
+    return 1;
+  }
+
+  FlatpakInfo info = {
+      .app = APP,
+      .wrapper_exe = "/var/lib/flatpak/exports/bin/" APP,
+      .exec_app_arg = "'" APP "'",
+  };
+
+  // A fixed seed keeps the corpus the same between runs.
+  g_autoptr(GRand) rand = g_rand_new_with_seed(20205);
+  g_autofree Entry *entries = g_new(Entry, n_files);
+  for (int i = 0; i < n_files; i++) {
+    generate_entry(rand, i, &entries[i]);
+  }
+
+  static const struct {
+    const char *name;
+    void (*run)(Entry *entry, FlatpakInfo *info, GPtrArray *warnings);
+  } kernels[] = {
+      {"exec", run_exec},
+      {"suffixes", run_suffixes},
+      {"rewrite", run_rewrite},
+  };
+
+  g_print("%d Chromium entries, median of %d runs\n", n_files, repeats);
+  g_print("%-10s %10s %12s\n", "kernel", "ns/file", "allocs/file");
+  for (gsize i = 0; i < G_N_ELEMENTS(kernels); i++) {
+    g_autofree double *times = g_new(double, repeats);
+    g_autoptr(GPtrArray) warnings = g_ptr_array_new_with_free_func(g_free);
+    unsigned long allocations = 0;
+    for (int j = 0; j < repeats; j++) {
+      unsigned long allocations_before = alloc_counter_get_allocations();
+      gint64 start = g_get_monotonic_time();
+      for (int k = 0; k < n_files; k++) {
+        kernels[i].run(&entries[k], &info, warnings);
+      }
+
+      times[j] = (g_get_monotonic_time() - start) * 1000.0 / n_files;
+      allocations = alloc_counter_get_allocations() - allocations_before;
+      g_ptr_array_set_size(warnings, 0);
+    }
+
+    g_print("%-10s %10.0f %12.1f\n", kernels[i].name, get_median(times, repeats),
+            (double)allocations / n_files);
+  }
+
+  for (int i = 0; i < n_files; i++) {
+    g_free(entries[i].contents);
+    g_strfreev(entries[i].execs);
+  }
+
+  return 0;
+}
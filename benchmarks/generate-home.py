@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+# Copyright (c) 2020 Endless OS Foundation LLC.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Generates a synthetic home for running the tools outside of Flatpak, in a build
+# with -Dtest_hooks=true. The output directory gets:
+#
+#   inputs/    What Chromium would hand the tools: a desktop file and a set of
+#              icons per PWA. The tools never modify these.
+#   home/      $HOME, with the sandbox's XDG dirs under .var/app/<id>, the host's
+#              data dir under .local/share, and a Desktop holding a shortcut for
+#              some of the PWAs plus unrelated desktop files.
+#   runtime/   $XDG_RUNTIME_DIR.
+#   flatpak/   A fake installation, only there so the paths in the Flatpak info
+#              can be resolved.
+#   home.json  The environment to run the tools with, and what was generated.
+
+import argparse
+import json
+import os
+import random
+import shutil
+import struct
+import sys
+import zlib
+
+APP_ID = 'org.chromium.Chromium'
+ARCH = 'x86_64'
+BRANCH = 'stable'
+COMMIT = '4f1e0c6b2d8a9e7f3c5b1a0d9e8f7c6b5a4d3e2f1a0b9c8d7e6f5a4b3c2d1e0f'
+CHROME_WRAPPER = '/app/bin/chromium'
+
+DEFAULT_ICON_SIZES = [16, 32, 48, 64, 128, 256]
+
+# Icons of the same size share one of these colors, and are made unique with a text
+# chunk, so only a handful of images have to be compressed.
+PALETTE = [
+    (0x1a, 0x73, 0xe8), (0xd9, 0x30, 0x25), (0xf9, 0xab, 0x00), (0x1e, 0x8e, 0x3e),
+    (0x9a, 0x34, 0xa0), (0x00, 0x89, 0x7b), (0x5f, 0x63, 0x68), (0xe8, 0x71, 0x0a),
+]
+
+
+def png_chunk(kind, data):
+    body = kind + data
+    return struct.pack('>I', len(data)) + body + struct.pack('>I', zlib.crc32(body))
+
+
+class IconWriter:
+    def __init__(self):
+        self._image_data = {}
+
+    def _get_image_data(self, size, color):
+        key = (size, color)
+        if key not in self._image_data:
+            row = b'\0' + bytes(color + (0xff,)) * size
+            self._image_data[key] = zlib.compress(row * size, 1)
+        return self._image_data[key]
+
+    def write(self, path, size, index, comment):
+        color = PALETTE[index % len(PALETTE)]
+        header = struct.pack('>IIBBBBB', size, size, 8, 6, 0, 0, 0)
+        with open(path, 'wb') as f:
+            f.write(b'\x89PNG\r\n\x1a\n')
+            f.write(png_chunk(b'IHDR', header))
+            f.write(png_chunk(b'tEXt', b'Comment\0' + comment.encode()))
+            f.write(png_chunk(b'IDAT', self._get_image_data(size, color)))
+            f.write(png_chunk(b'IEND', b''))
+
+
+def get_crx_id(rng):
+    # Chromium's app IDs are 32 characters from a-p.
+    return ''.join(rng.choice('abcdefghijklmnop') for _ in range(32))
+
+
+def get_pwa_desktop_file(crx_id, index, with_extras):
+    # Matches what Chromium writes for a PWA, with some of them also declaring
+    # actions and MIME types like the ones with shortcuts and file handlers.
+    lines = [
+        '#!/usr/bin/env xdg-open',
+        '[Desktop Entry]',
+        'Version=1.0',
+        'Terminal=false',
+        'Type=Application',
+        f'Name=Web App {index}',
+        f'Name[de]=Web-App {index}',
+        f'Exec={CHROME_WRAPPER} --profile-directory=Default --app-id={crx_id}',
+        f'Icon=chrome-{crx_id}-Default',
+        f'StartupWMClass=crx_{crx_id}',
+    ]
+
+    if with_extras:
+        lines += [
+            'MimeType=text/plain;application/x-flextop-benchmark;',
+            'Actions=New;Open;',
+            '',
+            '[Desktop Action New]',
+            'Name=New Window',
+            f'Exec={CHROME_WRAPPER} --profile-directory=Default --app-id={crx_id} '
+            f'--app-launch-url-for-shortcuts-menu-item=https://example.com/{index}/new',
+            '',
+            '[Desktop Action Open]',
+            'Name=Open',
+            f'Exec={CHROME_WRAPPER} --profile-directory=Default --app-id={crx_id} %U',
+        ]
+
+    return '\n'.join(lines) + '\n'
+
+
+def get_unrelated_desktop_file(index):
+    return '\n'.join([
+        '[Desktop Entry]',
+        'Type=Application',
+        f'Name=Unrelated {index}',
+        f'Exec=/usr/bin/unrelated-{index} --flag "quoted arg" %f',
+        'Icon=text-editor',
+    ]) + '\n'
+
+
+def generate_inputs(output, apps, icon_sizes, seed=0):
+    """Writes the desktop files and icons Chromium would install for each PWA, and
+    returns a description of them."""
+    rng = random.Random(seed)
+    icon_writer = IconWriter()
+
+    applications = os.path.join(output, 'inputs', 'applications')
+    icons = os.path.join(output, 'inputs', 'icons')
+    os.makedirs(applications, exist_ok=True)
+    os.makedirs(icons, exist_ok=True)
+
+    result = []
+    for index in range(apps):
+        crx_id = get_crx_id(rng)
+        icon_name = f'chrome-{crx_id}-Default'
+        desktop_name = f'{icon_name}.desktop'
+        desktop_path = os.path.join(applications, desktop_name)
+        with open(desktop_path, 'w') as f:
+            f.write(get_pwa_desktop_file(crx_id, index, index % 4 == 0))
+
+        app_icons = []
+        for size in icon_sizes:
+            icon_path = os.path.join(icons, f'{icon_name}-{size}.png')
+            icon_writer.write(icon_path, size, index, crx_id)
+            app_icons.append({'size': size, 'path': icon_path})
+
+        result.append({
+            'desktop_file': desktop_path,
+            'desktop_name': desktop_name,
+            'icon_name': icon_name,
+            'icons': app_icons,
+        })
+
+    return result
+
+
+def generate_home(output, apps, desktop_files, shortcut_ratio=0.25):
+    """Creates the home, runtime dir and fake installation, with shortcuts on the
+    Desktop for some of the given PWAs. Returns the environment to run the tools
+    with."""
+    home = os.path.join(output, 'home')
+    sandbox = os.path.join(home, '.var', 'app', APP_ID)
+    host_data = os.path.join(home, '.local', 'share')
+    desktop = os.path.join(home, 'Desktop')
+    runtime = os.path.join(output, 'runtime')
+    installation = os.path.join(output, 'flatpak')
+    app_path = os.path.join(installation, 'app', APP_ID, ARCH, BRANCH, COMMIT, 'files')
+
+    for path in [os.path.join(sandbox, 'data'), os.path.join(sandbox, 'config'),
+                 os.path.join(sandbox, 'cache'), host_data, desktop,
+                 os.path.join(runtime, 'app', APP_ID), app_path,
+                 os.path.join(installation, 'exports', 'bin')]:
+        os.makedirs(path, exist_ok=True)
+    os.chmod(runtime, 0o700)
+
+    with open(os.path.join(sandbox, 'config', 'user-dirs.dirs'), 'w') as f:
+        f.write('XDG_DESKTOP_DIR="$HOME/Desktop"\n')
+
+    flatpak_info = os.path.join(output, 'flatpak-info')
+    with open(flatpak_info, 'w') as f:
+        f.write('[Application]\n'
+                f'name={APP_ID}\n'
+                '\n'
+                '[Instance]\n'
+                f'branch={BRANCH}\n'
+                f'arch={ARCH}\n'
+                f'app-path={app_path}\n'
+                f'app-commit={COMMIT}\n')
+
+    # Shortcuts Chromium put on the Desktop, which flextop-init has to remove since
+    # they don't go through Flatpak, spread out among the unrelated files.
+    shortcut_every = int(1 / shortcut_ratio) if shortcut_ratio > 0 else 0
+    for index, app in enumerate(apps):
+        if shortcut_every and index % shortcut_every == 0:
+            shutil.copyfile(app['desktop_file'],
+                            os.path.join(desktop, app['desktop_name']))
+
+    for index in range(desktop_files):
+        with open(os.path.join(desktop, f'unrelated-{index}.desktop'), 'w') as f:
+            f.write(get_unrelated_desktop_file(index))
+
+    return {
+        'HOME': home,
+        'XDG_DATA_HOME': os.path.join(sandbox, 'data'),
+        'XDG_CONFIG_HOME': os.path.join(sandbox, 'config'),
+        'XDG_CACHE_HOME': os.path.join(sandbox, 'cache'),
+        'XDG_RUNTIME_DIR': runtime,
+        'FLATPAK_ID': APP_ID,
+        'CHROME_WRAPPER': CHROME_WRAPPER,
+        'FLEXTOP_TEST_FLATPAK_INFO': flatpak_info,
+        'FLEXTOP_TEST_HOST_DATA_DIR': host_data,
+    }
+
+
+def parse_sizes(value):
+    return [int(size) for size in value.split(',') if size]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate a synthetic flextop home.')
+    parser.add_argument('output', help='directory to generate into, must not exist')
+    parser.add_argument('--apps', type=int, default=10, help='number of PWAs')
+    parser.add_argument('--icon-sizes', type=parse_sizes, default=DEFAULT_ICON_SIZES,
+                        help='comma-separated icon sizes each PWA has')
+    parser.add_argument('--desktop-files', type=int, default=10,
+                        help='number of unrelated desktop files on the Desktop')
+    parser.add_argument('--seed', type=int, default=0)
+    args = parser.parse_args()
+
+    if os.path.exists(args.output):
+        sys.exit(f'{args.output} already exists')
+
+    apps = generate_inputs(args.output, args.apps, args.icon_sizes, args.seed)
+    env = generate_home(args.output, apps, args.desktop_files)
+    with open(os.path.join(args.output, 'home.json'), 'w') as f:
+        json.dump({'env': env, 'apps': apps}, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,473 @@
+#!/usr/bin/env python3
+# Copyright (c) 2020 Endless OS Foundation LLC.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Times the tools end to end against synthetic homes (see generate-home.py) with an
+# increasing number of PWAs, and writes the results as JSON. Needs a build with
+# -Dtest_hooks=true.
+
+import argparse
+import importlib.util
+import json
+import os
+import resource
+import shutil
+import signal
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+DEFAULT_SCALES = [10, 100, 1000, 10000]
+DEFAULT_LATENCY_REQUESTS = 100
+DEFAULT_STARTUP_RUNS = 100
+DEFAULT_WORKER_APPS = 500
+SUITES = ['end-to-end', 'latency', 'startup', 'workers']
+DURABILITIES = ['file', 'batch', 'none']
+DROP_CACHES = '/proc/sys/vm/drop_caches'
+SERVICE_START_TIMEOUT = 10
+RESULTS_VERSION = 1
+
+
+def load_generator():
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'generate-home.py')
+    spec = importlib.util.spec_from_file_location('generate_home', path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+class ToolError(Exception):
+    pass
+
+
+class Runner:
+    def __init__(self, bindir, env):
+        self.bindir = bindir
+        self.env = dict(os.environ)
+        self.env.update(env)
+        self.env['PATH'] = bindir + os.pathsep + self.env.get('PATH', '')
+        # The tools start the service from here instead of where it'd be installed.
+        self.env['FLEXTOP_TEST_BINDIR'] = bindir
+        # Debug output would only measure the terminal.
+        self.env.pop('G_MESSAGES_DEBUG', None)
+        self.env.pop('FLEXTOP_SERVICE', None)
+        self.env.pop('FLEXTOP_TRACE', None)
+        self.env.pop('FLEXTOP_DURABILITY', None)
+        self.env.pop('FLEXTOP_TEST_WORKERS', None)
+
+    def set_service(self, enabled):
+        if enabled:
+            self.env['FLEXTOP_SERVICE'] = '1'
+        else:
+            self.env.pop('FLEXTOP_SERVICE', None)
+
+    def set_durability(self, durability):
+        self.env['FLEXTOP_DURABILITY'] = durability
+
+    def set_workers(self, workers):
+        self.env['FLEXTOP_TEST_WORKERS'] = str(workers)
+
+    def run(self, argv, stdin=None):
+        """Runs a tool to completion, returning the wall, user and system time it
+        took in milliseconds."""
+        argv = [os.path.join(self.bindir, argv[0])] + argv[1:]
+        usage_before = resource.getrusage(resource.RUSAGE_CHILDREN)
+        start = time.perf_counter()
+        proc = subprocess.run(argv, env=self.env, input=stdin, stdout=subprocess.PIPE,
+                              stderr=subprocess.PIPE)
+        wall = time.perf_counter() - start
+        usage_after = resource.getrusage(resource.RUSAGE_CHILDREN)
+
+        if proc.returncode != 0:
+            raise ToolError(f'{" ".join(argv[:3])}... exited with {proc.returncode}:\n'
+                            f'{proc.stderr.decode(errors="replace")}')
+
+        return {
+            'wall_ms': wall * 1000,
+            'user_ms': (usage_after.ru_utime - usage_before.ru_utime) * 1000,
+            'sys_ms': (usage_after.ru_stime - usage_before.ru_stime) * 1000,
+        }
+
+
+def get_icon_batch(apps):
+    lines = []
+    for app in apps:
+        for icon in app['icons']:
+            lines.append(f'{icon["size"]} \'{icon["path"]}\' {app["icon_name"]}\n')
+    return ''.join(lines).encode()
+
+
+# Each scenario runs against the state the previous ones left behind, the way a
+# browser would install its PWAs, get relaunched, and eventually remove them.
+def get_scenarios(apps):
+    desktop_files = [app['desktop_file'] for app in apps]
+    desktop_names = [app['desktop_name'] for app in apps]
+    icon_batch = get_icon_batch(apps)
+
+    return [
+        ('init-cold', ['flextop-init'], None),
+        ('init-warm', ['flextop-init'], None),
+        ('icon-install', ['xdg-icon-resource', 'install', '--noupdate', '--mode', 'user',
+                          '--batch'], icon_batch),
+        ('icon-forceupdate', ['xdg-icon-resource', 'forceupdate', '--mode', 'user'],
+         None),
+        ('desktop-install', ['xdg-desktop-menu', 'install', '--mode', 'user']
+         + desktop_files, None),
+        ('desktop-install-unchanged', ['xdg-desktop-menu', 'install', '--mode', 'user']
+         + desktop_files, None),
+        ('desktop-uninstall', ['xdg-desktop-menu', 'uninstall', '--mode', 'user']
+         + desktop_names, None),
+    ]
+
+
+# Installs every desktop file into a fresh home, once for each FLEXTOP_DURABILITY
+# policy, since how much syncing costs depends on how much else is waiting to be
+# written back.
+def get_durability_scenarios(apps):
+    desktop_files = [app['desktop_file'] for app in apps]
+    return [(f'desktop-install-cold-{durability}', durability,
+             ['xdg-desktop-menu', 'install', '--mode', 'user'] + desktop_files)
+            for durability in DURABILITIES]
+
+
+def drop_caches():
+    """Writes back everything that's dirty, so that none of it is charged to the
+    next run's syncs, then drops the page cache if allowed to."""
+    os.sync()
+    try:
+        with open(DROP_CACHES, 'w') as f:
+            f.write('3\n')
+    except OSError:
+        pass
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+
+def summarize(samples, scale):
+    summary = {'repeats': len(samples)}
+    for key in ['wall_ms', 'user_ms', 'sys_ms']:
+        values = [sample[key] for sample in samples]
+        summary[key] = {
+            'min': min(values),
+            'median': statistics.median(values),
+            'p95': percentile(values, 0.95),
+            'mean': statistics.mean(values),
+        }
+    summary['per_app_us'] = summary['wall_ms']['median'] * 1000 / scale
+    return summary
+
+
+def run_scale(generator, bindir, workdir, scale, args):
+    inputs_dir = os.path.join(workdir, f'inputs-{scale}')
+    apps = generator.generate_inputs(inputs_dir, scale, args.icon_sizes)
+    desktop_files = args.desktop_files if args.desktop_files is not None else scale
+
+    samples = {}
+    for repeat in range(args.repeat):
+        # The scenarios change the home, so each repeat starts from a fresh one.
+        home_dir = os.path.join(workdir, f'home-{scale}')
+        shutil.rmtree(home_dir, ignore_errors=True)
+        env = generator.generate_home(home_dir, apps, desktop_files)
+
+        runner = Runner(bindir, env)
+        for name, argv, stdin in get_scenarios(apps):
+            samples.setdefault(name, []).append(runner.run(argv, stdin))
+
+        for name, durability, argv in get_durability_scenarios(apps):
+            shutil.rmtree(home_dir, ignore_errors=True)
+            env = generator.generate_home(home_dir, apps, desktop_files)
+            runner = Runner(bindir, env)
+            runner.set_durability(durability)
+            drop_caches()
+            samples.setdefault(name, []).append(runner.run(argv))
+
+    shutil.rmtree(inputs_dir, ignore_errors=True)
+    shutil.rmtree(os.path.join(workdir, f'home-{scale}'), ignore_errors=True)
+
+    return [{'scale': scale, 'scenario': name, **summarize(runs, scale)}
+            for name, runs in samples.items()]
+
+
+def find_service_pids(runtime_dir):
+    """Returns the flextop-service processes started for the given runtime dir."""
+    marker = f'XDG_RUNTIME_DIR={runtime_dir}'.encode()
+    pids = []
+    for entry in os.listdir('/proc'):
+        if not entry.isdigit():
+            continue
+        try:
+            # The service may be a script run through an interpreter.
+            with open(f'/proc/{entry}/cmdline', 'rb') as f:
+                argv = f.read().split(b'\0')[:2]
+            if b'flextop-service' not in [os.path.basename(arg) for arg in argv]:
+                continue
+            with open(f'/proc/{entry}/environ', 'rb') as f:
+                if marker in f.read().split(b'\0'):
+                    pids.append(int(entry))
+        except OSError:
+            pass
+    return pids
+
+
+def stop_service(runtime_dir):
+    for pid in find_service_pids(runtime_dir):
+        try:
+            os.kill(pid, signal.SIGTERM)
+        except ProcessLookupError:
+            pass
+
+
+def start_service(runner, env, app):
+    """Makes requests until one reaches the service, since the first ones only
+    start it and do the work themselves."""
+    socket_path = os.path.join(env['XDG_RUNTIME_DIR'], 'app', env['FLATPAK_ID'],
+                               '.flextop-service')
+    deadline = time.monotonic() + SERVICE_START_TIMEOUT
+    while True:
+        runner.run(['xdg-desktop-menu', 'install', '--mode', 'user',
+                    app['desktop_file']])
+        if os.path.exists(socket_path) and find_service_pids(env['XDG_RUNTIME_DIR']):
+            # This one may still have fallen back, but the next will connect.
+            return
+        if time.monotonic() > deadline:
+            raise ToolError('flextop-service did not start')
+        time.sleep(0.05)
+
+
+# Times single installs, the way Chromium installs a PWA at a time, run by the tool
+# itself and through the helper service. The service is only worth having if it
+# makes these faster.
+def run_latency(generator, bindir, workdir, args):
+    requests = args.latency_requests
+    inputs_dir = os.path.join(workdir, 'inputs-latency')
+    # One extra app is used to start the service.
+    apps = generator.generate_inputs(inputs_dir, requests + 1, args.icon_sizes)
+
+    results = []
+    for name, use_service in [('request-in-process', False), ('request-service', True)]:
+        home_dir = os.path.join(workdir, 'home-latency')
+        shutil.rmtree(home_dir, ignore_errors=True)
+        env = generator.generate_home(home_dir, apps, 0, shortcut_ratio=0)
+
+        runner = Runner(bindir, env)
+        runner.set_service(use_service)
+        try:
+            if use_service:
+                start_service(runner, env, apps[-1])
+
+            samples = [runner.run(['xdg-desktop-menu', 'install', '--mode', 'user',
+                                   app['desktop_file']])
+                       for app in apps[:requests]]
+        finally:
+            stop_service(env['XDG_RUNTIME_DIR'])
+
+        results.append({'scale': 1, 'scenario': name, **summarize(samples, 1)})
+
+    shutil.rmtree(inputs_dir, ignore_errors=True)
+    shutil.rmtree(os.path.join(workdir, 'home-latency'), ignore_errors=True)
+    return results
+
+
+# Times each tool from exec to exit doing next to nothing, which is mostly dynamic
+# linking and loading the Flatpak info. flextop-init runs on every browser and PWA
+# launch, so this is its floor.
+def get_startup_scenarios():
+    return [
+        ('startup-flextop-init', ['flextop-init']),
+        ('startup-xdg-desktop-menu', ['xdg-desktop-menu', 'uninstall', '--mode', 'user']),
+        ('startup-xdg-icon-resource', ['xdg-icon-resource', 'install', '--noupdate',
+                                       '--mode', 'user', '--batch']),
+    ]
+
+
+def run_startup(generator, bindir, workdir, args):
+    home_dir = os.path.join(workdir, 'home-startup')
+    env = generator.generate_home(home_dir, [], 0)
+    runner = Runner(bindir, env)
+
+    results = []
+    for name, argv in get_startup_scenarios():
+        # Leave out the first run, which sets things up and warms the page cache.
+        runner.run(argv, b'')
+        samples = [runner.run(argv, b'') for _ in range(args.startup_runs)]
+        results.append({'scale': 0, 'scenario': name, **summarize(samples, 1)})
+
+    shutil.rmtree(home_dir, ignore_errors=True)
+    return results
+
+
+def get_default_workers():
+    """Powers of two up to twice the CPUs, and at least up to 4, so that there's
+    something to compare even on small machines."""
+    limit = max(2 * (os.cpu_count() or 1), 4)
+    workers = [1]
+    while workers[-1] * 2 <= limit:
+        workers.append(workers[-1] * 2)
+    return workers
+
+
+# Times a bulk install into a fresh home with each number of workers, which shows
+# how far the worker pool scales and what it costs where it doesn't.
+def run_workers(generator, bindir, workdir, args):
+    scale = args.worker_apps
+    inputs_dir = os.path.join(workdir, 'inputs-workers')
+    apps = generator.generate_inputs(inputs_dir, scale, args.icon_sizes)
+    argv = ['xdg-desktop-menu', 'install', '--mode', 'user'] + \
+        [app['desktop_file'] for app in apps]
+
+    results = []
+    home_dir = os.path.join(workdir, 'home-workers')
+    for workers in args.workers:
+        samples = []
+        for repeat in range(args.repeat):
+            shutil.rmtree(home_dir, ignore_errors=True)
+            env = generator.generate_home(home_dir, apps, 0, shortcut_ratio=0)
+            runner = Runner(bindir, env)
+            runner.set_workers(workers)
+            samples.append(runner.run(argv))
+
+        results.append({'scale': scale, 'scenario': f'desktop-install-workers-{workers}',
+                        **summarize(samples, scale)})
+
+    shutil.rmtree(inputs_dir, ignore_errors=True)
+    shutil.rmtree(home_dir, ignore_errors=True)
+    return results
+
+
+def print_results(results, baseline):
+    baseline_wall = {}
+    for result in (baseline or {}).get('results', []):
+        baseline_wall[(result['scale'], result['scenario'])] = \
+            result['wall_ms']['median']
+
+    print(f'{"scale":>6} {"scenario":<26} {"median ms":>11} {"p95 ms":>9} '
+          f'{"us/app":>10} {"change":>8}')
+    for result in results:
+        wall = result['wall_ms']['median']
+        before = baseline_wall.get((result['scale'], result['scenario']))
+        change = f'{(wall - before) / before * 100:+.1f}%' if before else ''
+        print(f'{result["scale"]:>6} {result["scenario"]:<26} {wall:>11.2f} '
+              f'{result["wall_ms"]["p95"]:>9.2f} {result["per_app_us"]:>10.1f} '
+              f'{change:>8}')
+
+
+def parse_list(value):
+    return [int(item) for item in value.split(',') if item]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run the end-to-end benchmarks.')
+    parser.add_argument('--bindir', required=True,
+                        help='build directory containing the tools')
+    parser.add_argument('--scales', type=parse_list,
+                        default=parse_list(os.environ.get('FLEXTOP_BENCHMARK_SCALES',
+                                                          '')) or DEFAULT_SCALES,
+                        help='comma-separated numbers of PWAs to run with '
+                             '(default: $FLEXTOP_BENCHMARK_SCALES or 10,100,1000,10000)')
+    parser.add_argument('--icon-sizes', type=parse_list, default=None,
+                        help='comma-separated icon sizes per PWA')
+    parser.add_argument('--desktop-files', type=int, default=None,
+                        help='unrelated files on the Desktop (default: the scale)')
+    parser.add_argument('--repeat', type=int, default=3)
+    parser.add_argument('--latency-requests', type=int,
+                        default=DEFAULT_LATENCY_REQUESTS,
+                        help='single installs to time with and without the service')
+    parser.add_argument('--startup-runs', type=int, default=DEFAULT_STARTUP_RUNS,
+                        help='runs of each tool to time its startup with')
+    parser.add_argument('--worker-apps', type=int, default=DEFAULT_WORKER_APPS,
+                        help='desktop files to install with each number of workers')
+    parser.add_argument('--workers', type=parse_list, default=get_default_workers(),
+                        help='comma-separated numbers of workers to install with')
+    parser.add_argument('--suites', type=lambda value: value.split(','),
+                        default=SUITES,
+                        help='comma-separated suites to run (default: all of '
+                             f'{",".join(SUITES)})')
+    parser.add_argument('--output', help='where to write the results as JSON')
+    parser.add_argument('--baseline', help='earlier results to compare against')
+    parser.add_argument('--workdir', help='where to generate the homes '
+                                          '(default: a temporary directory)')
+    args = parser.parse_args()
+
+    unknown = set(args.suites) - set(SUITES)
+    if unknown:
+        parser.error(f'unknown suites: {", ".join(sorted(unknown))}')
+
+    generator = load_generator()
+    if args.icon_sizes is None:
+        args.icon_sizes = generator.DEFAULT_ICON_SIZES
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    bindir = os.path.abspath(args.bindir)
+    results = []
+    with tempfile.TemporaryDirectory(prefix='flextop-benchmark-',
+                                     dir=args.workdir) as workdir:
+        try:
+            if 'end-to-end' in args.suites:
+                if not os.access(DROP_CACHES, os.W_OK):
+                    print('Cannot drop the page cache without root, so the cold '
+                          'installs only start from a fresh home', file=sys.stderr)
+                for scale in args.scales:
+                    print(f'Running with {scale} PWAs...', file=sys.stderr)
+                    results += run_scale(generator, bindir, workdir, scale, args)
+
+            if 'latency' in args.suites:
+                print(f'Timing {args.latency_requests} single installs...',
+                      file=sys.stderr)
+                results += run_latency(generator, bindir, workdir, args)
+
+            if 'startup' in args.suites:
+                print(f'Timing startup over {args.startup_runs} runs...',
+                      file=sys.stderr)
+                results += run_startup(generator, bindir, workdir, args)
+
+            if 'workers' in args.suites:
+                print(f'Installing {args.worker_apps} desktop files with '
+                      f'{",".join(map(str, args.workers))} workers...', file=sys.stderr)
+                results += run_workers(generator, bindir, workdir, args)
+        except ToolError as e:
+            sys.exit(str(e))
+
+    print_results(results, baseline)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump({
+                'version': RESULTS_VERSION,
+                'config': {
+                    'scales': args.scales,
+                    'icon_sizes': args.icon_sizes,
+                    'desktop_files': args.desktop_files,
+                    'repeat': args.repeat,
+                    'suites': args.suites,
+                    'latency_requests': args.latency_requests,
+                    'startup_runs': args.startup_runs,
+                    'worker_apps': args.worker_apps,
+                    'workers': args.workers,
+                },
+                'results': results,
+            }, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,35 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include <gtk/gtk.h>
+
+// This is kept separate from the other tools so that they don't need to link
+// against GTK, given that they only ever need it to show this one dialog.
+int main(int argc, char **argv) {
+  g_set_prgname("flextop-access-dialog");
+
+  gtk_init(&argc, &argv);
+  GtkWidget *dialog = gtk_message_dialog_new(
+      NULL, 0, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+      "This Flatpak does not have write access to ~/.local/share/applications"
+      " and ~/.local/share/icons, so it cannot install or uninstall PWAs.\n\n"
+      "Once you grant access to those two directories (Flatseal is the easiest"
+      " method), you can attempt to re-create the shortcuts from"
+      " chrome://apps.");
+
+  gtk_dialog_run(GTK_DIALOG(dialog));
+
+  return 0;
+}
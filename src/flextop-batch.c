@@ -0,0 +1,136 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Runs the per-file work of a command over a pool of worker threads, while
+// keeping the outcome the same as running it in order: tasks that share a key
+// run one after another on the same worker, and once a task fails, the ones after
+// it are skipped unless they already started.
+
+#include "flextop-batch.h"
+
+typedef struct Batch {
+  GPtrArray *tasks;
+  BatchTaskFunc func;
+  gpointer user_data;
+
+  // The index of the earliest task that failed, or G_MAXINT.
+  int first_failure;
+  // Whether each task ran, indexed like tasks.
+  gboolean *ran;
+} Batch;
+
+static void batch_set_failed(Batch *batch, int index) {
+  int current = g_atomic_int_get(&batch->first_failure);
+  while (index < current &&
+         !g_atomic_int_compare_and_exchange(&batch->first_failure, current, index)) {
+    current = g_atomic_int_get(&batch->first_failure);
+  }
+}
+
+// Returns FALSE if the task failed or was skipped, so the rest of its chain is too.
+static gboolean batch_run_task(Batch *batch, int index) {
+  if (index > g_atomic_int_get(&batch->first_failure)) {
+    return FALSE;
+  }
+
+  batch->ran[index] = TRUE;
+  if (!batch->func(g_ptr_array_index(batch->tasks, index), batch->user_data)) {
+    batch_set_failed(batch, index);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Runs a chain of task indices sharing a key, in order.
+static void batch_run_chain(gpointer data, gpointer user_data) {
+  GArray *chain = data;
+  Batch *batch = user_data;
+
+  for (guint i = 0; i < chain->len; i++) {
+    if (!batch_run_task(batch, g_array_index(chain, int, i))) {
+      break;
+    }
+  }
+}
+
+// One worker per CPU. Builds with -Dtest_hooks=true let FLEXTOP_TEST_WORKERS set
+// the number instead, to measure how batches scale with it.
+static guint batch_get_max_workers() {
+#ifdef FLEXTOP_TEST_HOOKS
+  const char *value = g_getenv("FLEXTOP_TEST_WORKERS");
+  if (value != NULL) {
+    guint64 workers;
+    if (g_ascii_string_to_unsigned(value, 10, 1, G_MAXINT, &workers, NULL)) {
+      return workers;
+    }
+
+    g_warning("Invalid FLEXTOP_TEST_WORKERS '%s', using one per CPU", value);
+  }
+#endif
+
+  return g_get_num_processors();
+}
+
+// Runs func on every task, with up to batch_get_max_workers() workers. Returns which
+// of the tasks ran, for the caller to go over in order afterwards. Batches that
+// can't use more than one worker run on the calling thread.
+gboolean *batch_run(GPtrArray *tasks, BatchKeyFunc get_key, BatchTaskFunc func,
+                    gpointer user_data) {
+  Batch batch = {
+      .tasks = tasks,
+      .func = func,
+      .user_data = user_data,
+      .first_failure = G_MAXINT,
+      .ran = g_new0(gboolean, MAX(tasks->len, 1)),
+  };
+
+  g_autoptr(GPtrArray) chains =
+      g_ptr_array_new_with_free_func((GDestroyNotify)g_array_unref);
+  g_autoptr(GHashTable) chains_by_key = g_hash_table_new(g_str_hash, g_str_equal);
+  for (int i = 0; i < tasks->len; i++) {
+    const char *key = get_key(g_ptr_array_index(tasks, i));
+    GArray *chain = g_hash_table_lookup(chains_by_key, key);
+    if (chain == NULL) {
+      chain = g_array_new(FALSE, FALSE, sizeof(int));
+      g_ptr_array_add(chains, chain);
+      g_hash_table_insert(chains_by_key, (char *)key, chain);
+    }
+
+    g_array_append_val(chain, i);
+  }
+
+  guint n_workers = MIN(batch_get_max_workers(), chains->len);
+  if (n_workers <= 1) {
+    for (int i = 0; i < tasks->len; i++) {
+      if (!batch_run_task(&batch, i)) {
+        break;
+      }
+    }
+  } else {
+    GThreadPool *pool =
+        g_thread_pool_new(batch_run_chain, &batch, n_workers, FALSE, NULL);
+    for (int i = 0; i < chains->len; i++) {
+      g_thread_pool_push(pool, g_ptr_array_index(chains, i), NULL);
+    }
+
+    // Waits for every chain to finish.
+    g_thread_pool_free(pool, FALSE, TRUE);
+  }
+
+  g_debug("Ran %u tasks in %u chains on %u workers", tasks->len, chains->len,
+          MAX(n_workers, 1));
+  return batch.ran;
+}
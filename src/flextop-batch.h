@@ -0,0 +1,26 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <glib.h>
+
+// Returns the key that tasks have to be serialized on, e.g. the file they write.
+typedef const char *(*BatchKeyFunc)(gpointer task);
+// Runs a single task, returning FALSE if it failed.
+typedef gboolean (*BatchTaskFunc)(gpointer task, gpointer user_data);
+
+gboolean *batch_run(GPtrArray *tasks, BatchKeyFunc get_key, BatchTaskFunc func,
+                    gpointer user_data);
@@ -0,0 +1,661 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "flextop-desktop-menu.h"
+#include "flextop-batch.h"
+#include "flextop-desktop-rewrite.h"
+#include "flextop-icon-cache.h"
+#include "flextop-icon-store.h"
+#include "flextop-lock.h"
+#include "flextop-manifest.h"
+#include "flextop-mime-cache.h"
+#include "flextop-trace.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static MimeCache *load_mime_cache(DataDir *host) {
+  g_autoptr(GError) error = NULL;
+  MimeCache *mime_cache = mime_cache_load(host, &error);
+  if (mime_cache == NULL) {
+    g_warning("Failed to load MIME cache: %s", error->message);
+  }
+
+  return mime_cache;
+}
+
+static void save_mime_cache(MimeCache *mime_cache) {
+  g_autoptr(GError) error = NULL;
+  if (mime_cache != NULL && !mime_cache_save(mime_cache, &error)) {
+    g_warning("Failed to save MIME cache: %s", error->message);
+  }
+}
+
+typedef struct InstallContext {
+  FlatpakInfo *info;
+  DataDir *host;
+  const char *desktop_dir;
+  Durability durability;
+} InstallContext;
+
+typedef struct InstallTask {
+  const char *path;
+  char *prefixed_filename;
+
+  // Set by install_one().
+  DesktopFileRewrite rewrite;
+  gboolean written;
+  GPtrArray *warnings;
+  GError *error;
+} InstallTask;
+
+static void install_task_free(InstallTask *task) {
+  g_free(task->prefixed_filename);
+  desktop_file_rewrite_clear(&task->rewrite);
+  g_ptr_array_unref(task->warnings);
+  g_clear_error(&task->error);
+  g_free(task);
+}
+
+static const char *install_task_get_key(gpointer data) {
+  InstallTask *task = data;
+  return task->prefixed_filename;
+}
+
+// Does the part of installing a file that only touches that file, so it can run on
+// a worker thread. Updating the caches and reporting the results is left to
+// desktop_menu_install(), which goes over the files in order.
+static gboolean install_one(gpointer data, gpointer user_data) {
+  InstallTask *task = data;
+  InstallContext *context = user_data;
+  FlatpakInfo *info = context->info;
+  g_autoptr(TraceSpan) span = trace_span_begin("install_one", task->path);
+  g_autofree char *unprefixed_filename = g_path_get_basename(task->path);
+
+  if (context->desktop_dir == NULL) {
+    // Without a Desktop, there's no shortcut to clean up.
+    g_debug("No Desktop to check for %s", unprefixed_filename);
+  } else {
+    g_autofree char *file_on_desktop =
+        g_build_filename(context->desktop_dir, unprefixed_filename, NULL);
+    g_debug("Corresponding file on desktop: %s", file_on_desktop);
+    if (access(file_on_desktop, R_OK) != -1) {
+      g_autoptr(GError) local_error = NULL;
+      if (!delete_maybe_invalid_desktop_file(file_on_desktop, &local_error)) {
+        g_ptr_array_add(task->warnings,
+                        g_strdup_printf("Failed to check desktop file: %s",
+                                        local_error->message));
+      }
+    }
+  }
+
+  if (!desktop_file_rewrite(task->path, info, &task->rewrite, task->warnings,
+                            &task->error)) {
+    return FALSE;
+  }
+
+  g_autofree char *dest = g_build_filename(g_file_peek_path(context->host->applications),
+                                           task->prefixed_filename, NULL);
+  const char *contents = task->rewrite.contents->str;
+  gsize length = task->rewrite.contents->len;
+  if (file_has_contents(dest, contents, length)) {
+    g_debug("%s is unchanged", dest);
+  } else if (!write_file_with_durability(dest, contents, length, context->durability,
+                                         &task->error)) {
+    return FALSE;
+  } else {
+    task->written = TRUE;
+  }
+
+  return TRUE;
+}
+
+gboolean desktop_menu_install(GPtrArray *paths, FlatpakInfo *info, DataDir *host,
+                              GError **error) {
+  if (!mkdir_with_parents_exists_ok(host->applications, error)) {
+    return FALSE;
+  }
+
+  g_autoptr(GError) manifest_error = NULL;
+  g_autoptr(Manifest) manifest = manifest_load(&manifest_error);
+  if (manifest == NULL) {
+    g_warning("Failed to load install manifest: %s", manifest_error->message);
+  }
+
+  g_autoptr(MimeCache) mime_cache = load_mime_cache(host);
+
+  InstallContext context = {
+      .info = info,
+      .host = host,
+      .desktop_dir = client_get_desktop_dir(),
+      .durability = get_durability(),
+  };
+
+  g_autoptr(GPtrArray) tasks =
+      g_ptr_array_new_with_free_func((GDestroyNotify)install_task_free);
+  for (int i = 0; i < paths->len; i++) {
+    const char *path = g_ptr_array_index(paths, i);
+    g_autofree char *unprefixed_filename = g_path_get_basename(path);
+
+    InstallTask *task = g_new0(InstallTask, 1);
+    task->path = path;
+    task->prefixed_filename =
+        flatpak_info_add_desktop_file_prefix(info, unprefixed_filename);
+    task->warnings = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(tasks, task);
+  }
+
+  // Files with the same name end up at the same destination, so batch_run() keeps
+  // those in order.
+  g_autofree gboolean *ran =
+      batch_run(tasks, install_task_get_key, install_one, &context);
+
+  // Any file written after a failure is still recorded, since it's on disk now.
+  gboolean success = TRUE;
+  guint written = 0, unchanged = 0;
+  for (int i = 0; i < tasks->len; i++) {
+    InstallTask *task = g_ptr_array_index(tasks, i);
+    if (!ran[i]) {
+      continue;
+    }
+
+    for (int j = 0; j < task->warnings->len; j++) {
+      g_warning("%s", (const char *)g_ptr_array_index(task->warnings, j));
+    }
+
+    if (task->error != NULL) {
+      if (success) {
+        g_propagate_error(error, g_steal_pointer(&task->error));
+        success = FALSE;
+      }
+
+      continue;
+    }
+
+    if (task->written) {
+      written++;
+    } else {
+      unchanged++;
+    }
+
+    if (mime_cache != NULL) {
+      mime_cache_set_desktop_file(mime_cache, task->prefixed_filename,
+                                  (char **)task->rewrite.mime_types->pdata);
+    }
+
+    if (manifest != NULL) {
+      g_autoptr(GError) local_error = NULL;
+      if (!manifest_add_desktop_file(manifest, task->prefixed_filename,
+                                     task->rewrite.icon, &local_error)) {
+        g_warning("Failed to record %s: %s", task->prefixed_filename,
+                  local_error->message);
+      }
+    }
+  }
+
+  g_debug("Desktop files written: %u, unchanged: %u", written, unchanged);
+
+  // The files installed before any failure still need their MIME types and
+  // durability taken care of.
+  save_mime_cache(mime_cache);
+
+  if (written > 0) {
+    g_autoptr(GError) sync_error = NULL;
+    if (!finish_batch_with_durability(host->applications, context.durability,
+                                      &sync_error)) {
+      if (success) {
+        g_propagate_error(error, g_steal_pointer(&sync_error));
+        return FALSE;
+      }
+
+      g_warning("%s", sync_error->message);
+    }
+  }
+
+  return success;
+}
+
+// Returns the paths of every size of the icon in the hicolor theme. The candidates
+// are checked relative to the theme directory, rather than each by its full path.
+static GPtrArray *find_all_files_for_app_icon(DataDir *host, int hicolor_fd,
+                                              const char *icon, GPtrArray *warnings) {
+  g_autoptr(GPtrArray) result = g_ptr_array_new_with_free_func(g_free);
+
+  // XXX: We're tied to .png icons for now.
+  g_autofree char *icon_filename = g_strdup_printf("%s.png", icon);
+
+  // The O_PATH fd can't be listed, so that needs one of its own.
+  int list_fd = openat(hicolor_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *size_dirs = list_fd != -1 ? fdopendir(list_fd) : NULL;
+  if (size_dirs == NULL) {
+    int err = errno;
+    if (list_fd != -1) {
+      close(list_fd);
+    }
+
+    g_ptr_array_add(warnings, g_strdup_printf("Failed to iterate over icon size dirs: %s",
+                                              g_strerror(err)));
+    return g_steal_pointer(&result);
+  }
+
+  for (;;) {
+    errno = 0;
+    struct dirent *dent = readdir(size_dirs);
+    if (dent == NULL) {
+      if (errno != 0) {
+        g_ptr_array_add(warnings,
+                        g_strdup_printf("Failed to continue iteration over icon size "
+                                        "dirs: %s",
+                                        g_strerror(errno)));
+      }
+
+      break;
+    }
+
+    if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+      continue;
+    }
+
+    struct stat st;
+    if (dent->d_type == DT_UNKNOWN) {
+      if (fstatat(hicolor_fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+          !S_ISDIR(st.st_mode)) {
+        continue;
+      }
+    } else if (dent->d_type != DT_DIR) {
+      continue;
+    }
+
+    g_autofree char *relative =
+        g_build_filename(dent->d_name, "apps", icon_filename, NULL);
+    if (fstatat(hicolor_fd, relative, &st, 0) == 0) {
+      g_ptr_array_add(result, g_build_filename(g_file_peek_path(host->icons), "hicolor",
+                                               relative, NULL));
+    }
+  }
+
+  closedir(size_dirs);
+  return g_steal_pointer(&result);
+}
+
+static void remove_icon_file(DataDir *host, const char *path, GPtrArray *warnings) {
+  g_autoptr(GError) error = NULL;
+  if (!icon_store_remove(host, path, &error)) {
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+      g_ptr_array_add(warnings, g_strdup_printf("Unexpected error removing icon %s: %s",
+                                                path, error->message));
+    }
+  }
+}
+
+typedef struct UninstallContext {
+  DataDir *host;
+  // Whether files that are already gone count as uninstalled.
+  gboolean missing_ok;
+  // Opened up front, since the workers can't open them lazily. -1 if they don't
+  // exist.
+  int applications_fd;
+  int hicolor_fd;
+} UninstallContext;
+
+typedef struct UninstallTask {
+  char *prefixed_filename;
+
+  // Whether the manifest has the file, in which case icon and icon_paths are what
+  // it recorded (icon is "" if there was none). Files installed before the manifest
+  // existed still need the theme scanned for their icon.
+  gboolean recorded;
+  char *icon;
+  GPtrArray *icon_paths;
+
+  // Set by uninstall_one().
+  gboolean removed_recorded_icons;
+  gboolean removed_icons;
+  GPtrArray *warnings;
+  GError *error;
+} UninstallTask;
+
+static void uninstall_task_free(UninstallTask *task) {
+  g_free(task->prefixed_filename);
+  g_free(task->icon);
+  g_clear_pointer(&task->icon_paths, g_ptr_array_unref);
+  g_ptr_array_unref(task->warnings);
+  g_clear_error(&task->error);
+  g_free(task);
+}
+
+static const char *uninstall_task_get_key(gpointer data) {
+  UninstallTask *task = data;
+  return task->prefixed_filename;
+}
+
+static gboolean uninstall_unrecorded_icons(UninstallContext *context, UninstallTask *task,
+                                           const char *path) {
+  g_autoptr(GKeyFile) key_file = g_key_file_new();
+  if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, &task->error)) {
+    return FALSE;
+  }
+
+  g_autofree char *icon_name = g_key_file_get_string(key_file, G_KEY_FILE_DESKTOP_GROUP,
+                                                     G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+  if (icon_name != NULL && context->hicolor_fd != -1) {
+    g_autoptr(GPtrArray) icons = find_all_files_for_app_icon(
+        context->host, context->hicolor_fd, icon_name, task->warnings);
+    for (int i = 0; i < icons->len; i++) {
+      remove_icon_file(context->host, g_ptr_array_index(icons, i), task->warnings);
+    }
+
+    task->removed_icons |= icons->len > 0;
+  }
+
+  return TRUE;
+}
+
+// Removes a single desktop file and its icons, on a worker thread. Updating the
+// manifest and caches is left to desktop_menu_uninstall(), which goes over the
+// files in order.
+static gboolean uninstall_one(gpointer data, gpointer user_data) {
+  UninstallTask *task = data;
+  UninstallContext *context = user_data;
+  DataDir *host = context->host;
+  g_autoptr(TraceSpan) span = trace_span_begin("uninstall_one", task->prefixed_filename);
+
+  struct stat st;
+  gboolean exists =
+      context->applications_fd != -1 &&
+      fstatat(context->applications_fd, task->prefixed_filename, &st, 0) == 0;
+  if (!exists && !context->missing_ok) {
+    g_set_error(&task->error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                "Desktop file %s does not exist", task->prefixed_filename);
+    return FALSE;
+  }
+
+  if (task->recorded) {
+    // Removes the icon files the manifest recorded, without having to look
+    // through the icon theme.
+    for (int i = 0; i < task->icon_paths->len; i++) {
+      remove_icon_file(host, g_ptr_array_index(task->icon_paths, i), task->warnings);
+    }
+
+    task->removed_recorded_icons = TRUE;
+    task->removed_icons = task->icon_paths->len > 0;
+  } else if (exists) {
+    g_autofree char *path = g_build_filename(g_file_peek_path(host->applications),
+                                             task->prefixed_filename, NULL);
+    if (!uninstall_unrecorded_icons(context, task, path)) {
+      return FALSE;
+    }
+  }
+
+  if (exists && unlinkat(context->applications_fd, task->prefixed_filename, 0) == -1 &&
+      !(errno == ENOENT && context->missing_ok)) {
+    int err = errno;
+    g_set_error(&task->error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to delete %s: %s", task->prefixed_filename, g_strerror(err));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Copies the icon files the manifest recorded for the icon, since the records get
+// removed while they're being iterated over. Returns NULL if there are none.
+static GPtrArray *get_recorded_icon_paths(Manifest *manifest, const char *icon) {
+  GHashTable *recorded = manifest_get_icon_files(manifest, icon);
+  if (recorded == NULL) {
+    return NULL;
+  }
+
+  GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+  GHashTableIter iter;
+  gpointer path;
+  g_hash_table_iter_init(&iter, recorded);
+  while (g_hash_table_iter_next(&iter, &path, NULL)) {
+    g_ptr_array_add(paths, g_strdup(path));
+  }
+
+  return paths;
+}
+
+// If missing_ok, files that are already gone still have any icons the manifest
+// recorded for them removed, which finishes off an uninstall that was interrupted.
+gboolean desktop_menu_uninstall(GPtrArray *filenames, gboolean missing_ok,
+                                FlatpakInfo *info, DataDir *host, GError **error) {
+  g_autoptr(GError) manifest_error = NULL;
+  g_autoptr(Manifest) manifest = manifest_load(&manifest_error);
+  if (manifest == NULL) {
+    g_warning("Failed to load install manifest: %s", manifest_error->message);
+  }
+
+  g_autoptr(MimeCache) mime_cache = load_mime_cache(host);
+
+  UninstallContext context = {
+      .host = host,
+      .missing_ok = missing_ok,
+      .applications_fd = data_dir_get_fd(host, DATA_DIR_APPLICATIONS, NULL),
+      .hicolor_fd = data_dir_get_fd(host, DATA_DIR_HICOLOR, NULL),
+  };
+
+  // The manifest is only read here and written below, never by the workers. An icon
+  // shared by several files is only removed by the first, which is all that
+  // removing them in order would have done too.
+  g_autoptr(GHashTable) claimed_icons = g_hash_table_new(g_str_hash, g_str_equal);
+  g_autoptr(GPtrArray) tasks =
+      g_ptr_array_new_with_free_func((GDestroyNotify)uninstall_task_free);
+  for (int i = 0; i < filenames->len; i++) {
+    const char *filename = g_ptr_array_index(filenames, i);
+
+    UninstallTask *task = g_new0(UninstallTask, 1);
+    task->prefixed_filename = flatpak_info_add_desktop_file_prefix(info, filename);
+    task->warnings = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(tasks, task);
+
+    // Updating the manifest can reload it, so nothing can point into it.
+    const char *icon = NULL;
+    if (manifest != NULL &&
+        manifest_lookup_desktop_file(manifest, task->prefixed_filename, &icon)) {
+      task->recorded = TRUE;
+      task->icon = g_strdup(icon);
+      if (*task->icon != '\0' && !g_hash_table_contains(claimed_icons, task->icon)) {
+        g_hash_table_add(claimed_icons, task->icon);
+        task->icon_paths = get_recorded_icon_paths(manifest, task->icon);
+      }
+
+      if (task->icon_paths == NULL) {
+        task->icon_paths = g_ptr_array_new_with_free_func(g_free);
+      }
+    }
+  }
+
+  g_autofree gboolean *ran =
+      batch_run(tasks, uninstall_task_get_key, uninstall_one, &context);
+
+  // Even after a failure, the files removed so far need the caches updated.
+  gboolean success = TRUE;
+  gboolean removed_icons = FALSE;
+  for (int i = 0; i < tasks->len; i++) {
+    UninstallTask *task = g_ptr_array_index(tasks, i);
+    if (!ran[i]) {
+      continue;
+    }
+
+    for (int j = 0; j < task->warnings->len; j++) {
+      g_warning("%s", (const char *)g_ptr_array_index(task->warnings, j));
+    }
+
+    removed_icons |= task->removed_icons;
+    if (manifest != NULL && task->removed_recorded_icons) {
+      for (int j = 0; j < task->icon_paths->len; j++) {
+        const char *path = g_ptr_array_index(task->icon_paths, j);
+        g_autoptr(GError) local_error = NULL;
+        if (!manifest_remove_icon_file(manifest, task->icon, path, &local_error)) {
+          g_warning("Failed to record removal of %s: %s", path, local_error->message);
+        }
+      }
+    }
+
+    if (task->error != NULL) {
+      if (success) {
+        g_propagate_error(error, g_steal_pointer(&task->error));
+        success = FALSE;
+      }
+
+      continue;
+    }
+
+    if (mime_cache != NULL) {
+      mime_cache_set_desktop_file(mime_cache, task->prefixed_filename, NULL);
+    }
+
+    if (manifest != NULL) {
+      g_autoptr(GError) local_error = NULL;
+      if (!manifest_remove_desktop_file(manifest, task->prefixed_filename,
+                                        &local_error)) {
+        g_warning("Failed to record removal of %s: %s", task->prefixed_filename,
+                  local_error->message);
+      }
+    }
+  }
+
+  save_mime_cache(mime_cache);
+
+  if (removed_icons) {
+    g_autoptr(GError) local_error = NULL;
+    if (!icon_cache_update(host, FALSE, &local_error)) {
+      g_warning("Failed to update icon cache: %s", local_error->message);
+      g_clear_error(&local_error);
+    }
+
+    // Also picks up any blobs that earlier, interrupted uninstalls left behind.
+    if (!icon_store_collect_garbage(host, &local_error)) {
+      g_warning("Failed to clean up icon store: %s", local_error->message);
+    }
+  }
+
+  return success;
+}
+
+gboolean desktop_menu_rebuild_manifest(FlatpakInfo *info, DataDir *host, GError **error) {
+  g_autoptr(Manifest) manifest = manifest_load(error);
+  if (manifest == NULL) {
+    return FALSE;
+  }
+
+  return manifest_rebuild(manifest, info, host, error);
+}
+
+gboolean desktop_menu_parse_args(int argc, char **argv, DesktopMenuCommand *out_command,
+                                 GPtrArray *out_files) {
+  if (argc == 2 && strcmp(argv[1], "rebuild-manifest") == 0) {
+    *out_command = DESKTOP_MENU_COMMAND_REBUILD_MANIFEST;
+    return TRUE;
+  }
+
+  if (argc < 4) {
+    g_warning("usage: xdg-desktop-menu install|uninstall --mode user app.desktop...\n"
+              "       xdg-desktop-menu rebuild-manifest");
+    return FALSE;
+  }
+
+  const char *command = argv[1];
+  if (strcmp(command, "install") == 0) {
+    *out_command = DESKTOP_MENU_COMMAND_INSTALL;
+  } else if (strcmp(command, "uninstall") == 0) {
+    *out_command = DESKTOP_MENU_COMMAND_UNINSTALL;
+  } else {
+    g_warning("Unknown command: %s", command);
+    return FALSE;
+  }
+
+  for (int i = 4; i < argc; i++) {
+    if (g_str_has_suffix(argv[i], ".desktop")) {
+      g_ptr_array_add(out_files, argv[i]);
+    }
+  }
+
+  return TRUE;
+}
+
+// Builds the command line to send to the service, which doesn't share our working
+// directory, so the files to install are given by their absolute paths.
+GStrv desktop_menu_build_service_argv(DesktopMenuCommand command, GPtrArray *files) {
+  GPtrArray *argv = g_ptr_array_new();
+  g_ptr_array_add(argv, g_strdup("xdg-desktop-menu"));
+
+  switch (command) {
+  case DESKTOP_MENU_COMMAND_INSTALL:
+  case DESKTOP_MENU_COMMAND_UNINSTALL:
+    g_ptr_array_add(argv, g_strdup(command == DESKTOP_MENU_COMMAND_INSTALL
+                                       ? "install"
+                                       : "uninstall"));
+    g_ptr_array_add(argv, g_strdup("--mode"));
+    g_ptr_array_add(argv, g_strdup("user"));
+    for (int i = 0; i < files->len; i++) {
+      const char *file = g_ptr_array_index(files, i);
+      g_ptr_array_add(argv, command == DESKTOP_MENU_COMMAND_INSTALL
+                                ? g_canonicalize_filename(file, NULL)
+                                : g_strdup(file));
+    }
+    break;
+  case DESKTOP_MENU_COMMAND_REBUILD_MANIFEST:
+    g_ptr_array_add(argv, g_strdup("rebuild-manifest"));
+    break;
+  }
+
+  g_ptr_array_add(argv, NULL);
+  return (GStrv)g_ptr_array_free(argv, FALSE);
+}
+
+int desktop_menu_run(DesktopMenuCommand command, GPtrArray *files, gboolean missing_ok,
+                     FlatpakInfo *info, DataDir *host) {
+  g_autoptr(GError) error = NULL;
+  g_autoptr(TraceSpan) span = trace_span_begin("desktop_menu_run", NULL);
+
+  // Only flextop-init relinking or migrating the applications folder takes this
+  // exclusively, so separate installs and uninstalls don't wait on each other.
+  g_auto(LockFd) lock = lock_acquire_applications(info, LOCK_MODE_SHARED, &error);
+  if (lock == -1) {
+    g_warning("%s", error->message);
+    return 1;
+  }
+
+  gboolean success = FALSE;
+  const char *command_name = NULL;
+  switch (command) {
+  case DESKTOP_MENU_COMMAND_INSTALL:
+    command_name = "install file";
+    success = desktop_menu_install(files, info, host, &error);
+    break;
+  case DESKTOP_MENU_COMMAND_UNINSTALL:
+    command_name = "uninstall file";
+    success = desktop_menu_uninstall(files, missing_ok, info, host, &error);
+    break;
+  case DESKTOP_MENU_COMMAND_REBUILD_MANIFEST:
+    command_name = "rebuild manifest";
+    success = desktop_menu_rebuild_manifest(info, host, &error);
+    break;
+  }
+
+  if (!success) {
+    g_warning("Failed to %s: %s", command_name, error->message);
+    return 1;
+  }
+
+  return 0;
+}
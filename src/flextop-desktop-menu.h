@@ -0,0 +1,37 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "flextop-utils.h"
+
+typedef enum {
+  DESKTOP_MENU_COMMAND_INSTALL,
+  DESKTOP_MENU_COMMAND_UNINSTALL,
+  DESKTOP_MENU_COMMAND_REBUILD_MANIFEST,
+} DesktopMenuCommand;
+
+gboolean desktop_menu_parse_args(int argc, char **argv, DesktopMenuCommand *out_command,
+                                 GPtrArray *out_files);
+GStrv desktop_menu_build_service_argv(DesktopMenuCommand command, GPtrArray *files);
+
+gboolean desktop_menu_install(GPtrArray *paths, FlatpakInfo *info, DataDir *host,
+                              GError **error);
+gboolean desktop_menu_uninstall(GPtrArray *filenames, gboolean missing_ok,
+                                FlatpakInfo *info, DataDir *host, GError **error);
+gboolean desktop_menu_rebuild_manifest(FlatpakInfo *info, DataDir *host, GError **error);
+
+int desktop_menu_run(DesktopMenuCommand command, GPtrArray *files, gboolean missing_ok,
+                     FlatpakInfo *info, DataDir *host);
@@ -0,0 +1,731 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Rewrites the desktop files Chromium gives us so they launch through Flatpak.
+// Only the Exec, TryExec and X-Flatpak-Part-Of keys change, so instead of
+// parsing the whole file into a GKeyFile and serializing it again, the lines are
+// copied through in a single pass and just those keys are replaced.
+//
+// The output has to be exactly what the GKeyFile round trip would produce, so
+// that rewriting an installed file is still recognized as unchanged. The
+// streaming path therefore only handles files where that's easy to guarantee,
+// and anything unusual (escape sequences in the keys it reads, indented keys,
+// duplicate groups, etc.) falls back to GKeyFile. Where GKeyFile puts the keys it
+// adds has changed between GLib versions, so that's checked once at runtime.
+
+#include "flextop-desktop-rewrite.h"
+
+#include <string.h>
+
+#define DESKTOP_ACTION_GROUP_PREFIX "Desktop Action "
+
+// Appends str quoted the same way as g_shell_quote, without allocating a copy of
+// it first.
+static void append_shell_quoted(GString *out, const char *str) {
+  g_string_append_c(out, '\'');
+
+  for (const char *quote = strchr(str, '\''); quote != NULL;
+       quote = strchr(str, '\'')) {
+    g_string_append_len(out, str, quote - str);
+    g_string_append(out, "'\\''");
+    str = quote + 1;
+  }
+
+  g_string_append(out, str);
+  g_string_append_c(out, '\'');
+}
+
+// Builds the Exec command that runs the given one through Flatpak. Returns TRUE
+// with a NULL out_command if the key should be left alone.
+gboolean desktop_file_build_exec_command(const char *exec, const char *section,
+                                         FlatpakInfo *info, GPtrArray *warnings,
+                                         char **out_command, GError **error) {
+  int argc;
+  g_auto(GStrv) argv = NULL;
+
+  *out_command = NULL;
+
+  if (exec == NULL) {
+    g_ptr_array_add(warnings, g_strdup_printf("Missing Exec key in %s", section));
+    return TRUE;
+  }
+
+  if (!g_shell_parse_argv(exec, &argc, &argv, error)) {
+    g_prefix_error(error, "Getting command of %s: ", section);
+    return FALSE;
+  }
+
+  if (argc < 1) {
+    g_ptr_array_add(warnings, g_strdup_printf("Empty Exec key in %s", section));
+    return TRUE;
+  }
+
+  // Don't quote the "flatpak" binary name, which messes with GNOME Shell trying to
+  // ignore the name from searches.
+  GString *command = g_string_sized_new(strlen(exec) + strlen(info->exec_app_arg) + 64);
+  g_string_append(command, "flatpak 'run' ");
+
+  g_autofree char *command_arg = g_strconcat("--command=", argv[0], NULL);
+  append_shell_quoted(command, command_arg);
+  g_string_append_c(command, ' ');
+  g_string_append(command, info->exec_app_arg);
+
+  for (int i = 1; i < argc; i++) {
+    g_string_append_c(command, ' ');
+    append_shell_quoted(command, argv[i]);
+  }
+
+  *out_command = g_string_free(command, FALSE);
+  return TRUE;
+}
+
+static void add_try_exec_warning(FlatpakInfo *info, GPtrArray *warnings) {
+  if (info->wrapper_exe == NULL) {
+    g_ptr_array_add(warnings, g_strdup_printf("Could not detect installation root for %s",
+                                              info->app));
+  }
+}
+
+static gboolean rewrite_with_key_file(const char *path, const char *data, gsize length,
+                                      FlatpakInfo *info, DesktopFileRewrite *rewrite,
+                                      GPtrArray *warnings, GError **error) {
+  g_autoptr(GKeyFile) key_file = g_key_file_new();
+  if (!g_key_file_load_from_data(key_file, data, length,
+                                 G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS,
+                                 error)) {
+    g_prefix_error(error, "Loading %s: ", path);
+    return FALSE;
+  }
+
+  g_key_file_set_string(key_file, G_KEY_FILE_DESKTOP_GROUP, DESKTOP_KEY_X_FLATPAK_PART_OF,
+                        info->app);
+
+  g_auto(GStrv) actions = g_key_file_get_string_list(
+      key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ACTIONS, NULL, NULL);
+  g_autoptr(GPtrArray) sections = g_ptr_array_new_with_free_func(g_free);
+  g_ptr_array_add(sections, g_strdup(G_KEY_FILE_DESKTOP_GROUP));
+  for (char **action = actions; action != NULL && *action != NULL; action++) {
+    g_ptr_array_add(sections, g_strconcat(DESKTOP_ACTION_GROUP_PREFIX, *action, NULL));
+  }
+
+  for (int i = 0; i < sections->len; i++) {
+    const char *section = g_ptr_array_index(sections, i);
+    g_autofree char *exec =
+        g_key_file_get_string(key_file, section, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
+    g_autofree char *command = NULL;
+    if (!desktop_file_build_exec_command(exec, section, info, warnings, &command,
+                                         error)) {
+      return FALSE;
+    }
+
+    if (command != NULL) {
+      g_key_file_set_string(key_file, section, G_KEY_FILE_DESKTOP_KEY_EXEC, command);
+    }
+
+    if (i == 0) {
+      add_try_exec_warning(info, warnings);
+      if (info->wrapper_exe != NULL) {
+        g_key_file_set_string(key_file, G_KEY_FILE_DESKTOP_GROUP,
+                              G_KEY_FILE_DESKTOP_KEY_TRY_EXEC, info->wrapper_exe);
+      }
+    }
+  }
+
+  gsize contents_length;
+  g_autofree char *contents = g_key_file_to_data(key_file, &contents_length, NULL);
+  g_string_append_len(rewrite->contents, contents, contents_length);
+
+  g_autofree char *icon = g_key_file_get_string(key_file, G_KEY_FILE_DESKTOP_GROUP,
+                                                G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+  if (icon != NULL) {
+    rewrite->icon = g_string_chunk_insert(rewrite->arena, icon);
+  }
+
+  g_auto(GStrv) mime_types =
+      g_key_file_get_string_list(key_file, G_KEY_FILE_DESKTOP_GROUP,
+                                 G_KEY_FILE_DESKTOP_KEY_MIME_TYPE, NULL, NULL);
+  for (char **mime_type = mime_types; mime_type != NULL && *mime_type != NULL;
+       mime_type++) {
+    g_ptr_array_add(rewrite->mime_types,
+                    g_string_chunk_insert(rewrite->arena, *mime_type));
+  }
+
+  return TRUE;
+}
+
+typedef enum {
+  // 0 is reserved for g_once_init_enter().
+  KEY_PLACEMENT_UNKNOWN = 1,
+  // After everything in the group, including trailing blank lines and comments.
+  KEY_PLACEMENT_END,
+  // After the group's last key, before its trailing blank lines and comments.
+  KEY_PLACEMENT_AFTER_LAST_KEY,
+} KeyPlacement;
+
+// Finds out where this GLib's GKeyFile adds new keys to an existing group. If
+// it's neither of the known places, the streaming path is never used.
+static KeyPlacement get_key_placement() {
+  static gsize placement = 0;
+
+  if (g_once_init_enter(&placement)) {
+    static const char probe[] = "[A]\nx=1\n# c\n\n[B]\n";
+    KeyPlacement result = KEY_PLACEMENT_UNKNOWN;
+
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    if (g_key_file_load_from_data(key_file, probe, sizeof(probe) - 1,
+                                  G_KEY_FILE_KEEP_COMMENTS, NULL)) {
+      g_key_file_set_string(key_file, "A", "y", "2");
+      g_autofree char *data = g_key_file_to_data(key_file, NULL, NULL);
+      if (g_strcmp0(data, "[A]\nx=1\n# c\n\ny=2\n\n[B]\n") == 0) {
+        result = KEY_PLACEMENT_END;
+      } else if (g_strcmp0(data, "[A]\nx=1\ny=2\n# c\n\n[B]\n") == 0) {
+        result = KEY_PLACEMENT_AFTER_LAST_KEY;
+      } else {
+        g_debug("GKeyFile adds keys in an unexpected place, not streaming rewrites");
+      }
+    }
+
+    g_once_init_leave(&placement, result);
+  }
+
+  return placement;
+}
+
+typedef enum {
+  GROUP_NONE,
+  GROUP_MAIN,
+  GROUP_ACTION,
+  GROUP_OTHER,
+} GroupKind;
+
+typedef struct Rewriter {
+  FlatpakInfo *info;
+  DesktopFileRewrite *rewrite;
+  GPtrArray *warnings;
+
+  // Group names seen so far, since GKeyFile merges duplicate groups.
+  GHashTable *groups;
+  // The listed actions in order, and which of them had their Exec key seen.
+  GPtrArray *actions;
+  GHashTable *actions_with_exec;
+
+  KeyPlacement key_placement;
+  gboolean seen_main;
+  GroupKind kind;
+  const char *group;
+  // The length of the output up to the current group's header or last key.
+  gsize group_keys_end;
+
+  // The keys read or edited in the current group, which must not be duplicated,
+  // since GKeyFile would only use the last one.
+  gboolean has_exec;
+  gboolean has_try_exec;
+  gboolean has_part_of;
+  gboolean has_actions;
+  gboolean has_icon;
+  gboolean has_mime_types;
+} Rewriter;
+
+// Appends the value the way g_key_file_set_string() would escape it.
+static void append_escaped(GString *out, const char *value) {
+  for (const char *p = value; *p != '\0'; p++) {
+    switch (*p) {
+    case ' ':
+      g_string_append(out, p == value ? "\\s" : " ");
+      break;
+    case '\t':
+      g_string_append(out, p == value ? "\\t" : "\t");
+      break;
+    case '\n':
+      g_string_append(out, "\\n");
+      break;
+    case '\r':
+      g_string_append(out, "\\r");
+      break;
+    case '\\':
+      g_string_append(out, "\\\\");
+      break;
+    default:
+      g_string_append_c(out, *p);
+      break;
+    }
+  }
+}
+
+static void append_key(GString *out, const char *key, gsize key_length, const char *value,
+                       gsize value_length) {
+  g_string_append_len(out, key, key_length);
+  g_string_append_c(out, '=');
+  g_string_append_len(out, value, value_length);
+  g_string_append_c(out, '\n');
+}
+
+static void append_escaped_key(GString *out, const char *key, const char *value) {
+  g_string_append(out, key);
+  g_string_append_c(out, '=');
+  append_escaped(out, value);
+  g_string_append_c(out, '\n');
+}
+
+static gboolean is_ascii_key_char(char c) { return g_ascii_isalnum(c) || c == '-'; }
+
+// A conservative subset of what GKeyFile accepts as a key: ASCII letters, digits
+// and dashes, optionally followed by a [locale].
+static gboolean is_simple_key(const char *key, gsize length) {
+  gsize i = 0;
+  while (i < length && is_ascii_key_char(key[i])) {
+    i++;
+  }
+
+  if (i == 0) {
+    return FALSE;
+  } else if (i == length) {
+    return TRUE;
+  } else if (key[i] != '[' || key[length - 1] != ']' || i + 2 == length) {
+    return FALSE;
+  }
+
+  for (i++; i < length - 1; i++) {
+    if (!g_ascii_isalnum(key[i]) && strchr("-_.@", key[i]) == NULL) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean key_equals(const char *key, gsize length, const char *expected) {
+  return strlen(expected) == length && memcmp(key, expected, length) == 0;
+}
+
+// Splits a list value the way g_key_file_get_string_list() would, for values
+// without escapes: "a;b;" and "a;b" are both [a, b], but ";" is [""]. The items
+// are added to the arena.
+static void split_list(Rewriter *rewriter, const char *value, gsize length,
+                       GPtrArray *out_items) {
+  const char *end = value + length;
+  const char *item = value;
+  for (;;) {
+    const char *separator = memchr(item, ';', end - item);
+    if (separator == NULL) {
+      if (item < end) {
+        g_ptr_array_add(out_items, g_string_chunk_insert_len(rewriter->rewrite->arena,
+                                                             item, end - item));
+      }
+
+      break;
+    }
+
+    g_ptr_array_add(out_items, g_string_chunk_insert_len(rewriter->rewrite->arena, item,
+                                                         separator - item));
+    item = separator + 1;
+  }
+}
+
+// Adds the keys GKeyFile would have added to the main group, wherever it would
+// have put them.
+static void finish_group(Rewriter *rewriter) {
+  if (rewriter->kind != GROUP_MAIN) {
+    return;
+  }
+
+  FlatpakInfo *info = rewriter->info;
+  GString *out = rewriter->rewrite->contents;
+  gsize group_end = out->len;
+  if (!rewriter->has_part_of) {
+    append_escaped_key(out, DESKTOP_KEY_X_FLATPAK_PART_OF, info->app);
+  }
+
+  if (!rewriter->has_exec) {
+    g_ptr_array_add(rewriter->warnings,
+                    g_strdup_printf("Missing Exec key in %s", G_KEY_FILE_DESKTOP_GROUP));
+  }
+
+  add_try_exec_warning(info, rewriter->warnings);
+  if (!rewriter->has_try_exec && info->wrapper_exe != NULL) {
+    append_escaped_key(out, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC, info->wrapper_exe);
+  }
+
+  if (rewriter->key_placement == KEY_PLACEMENT_AFTER_LAST_KEY &&
+      out->len > group_end && rewriter->group_keys_end < group_end) {
+    // Move the added keys up above the trailing blank lines and comments.
+    g_autofree char *added = g_strndup(out->str + group_end, out->len - group_end);
+    g_string_truncate(out, group_end);
+    g_string_insert(out, rewriter->group_keys_end, added);
+  }
+}
+
+static gboolean start_group(Rewriter *rewriter, const char *line, gsize length) {
+  // GKeyFile tolerates some oddities here, but they're not worth reproducing.
+  if (line[length - 1] != ']' || length == 2) {
+    return FALSE;
+  }
+
+  const char *name = line + 1;
+  gsize name_length = length - 2;
+  for (gsize i = 0; i < name_length; i++) {
+    if (name[i] == '[' || name[i] == ']' || g_ascii_iscntrl(name[i])) {
+      return FALSE;
+    }
+  }
+
+  finish_group(rewriter);
+
+  const char *group =
+      g_string_chunk_insert_len(rewriter->rewrite->arena, name, name_length);
+  if (g_hash_table_contains(rewriter->groups, group)) {
+    return FALSE;
+  }
+
+  g_hash_table_add(rewriter->groups, (char *)group);
+
+  if (strcmp(group, G_KEY_FILE_DESKTOP_GROUP) == 0) {
+    rewriter->kind = GROUP_MAIN;
+    rewriter->seen_main = TRUE;
+  } else if (g_str_has_prefix(group, DESKTOP_ACTION_GROUP_PREFIX)) {
+    // Which actions get edited depends on the Actions key, so it has to have been
+    // seen already.
+    if (!rewriter->seen_main) {
+      return FALSE;
+    }
+
+    const char *action = group + strlen(DESKTOP_ACTION_GROUP_PREFIX);
+    gboolean listed = FALSE;
+    for (int i = 0; i < rewriter->actions->len && !listed; i++) {
+      listed = strcmp(g_ptr_array_index(rewriter->actions, i), action) == 0;
+    }
+
+    rewriter->kind = listed ? GROUP_ACTION : GROUP_OTHER;
+  } else {
+    rewriter->kind = GROUP_OTHER;
+  }
+
+  rewriter->group = group;
+  rewriter->has_exec = FALSE;
+  rewriter->has_try_exec = FALSE;
+  rewriter->has_part_of = FALSE;
+  rewriter->has_actions = FALSE;
+  rewriter->has_icon = FALSE;
+  rewriter->has_mime_types = FALSE;
+
+  // GKeyFile separates groups with at least one empty line.
+  GString *out = rewriter->rewrite->contents;
+  if (out->len >= 2 && out->str[out->len - 2] != '\n') {
+    g_string_append_c(out, '\n');
+  }
+
+  g_string_append_c(out, '[');
+  g_string_append_len(out, name, name_length);
+  g_string_append(out, "]\n");
+  return TRUE;
+}
+
+// Marks a key that's read or edited as seen, returning FALSE if it was already.
+static gboolean mark_key(gboolean *seen) {
+  if (*seen) {
+    return FALSE;
+  }
+
+  *seen = TRUE;
+  return TRUE;
+}
+
+// The values that are read would need unescaping first, which is left to GKeyFile.
+static gboolean has_escapes(const char *value, gsize value_length) {
+  return memchr(value, '\\', value_length) != NULL;
+}
+
+static gboolean handle_exec(Rewriter *rewriter, const char *value,
+                            gsize value_length) {
+  if (!mark_key(&rewriter->has_exec) || has_escapes(value, value_length)) {
+    return FALSE;
+  }
+
+  if (rewriter->kind == GROUP_ACTION) {
+    g_hash_table_add(rewriter->actions_with_exec,
+                     (char *)rewriter->group + strlen(DESKTOP_ACTION_GROUP_PREFIX));
+  }
+
+  const char *exec = g_string_chunk_insert_len(rewriter->rewrite->arena, value,
+                                               value_length);
+  g_autofree char *command = NULL;
+  // A later duplicate Exec key would replace this one, so GKeyFile gets to decide
+  // whether it's actually an error.
+  if (!desktop_file_build_exec_command(exec, rewriter->group, rewriter->info,
+                                       rewriter->warnings, &command, NULL)) {
+    return FALSE;
+  }
+
+  GString *out = rewriter->rewrite->contents;
+  if (command != NULL) {
+    append_escaped_key(out, G_KEY_FILE_DESKTOP_KEY_EXEC, command);
+  } else {
+    append_key(out, G_KEY_FILE_DESKTOP_KEY_EXEC, strlen(G_KEY_FILE_DESKTOP_KEY_EXEC),
+               value, value_length);
+  }
+
+  return TRUE;
+}
+
+static gboolean handle_main_key(Rewriter *rewriter, const char *key, gsize key_length,
+                                const char *value, gsize value_length) {
+  FlatpakInfo *info = rewriter->info;
+  DesktopFileRewrite *rewrite = rewriter->rewrite;
+
+  if (key_equals(key, key_length, DESKTOP_KEY_X_FLATPAK_PART_OF)) {
+    if (!mark_key(&rewriter->has_part_of)) {
+      return FALSE;
+    }
+
+    append_escaped_key(rewrite->contents, DESKTOP_KEY_X_FLATPAK_PART_OF, info->app);
+    return TRUE;
+  } else if (key_equals(key, key_length, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC)) {
+    if (!mark_key(&rewriter->has_try_exec)) {
+      return FALSE;
+    }
+
+    if (info->wrapper_exe != NULL) {
+      append_escaped_key(rewrite->contents, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC,
+                         info->wrapper_exe);
+      return TRUE;
+    }
+  } else if (key_equals(key, key_length, G_KEY_FILE_DESKTOP_KEY_ACTIONS)) {
+    if (!mark_key(&rewriter->has_actions) || has_escapes(value, value_length)) {
+      return FALSE;
+    }
+
+    split_list(rewriter, value, value_length, rewriter->actions);
+    for (int i = 0; i < rewriter->actions->len; i++) {
+      for (int j = 0; j < i; j++) {
+        // GKeyFile would edit the same action twice.
+        if (strcmp(g_ptr_array_index(rewriter->actions, i),
+                   g_ptr_array_index(rewriter->actions, j)) == 0) {
+          return FALSE;
+        }
+      }
+    }
+  } else if (key_equals(key, key_length, G_KEY_FILE_DESKTOP_KEY_ICON)) {
+    if (!mark_key(&rewriter->has_icon) || has_escapes(value, value_length)) {
+      return FALSE;
+    }
+
+    rewrite->icon = g_string_chunk_insert_len(rewrite->arena, value, value_length);
+  } else if (key_equals(key, key_length, G_KEY_FILE_DESKTOP_KEY_MIME_TYPE)) {
+    if (!mark_key(&rewriter->has_mime_types) || has_escapes(value, value_length)) {
+      return FALSE;
+    }
+
+    split_list(rewriter, value, value_length, rewrite->mime_types);
+  }
+
+  append_key(rewrite->contents, key, key_length, value, value_length);
+  return TRUE;
+}
+
+static gboolean handle_key_or_group(Rewriter *rewriter, const char *line,
+                                    gsize length) {
+  GString *out = rewriter->rewrite->contents;
+
+  if (*line == '[') {
+    return start_group(rewriter, line, length);
+  } else if (rewriter->kind == GROUP_NONE) {
+    return FALSE;
+  }
+
+  const char *end = line + length;
+  const char *equals = memchr(line, '=', length);
+  if (equals == NULL) {
+    return FALSE;
+  }
+
+  // GKeyFile drops the whitespace around the '='.
+  const char *key_end = equals;
+  while (key_end > line && g_ascii_isspace(key_end[-1])) {
+    key_end--;
+  }
+
+  const char *value = equals + 1;
+  while (value < end && g_ascii_isspace(*value)) {
+    value++;
+  }
+
+  gsize key_length = key_end - line;
+  gsize value_length = end - value;
+  if (!is_simple_key(line, key_length)) {
+    return FALSE;
+  }
+
+  gboolean is_exec = key_equals(line, key_length, G_KEY_FILE_DESKTOP_KEY_EXEC);
+  if (rewriter->kind == GROUP_OTHER ||
+      (rewriter->kind == GROUP_ACTION && !is_exec)) {
+    append_key(out, line, key_length, value, value_length);
+    return TRUE;
+  }
+
+  if (is_exec) {
+    return handle_exec(rewriter, value, value_length);
+  }
+
+  return handle_main_key(rewriter, line, key_length, value, value_length);
+}
+
+static gboolean handle_line(Rewriter *rewriter, const char *line, gsize length) {
+  GString *out = rewriter->rewrite->contents;
+
+  const char *start = line;
+  const char *end = line + length;
+  while (start < end && g_ascii_isspace(*start)) {
+    start++;
+  }
+
+  // Blank lines and comments are kept as-is, including any indentation.
+  if (start == end || *start == '#') {
+    g_string_append_len(out, line, length);
+    g_string_append_c(out, '\n');
+    return TRUE;
+  } else if (start != line || !handle_key_or_group(rewriter, line, length)) {
+    return FALSE;
+  }
+
+  rewriter->group_keys_end = out->len;
+  return TRUE;
+}
+
+// Rewrites the file a line at a time, copying everything that isn't edited as-is.
+// Returns FALSE for anything where the output might differ from GKeyFile's, in
+// which case the caller should start over with rewrite_with_key_file.
+static gboolean rewrite_streaming(const char *data, gsize length, FlatpakInfo *info,
+                                  DesktopFileRewrite *rewrite, GPtrArray *warnings) {
+  KeyPlacement key_placement = get_key_placement();
+  if (key_placement == KEY_PLACEMENT_UNKNOWN || memchr(data, '\r', length) != NULL ||
+      !g_utf8_validate(data, length, NULL)) {
+    return FALSE;
+  }
+
+  g_autoptr(GHashTable) groups = g_hash_table_new(g_str_hash, g_str_equal);
+  g_autoptr(GPtrArray) actions = g_ptr_array_new();
+  g_autoptr(GHashTable) actions_with_exec = g_hash_table_new(g_str_hash, g_str_equal);
+  Rewriter rewriter = {
+      .info = info,
+      .rewrite = rewrite,
+      .warnings = warnings,
+      .groups = groups,
+      .actions = actions,
+      .actions_with_exec = actions_with_exec,
+      .key_placement = key_placement,
+      .kind = GROUP_NONE,
+  };
+
+  const char *line = data;
+  const char *end = data + length;
+  while (line < end) {
+    const char *newline = memchr(line, '\n', end - line);
+    const char *line_end = newline != NULL ? newline : end;
+
+    if (!handle_line(&rewriter, line, line_end - line)) {
+      return FALSE;
+    }
+
+    line = line_end + 1;
+  }
+
+  if (!rewriter.seen_main) {
+    return FALSE;
+  }
+
+  finish_group(&rewriter);
+
+  for (int i = 0; i < actions->len; i++) {
+    const char *action = g_ptr_array_index(actions, i);
+    if (!g_hash_table_contains(actions_with_exec, action)) {
+      g_ptr_array_add(warnings, g_strdup_printf("Missing Exec key in %s%s",
+                                                DESKTOP_ACTION_GROUP_PREFIX, action));
+    }
+  }
+
+  return TRUE;
+}
+
+// Produces the installed version of the desktop file with the given contents,
+// along with the icon and MIME types it declares. path is only used in messages.
+// Unless allow_streaming is set, the file always goes through GKeyFile. Any
+// warnings about the file are added to out_warnings rather than logged, since this
+// may run on a worker thread.
+gboolean desktop_file_rewrite_data(const char *path, const char *data, gsize length,
+                                   FlatpakInfo *info, gboolean allow_streaming,
+                                   DesktopFileRewrite *out_rewrite,
+                                   GPtrArray *out_warnings, gboolean *out_streamed,
+                                   GError **error) {
+  out_rewrite->contents = g_string_sized_new(length + 256);
+  out_rewrite->arena = g_string_chunk_new(1024);
+  out_rewrite->icon = NULL;
+  out_rewrite->mime_types = g_ptr_array_new();
+
+  g_autoptr(GPtrArray) warnings = g_ptr_array_new_with_free_func(g_free);
+  gboolean ok = TRUE;
+  gboolean streamed =
+      allow_streaming && rewrite_streaming(data, length, info, out_rewrite, warnings);
+  if (!streamed) {
+    if (allow_streaming) {
+      g_debug("Falling back to GKeyFile to rewrite %s", path);
+    }
+
+    g_string_truncate(out_rewrite->contents, 0);
+    out_rewrite->icon = NULL;
+    g_ptr_array_set_size(out_rewrite->mime_types, 0);
+    g_ptr_array_set_size(warnings, 0);
+
+    ok = rewrite_with_key_file(path, data, length, info, out_rewrite, warnings, error);
+  }
+
+  // Only the path that was actually used gets to warn, so falling back doesn't
+  // repeat anything.
+  g_ptr_array_extend_and_steal(out_warnings, g_steal_pointer(&warnings));
+  if (!ok) {
+    return FALSE;
+  }
+
+  g_ptr_array_add(out_rewrite->mime_types, NULL);
+  if (out_streamed != NULL) {
+    *out_streamed = streamed;
+  }
+
+  return TRUE;
+}
+
+gboolean desktop_file_rewrite(const char *path, FlatpakInfo *info,
+                              DesktopFileRewrite *out_rewrite, GPtrArray *out_warnings,
+                              GError **error) {
+  g_autofree char *data = NULL;
+  gsize length = 0;
+  if (!g_file_get_contents(path, &data, &length, error)) {
+    g_prefix_error(error, "Loading %s: ", path);
+    return FALSE;
+  }
+
+  return desktop_file_rewrite_data(path, data, length, info, TRUE, out_rewrite,
+                                   out_warnings, NULL, error);
+}
+
+void desktop_file_rewrite_clear(DesktopFileRewrite *rewrite) {
+  if (rewrite->contents != NULL) {
+    g_string_free(rewrite->contents, TRUE);
+    rewrite->contents = NULL;
+  }
+
+  g_clear_pointer(&rewrite->arena, g_string_chunk_free);
+  g_clear_pointer(&rewrite->mime_types, g_ptr_array_unref);
+  rewrite->icon = NULL;
+}
@@ -0,0 +1,46 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "flextop-utils.h"
+
+typedef struct DesktopFileRewrite {
+  GString *contents;
+
+  // Everything below lives in the arena, which is freed all at once along with
+  // the rest of the rewrite.
+  GStringChunk *arena;
+  // NULL if there's no Icon key.
+  const char *icon;
+  // NULL-terminated, and empty if there's no MimeType key.
+  GPtrArray *mime_types;
+} DesktopFileRewrite;
+
+gboolean desktop_file_build_exec_command(const char *exec, const char *section,
+                                         FlatpakInfo *info, GPtrArray *warnings,
+                                         char **out_command, GError **error);
+
+gboolean desktop_file_rewrite_data(const char *path, const char *data, gsize length,
+                                   FlatpakInfo *info, gboolean allow_streaming,
+                                   DesktopFileRewrite *out_rewrite,
+                                   GPtrArray *out_warnings, gboolean *out_streamed,
+                                   GError **error);
+gboolean desktop_file_rewrite(const char *path, FlatpakInfo *info,
+                              DesktopFileRewrite *out_rewrite, GPtrArray *out_warnings,
+                              GError **error);
+void desktop_file_rewrite_clear(DesktopFileRewrite *rewrite);
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(DesktopFileRewrite, desktop_file_rewrite_clear)
@@ -0,0 +1,334 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "flextop-dir-scan.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define DIR_SCAN_QUEUE_DEPTH 32
+#define DIR_SCAN_STATX_MASK (STATX_TYPE | STATX_INO | STATX_MTIME | STATX_SIZE)
+
+void dir_scan_entry_free(DirScanEntry *entry) {
+  g_free(entry->name);
+  g_free(entry);
+}
+
+#ifdef HAVE_LIBURING
+// Stats all the names relative to dirfd, keeping up to DIR_SCAN_QUEUE_DEPTH
+// requests in flight at once, which hides most of the per-file latency on
+// network and encrypted home directories. errors[i] is set to the errno for
+// each failed entry. Returns FALSE if io_uring can't be used at all (e.g. the
+// kernel is too old or seccomp blocks it), in which case nothing is filled in.
+static gboolean statx_all_uring(int dirfd, GPtrArray *names, struct statx *results,
+                                int *errors) {
+  struct io_uring ring;
+  int ret = io_uring_queue_init(DIR_SCAN_QUEUE_DEPTH, &ring, 0);
+  if (ret < 0) {
+    g_debug("io_uring is unavailable: %s", g_strerror(-ret));
+    return FALSE;
+  }
+
+  gboolean success = TRUE;
+  guint next = 0, in_flight = 0, completed = 0;
+  while (completed < names->len) {
+    guint queued = 0;
+    while (next < names->len && in_flight + queued < DIR_SCAN_QUEUE_DEPTH) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+      if (sqe == NULL) {
+        break;
+      }
+
+      io_uring_prep_statx(sqe, dirfd, g_ptr_array_index(names, next), 0,
+                          DIR_SCAN_STATX_MASK, &results[next]);
+      io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(next));
+      next++;
+      queued++;
+    }
+
+    if (queued > 0) {
+      ret = io_uring_submit(&ring);
+      if (ret < 0) {
+        g_debug("Failed to submit to io_uring: %s", g_strerror(-ret));
+        success = FALSE;
+        break;
+      }
+
+      in_flight += ret;
+    }
+
+    struct io_uring_cqe *cqe;
+    ret = io_uring_wait_cqe(&ring, &cqe);
+    if (ret == -EINTR) {
+      continue;
+    } else if (ret < 0) {
+      g_debug("Failed to wait on io_uring: %s", g_strerror(-ret));
+      success = FALSE;
+      break;
+    }
+
+    guint index = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+    errors[index] = cqe->res < 0 ? -cqe->res : 0;
+    io_uring_cqe_seen(&ring, cqe);
+    in_flight--;
+    completed++;
+  }
+
+  // Don't let the kernel write into the results after they've been given up on.
+  while (in_flight > 0) {
+    struct io_uring_cqe *cqe;
+    ret = io_uring_wait_cqe(&ring, &cqe);
+    if (ret == -EINTR) {
+      continue;
+    } else if (ret < 0) {
+      break;
+    }
+
+    io_uring_cqe_seen(&ring, cqe);
+    in_flight--;
+  }
+
+  io_uring_queue_exit(&ring);
+  return success;
+}
+#endif
+
+// Whether the error means statx itself can't be used, e.g. because a seccomp
+// filter predating it rejects it with EPERM. glibc already emulates it with
+// fstatat on kernels that return ENOSYS, but not if the filter does.
+static gboolean is_statx_unavailable(int err) { return err == ENOSYS || err == EPERM; }
+
+// Fails with G_IO_ERROR_NOT_SUPPORTED if statx, or io_uring when it's the given
+// backend, can't be used at all, in which case the results are incomplete.
+static gboolean statx_all(int dirfd, GPtrArray *names, DirScanBackend backend,
+                          struct statx *results, int *errors, GError **error) {
+  for (int i = 0; i < names->len; i++) {
+    errors[i] = -1;
+  }
+
+#ifdef HAVE_LIBURING
+  if (backend == DIR_SCAN_BACKEND_URING ||
+      (backend == DIR_SCAN_BACKEND_AUTO && names->len > 1)) {
+    if (statx_all_uring(dirfd, names, results, errors)) {
+      // Kernels that predate IORING_OP_STATX fail each request with EINVAL, so
+      // those still get redone below, unless io_uring was asked for.
+      for (int i = 0; i < names->len; i++) {
+        if (errors[i] == EINVAL) {
+          if (backend == DIR_SCAN_BACKEND_URING) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "io_uring doesn't support statx");
+            return FALSE;
+          }
+
+          errors[i] = -1;
+        }
+      }
+    } else if (backend == DIR_SCAN_BACKEND_URING) {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                  "io_uring is unavailable");
+      return FALSE;
+    } else {
+      for (int i = 0; i < names->len; i++) {
+        errors[i] = -1;
+      }
+    }
+  }
+#else
+  if (backend == DIR_SCAN_BACKEND_URING) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                "Built without io_uring support");
+    return FALSE;
+  }
+#endif
+
+  for (int i = 0; i < names->len; i++) {
+    if (errors[i] == -1) {
+      const char *name = g_ptr_array_index(names, i);
+      errors[i] =
+          statx(dirfd, name, 0, DIR_SCAN_STATX_MASK, &results[i]) == -1 ? errno : 0;
+      if (is_statx_unavailable(errors[i])) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "statx is unavailable: %s", g_strerror(errors[i]));
+        return FALSE;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+// Lists the directory through GIO instead, which works wherever stat does.
+static GPtrArray *dir_scan_regular_files_gio(const char *dir, const char *suffix,
+                                             GError **error) {
+  g_autoptr(GPtrArray) entries =
+      g_ptr_array_new_with_free_func((GDestroyNotify)dir_scan_entry_free);
+
+  g_autoptr(GFile) file = g_file_new_for_path(dir);
+  g_autoptr(GFileEnumerator) enumerator = g_file_enumerate_children(
+      file,
+      G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE
+                                     "," G_FILE_ATTRIBUTE_STANDARD_SIZE
+                                     "," G_FILE_ATTRIBUTE_UNIX_INODE
+                                     "," G_FILE_ATTRIBUTE_TIME_MODIFIED
+                                     "," G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+      G_FILE_QUERY_INFO_NONE, NULL, error);
+  if (enumerator == NULL) {
+    if (g_error_matches(*error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+      g_clear_error(error);
+      return g_steal_pointer(&entries);
+    }
+
+    return NULL;
+  }
+
+  for (;;) {
+    GFileInfo *info = NULL;
+    if (!g_file_enumerator_iterate(enumerator, &info, NULL, NULL, error)) {
+      return NULL;
+    } else if (info == NULL) {
+      break;
+    }
+
+    const char *name = g_file_info_get_name(info);
+    if (g_file_info_get_file_type(info) != G_FILE_TYPE_REGULAR ||
+        !g_str_has_suffix(name, suffix)) {
+      continue;
+    }
+
+    DirScanEntry *entry = g_new0(DirScanEntry, 1);
+    entry->name = g_strdup(name);
+    entry->inode = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_UNIX_INODE);
+    entry->mtime_sec =
+        g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+    entry->mtime_nsec =
+        g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC) *
+        1000;
+    entry->size = g_file_info_get_size(info);
+    g_ptr_array_add(entries, entry);
+  }
+
+  return g_steal_pointer(&entries);
+}
+
+// Lists the regular files in dir whose names end with suffix, following
+// symlinks the way GFileEnumerator does. Entries that getdents already reports
+// as something other than a file or symlink are never stat'd. If statx turns out
+// to be unavailable, this falls back to GFileEnumerator. Returns an empty array if
+// dir doesn't exist.
+GPtrArray *dir_scan_regular_files(const char *dir, const char *suffix, GError **error) {
+  return dir_scan_regular_files_with_backend(dir, suffix, DIR_SCAN_BACKEND_AUTO,
+                                             error);
+}
+
+// Like dir_scan_regular_files(), but only with the given backend, failing with
+// G_IO_ERROR_NOT_SUPPORTED if it can't be used, so that they can be compared.
+GPtrArray *dir_scan_regular_files_with_backend(const char *dir, const char *suffix,
+                                               DirScanBackend backend, GError **error) {
+  if (backend == DIR_SCAN_BACKEND_GIO) {
+    return dir_scan_regular_files_gio(dir, suffix, error);
+  }
+
+  g_autoptr(GPtrArray) entries =
+      g_ptr_array_new_with_free_func((GDestroyNotify)dir_scan_entry_free);
+
+  DIR *dp = opendir(dir);
+  if (dp == NULL) {
+    int err = errno;
+    if (err == ENOENT) {
+      return g_steal_pointer(&entries);
+    }
+
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open %s: %s",
+                dir, g_strerror(err));
+    return NULL;
+  }
+
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func(g_free);
+  for (;;) {
+    errno = 0;
+    struct dirent *dent = readdir(dp);
+    if (dent == NULL) {
+      int err = errno;
+      if (err != 0) {
+        closedir(dp);
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                    "Failed to read %s: %s", dir, g_strerror(err));
+        return NULL;
+      }
+
+      break;
+    }
+
+    if (dent->d_type != DT_REG && dent->d_type != DT_LNK && dent->d_type != DT_UNKNOWN) {
+      continue;
+    }
+
+    if (g_str_has_suffix(dent->d_name, suffix)) {
+      g_ptr_array_add(names, g_strdup(dent->d_name));
+    }
+  }
+
+  g_autofree struct statx *results = g_new0(struct statx, names->len);
+  g_autofree int *errors = g_new0(int, names->len);
+  g_autoptr(GError) statx_error = NULL;
+  gboolean have_statx =
+      statx_all(dirfd(dp), names, backend, results, errors, &statx_error);
+  closedir(dp);
+
+  if (!have_statx) {
+    if (backend != DIR_SCAN_BACKEND_AUTO) {
+      g_propagate_prefixed_error(error, g_steal_pointer(&statx_error), "Scanning %s: ",
+                                 dir);
+      return NULL;
+    }
+
+    g_debug("%s, listing %s through GIO", statx_error->message, dir);
+    return dir_scan_regular_files_gio(dir, suffix, error);
+  }
+
+  for (int i = 0; i < names->len; i++) {
+    const char *name = g_ptr_array_index(names, i);
+    if (errors[i] != 0) {
+      if (errors[i] != ENOENT) {
+        g_warning("Failed to stat %s/%s: %s", dir, name, g_strerror(errors[i]));
+      }
+
+      continue;
+    }
+
+    struct statx *stx = &results[i];
+    if (!S_ISREG(stx->stx_mode)) {
+      continue;
+    }
+
+    DirScanEntry *entry = g_new0(DirScanEntry, 1);
+    entry->name = g_strdup(name);
+    entry->inode = stx->stx_ino;
+    entry->mtime_sec = stx->stx_mtime.tv_sec;
+    entry->mtime_nsec = stx->stx_mtime.tv_nsec;
+    entry->size = stx->stx_size;
+    g_ptr_array_add(entries, entry);
+  }
+
+  return g_steal_pointer(&entries);
+}
@@ -0,0 +1,40 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <gio/gio.h>
+
+typedef struct DirScanEntry {
+  char *name;
+  guint64 inode;
+  gint64 mtime_sec;
+  gint64 mtime_nsec;
+  goffset size;
+} DirScanEntry;
+
+void dir_scan_entry_free(DirScanEntry *entry);
+
+typedef enum {
+  // io_uring where it helps, then plain statx, then GIO if statx is unavailable.
+  DIR_SCAN_BACKEND_AUTO,
+  DIR_SCAN_BACKEND_URING,
+  DIR_SCAN_BACKEND_STATX,
+  DIR_SCAN_BACKEND_GIO,
+} DirScanBackend;
+
+GPtrArray *dir_scan_regular_files(const char *dir, const char *suffix, GError **error);
+GPtrArray *dir_scan_regular_files_with_backend(const char *dir, const char *suffix,
+                                               DirScanBackend backend, GError **error);
@@ -0,0 +1,358 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Writes the icon-theme.cache that GTK (and anything else reading the same
+// format) uses to look up icons in a theme directory without stat'ing every
+// size directory, the same way gtk-update-icon-cache would. The host's binary
+// can't be run from inside the sandbox, so this reimplements the format:
+//
+//   Header:    u16 major (1), u16 minor (0), u32 hash offset, u32 directory list offset
+//   Hash:      u32 n buckets, u32 icon offset[n] (0xffffffff if empty)
+//   Icon:      u32 next icon in the bucket, u32 name offset, u32 image list offset
+//   ImageList: u32 n images, then per image: u16 directory index, u16 flags,
+//              u32 image data offset (always 0, no pixel data is embedded)
+//   DirList:   u32 n directories, u32 directory name offset[n]
+//
+// All integers are big-endian, and strings are NUL-terminated and padded to
+// 4 bytes.
+//
+// No index.theme is written: the first hicolor index.theme found wins for the
+// whole theme, so a minimal one in the user's data dir would hide the system's
+// directories.
+
+#include "flextop-icon-cache.h"
+#include "flextop-icon-store.h"
+#include "flextop-lock.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define ICON_CACHE_NAME "icon-theme.cache"
+#define ICON_CACHE_LOCK_NAME "icon-theme.cache.lock"
+#define ICON_CACHE_NONE 0xffffffff
+
+typedef enum {
+  ICON_FLAG_XPM = 1 << 0,
+  ICON_FLAG_SVG = 1 << 1,
+  ICON_FLAG_PNG = 1 << 2,
+  ICON_FLAG_ICON_FILE = 1 << 3,
+} IconFlags;
+
+typedef struct IconImage {
+  guint16 dir_index;
+  guint16 flags;
+} IconImage;
+
+typedef struct IconCacheBuilder {
+  // Directory paths relative to the theme.
+  GPtrArray *dirs;
+  // icon name -> GArray of IconImage
+  GHashTable *icons;
+} IconCacheBuilder;
+
+static IconFlags get_flags_for_suffix(const char *suffix) {
+  if (strcmp(suffix, ".png") == 0) {
+    return ICON_FLAG_PNG;
+  } else if (strcmp(suffix, ".svg") == 0) {
+    return ICON_FLAG_SVG;
+  } else if (strcmp(suffix, ".xpm") == 0) {
+    return ICON_FLAG_XPM;
+  } else if (strcmp(suffix, ".icon") == 0) {
+    return ICON_FLAG_ICON_FILE;
+  }
+
+  return 0;
+}
+
+static void add_image(IconCacheBuilder *builder, const char *name, guint16 dir_index,
+                      IconFlags flags) {
+  GArray *images = g_hash_table_lookup(builder->icons, name);
+  if (images == NULL) {
+    images = g_array_new(FALSE, FALSE, sizeof(IconImage));
+    g_hash_table_insert(builder->icons, g_strdup(name), images);
+  }
+
+  // The same icon can be present in a directory in multiple formats.
+  for (int i = 0; i < images->len; i++) {
+    IconImage *image = &g_array_index(images, IconImage, i);
+    if (image->dir_index == dir_index) {
+      image->flags |= flags;
+      return;
+    }
+  }
+
+  IconImage image = {.dir_index = dir_index, .flags = flags};
+  g_array_append_val(images, image);
+}
+
+static gboolean scan_dir(IconCacheBuilder *builder, const char *theme, const char *subdir,
+                         GError **error) {
+  g_autofree char *path =
+      subdir != NULL ? g_build_filename(theme, subdir, NULL) : g_strdup(theme);
+  DIR *dp = opendir(path);
+  if (dp == NULL) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open %s: %s",
+                path, g_strerror(err));
+    return FALSE;
+  }
+
+  // Icons right inside the theme directory aren't part of any theme directory.
+  gboolean has_index = subdir != NULL && builder->dirs->len < G_MAXUINT16;
+  guint16 dir_index = builder->dirs->len;
+  if (has_index) {
+    g_ptr_array_add(builder->dirs, g_strdup(subdir));
+  }
+
+  g_autoptr(GPtrArray) children = g_ptr_array_new_with_free_func(g_free);
+  for (;;) {
+    errno = 0;
+    struct dirent *dent = readdir(dp);
+    if (dent == NULL) {
+      int err = errno;
+      if (err != 0) {
+        closedir(dp);
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                    "Failed to read %s: %s", path, g_strerror(err));
+        return FALSE;
+      }
+
+      break;
+    }
+
+    if (dent->d_name[0] == '.') {
+      continue;
+    }
+
+    unsigned char type = dent->d_type;
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+      struct stat st;
+      if (fstatat(dirfd(dp), dent->d_name, &st, 0) == -1) {
+        continue;
+      }
+
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+
+    if (type == DT_DIR) {
+      g_ptr_array_add(children, g_strdup(dent->d_name));
+    } else if (type == DT_REG && has_index) {
+      const char *suffix = strrchr(dent->d_name, '.');
+      IconFlags flags = suffix != NULL ? get_flags_for_suffix(suffix) : 0;
+      if (flags != 0) {
+        g_autofree char *name = g_strndup(dent->d_name, suffix - dent->d_name);
+        add_image(builder, name, dir_index, flags);
+      }
+    }
+  }
+
+  closedir(dp);
+
+  for (int i = 0; i < children->len; i++) {
+    const char *child = g_ptr_array_index(children, i);
+    g_autofree char *child_subdir =
+        subdir != NULL ? g_build_filename(subdir, child, NULL) : g_strdup(child);
+    if (!scan_dir(builder, theme, child_subdir, error)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+// Must match GTK's icon_name_hash, including the sign extension of each byte.
+static guint32 icon_name_hash(const char *name) {
+  const signed char *p = (const signed char *)name;
+  guint32 h = *p;
+  if (h != 0) {
+    for (p++; *p != '\0'; p++) {
+      h = (h << 5) - h + *p;
+    }
+  }
+
+  return h;
+}
+
+static void append_u16(GByteArray *data, guint16 value) {
+  guint16 be = GUINT16_TO_BE(value);
+  g_byte_array_append(data, (const guint8 *)&be, sizeof(be));
+}
+
+static void append_u32(GByteArray *data, guint32 value) {
+  guint32 be = GUINT32_TO_BE(value);
+  g_byte_array_append(data, (const guint8 *)&be, sizeof(be));
+}
+
+static void set_u32(GByteArray *data, guint32 offset, guint32 value) {
+  guint32 be = GUINT32_TO_BE(value);
+  memcpy(data->data + offset, &be, sizeof(be));
+}
+
+static guint32 append_string(GByteArray *data, const char *string) {
+  guint32 offset = data->len;
+  g_byte_array_append(data, (const guint8 *)string, strlen(string) + 1);
+
+  static const guint8 padding[4] = {0};
+  if (data->len % 4 != 0) {
+    g_byte_array_append(data, padding, 4 - data->len % 4);
+  }
+
+  return offset;
+}
+
+static GByteArray *build_cache(IconCacheBuilder *builder) {
+  GByteArray *data = g_byte_array_new();
+
+  guint n_buckets = g_spaced_primes_closest(g_hash_table_size(builder->icons) / 3);
+  g_autofree GPtrArray **buckets = g_new0(GPtrArray *, n_buckets);
+
+  GHashTableIter iter;
+  gpointer name;
+  g_hash_table_iter_init(&iter, builder->icons);
+  while (g_hash_table_iter_next(&iter, &name, NULL)) {
+    guint bucket = icon_name_hash(name) % n_buckets;
+    if (buckets[bucket] == NULL) {
+      buckets[bucket] = g_ptr_array_new();
+    }
+
+    g_ptr_array_add(buckets[bucket], name);
+  }
+
+  append_u16(data, 1);
+  append_u16(data, 0);
+  guint32 hash_offset_field = data->len;
+  append_u32(data, 0);
+  guint32 dir_list_offset_field = data->len;
+  append_u32(data, 0);
+
+  set_u32(data, hash_offset_field, data->len);
+  append_u32(data, n_buckets);
+  guint32 buckets_offset = data->len;
+  for (int i = 0; i < n_buckets; i++) {
+    append_u32(data, ICON_CACHE_NONE);
+  }
+
+  for (int i = 0; i < n_buckets; i++) {
+    if (buckets[i] == NULL) {
+      continue;
+    }
+
+    guint32 link_field = buckets_offset + i * 4;
+    for (int j = 0; j < buckets[i]->len; j++) {
+      const char *icon_name = g_ptr_array_index(buckets[i], j);
+      GArray *images = g_hash_table_lookup(builder->icons, icon_name);
+
+      set_u32(data, link_field, data->len);
+      link_field = data->len;
+      append_u32(data, ICON_CACHE_NONE);
+      guint32 name_offset_field = data->len;
+      append_u32(data, 0);
+      guint32 images_offset_field = data->len;
+      append_u32(data, 0);
+
+      set_u32(data, name_offset_field, append_string(data, icon_name));
+
+      set_u32(data, images_offset_field, data->len);
+      append_u32(data, images->len);
+      for (int k = 0; k < images->len; k++) {
+        IconImage *image = &g_array_index(images, IconImage, k);
+        append_u16(data, image->dir_index);
+        append_u16(data, image->flags);
+        append_u32(data, 0);
+      }
+    }
+
+    g_ptr_array_unref(buckets[i]);
+  }
+
+  set_u32(data, dir_list_offset_field, data->len);
+  append_u32(data, builder->dirs->len);
+  guint32 dirs_offset = data->len;
+  for (int i = 0; i < builder->dirs->len; i++) {
+    append_u32(data, 0);
+  }
+
+  for (int i = 0; i < builder->dirs->len; i++) {
+    set_u32(data, dirs_offset + i * 4,
+            append_string(data, g_ptr_array_index(builder->dirs, i)));
+  }
+
+  return data;
+}
+
+// Regenerates the icon cache for the whole hicolor theme in the host's icons
+// dir, including icons that weren't installed by us, since GTK trusts the cache
+// over the directory contents. Unless create is set, a theme without a cache is
+// left alone, since GTK already reads its directories directly.
+gboolean icon_cache_update(DataDir *host, gboolean create, GError **error) {
+  g_autofree char *theme =
+      g_build_filename(g_file_peek_path(host->icons), "hicolor", NULL);
+  if (!g_file_test(theme, G_FILE_TEST_IS_DIR)) {
+    return TRUE;
+  }
+
+  g_autofree char *cache = g_build_filename(theme, ICON_CACHE_NAME, NULL);
+  if (!create && !g_file_test(cache, G_FILE_TEST_EXISTS)) {
+    g_debug("No icon cache in %s, not creating one", theme);
+    return TRUE;
+  }
+
+  // Updates are serialized so that the last one to finish scans after every
+  // other's icons were written, and its cache isn't replaced by an older scan.
+  // The lock lives in the icon store rather than the theme, which other tools
+  // own.
+  g_autofree char *store = icon_store_get_path(host);
+  if (g_mkdir_with_parents(store, 0755) == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to create %s: %s", store, g_strerror(err));
+    return FALSE;
+  }
+
+  g_autofree char *lock_path = g_build_filename(store, ICON_CACHE_LOCK_NAME, NULL);
+  g_auto(LockFd) lock =
+      lock_acquire(lock_path, LOCK_MODE_EXCLUSIVE, LOCK_DEFAULT_TIMEOUT_MS, error);
+  if (lock == -1) {
+    return FALSE;
+  }
+
+  IconCacheBuilder builder;
+  builder.dirs = g_ptr_array_new_with_free_func(g_free);
+  builder.icons = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify)g_array_unref);
+
+  gboolean success = scan_dir(&builder, theme, NULL, error);
+  if (success) {
+    g_autoptr(GByteArray) data = build_cache(&builder);
+    success = write_file_with_durability(cache, (const char *)data->data, data->len,
+                                         get_durability(), error);
+
+    // GTK ignores caches older than the theme dir, which the rename into it just
+    // touched.
+    if (success && utimensat(AT_FDCWD, cache, NULL, 0) == -1) {
+      g_debug("Failed to touch %s: %s", cache, g_strerror(errno));
+    }
+
+    g_debug("Wrote icon cache with %u icons in %u directories",
+            g_hash_table_size(builder.icons), builder.dirs->len);
+  }
+
+  g_ptr_array_unref(builder.dirs);
+  g_hash_table_unref(builder.icons);
+  return success;
+}
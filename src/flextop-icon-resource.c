@@ -0,0 +1,565 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "flextop-icon-resource.h"
+#include "flextop-icon-cache.h"
+#include "flextop-icon-scale.h"
+#include "flextop-icon-store.h"
+#include "flextop-manifest.h"
+#include "flextop-trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void icon_request_free(IconRequest *request) {
+  g_free(request->file);
+  g_free(request->name);
+  g_free(request);
+}
+
+static gboolean parse_size(const char *size_str, int *out_size) {
+  char *size_end;
+  *out_size = g_strtod(size_str, &size_end);
+  if (*size_end != '\0') {
+    g_warning("Invalid size: %s", size_str);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean add_request(GPtrArray *requests, const char *size_str,
+                            const char *icon_file, const char *icon_name) {
+  int size;
+  if (!parse_size(size_str, &size)) {
+    return FALSE;
+  }
+
+  IconRequest *request = g_new0(IconRequest, 1);
+  request->size = size;
+  request->scale = 1;
+  request->file = g_strdup(icon_file);
+  request->name = g_strdup(icon_name);
+  g_ptr_array_add(requests, request);
+  return TRUE;
+}
+
+// Reads "size file name" triples from stdin, one per line. The fields use shell
+// quoting, so file names containing spaces can still be passed.
+gboolean icon_resource_read_requests_from_stdin(GPtrArray *requests, GError **error) {
+  g_autofree char *line = NULL;
+  size_t line_capacity = 0;
+  int lineno = 0;
+
+  while (getline(&line, &line_capacity, stdin) != -1) {
+    lineno++;
+
+    g_strstrip(line);
+    if (*line == '\0') {
+      continue;
+    }
+
+    int fieldc;
+    g_auto(GStrv) fields = NULL;
+    if (!g_shell_parse_argv(line, &fieldc, &fields, error)) {
+      g_prefix_error(error, "Parsing stdin line %d: ", lineno);
+      return FALSE;
+    }
+
+    if (fieldc != 3) {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                  "Expected 'size file name' on stdin line %d", lineno);
+      return FALSE;
+    }
+
+    if (!add_request(requests, fields[0], fields[1], fields[2])) {
+      g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                  "Invalid size on stdin line %d", lineno);
+      return FALSE;
+    }
+  }
+
+  if (ferror(stdin)) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Reading stdin: %s",
+                g_strerror(err));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+typedef struct IconSize {
+  int size;
+  int scale;
+} IconSize;
+
+// Parses FLEXTOP_ICON_SIZES, a comma-separated list of sizes such as
+// "16,32,48,256,32@2". Returns NULL if it's unset or invalid, in which case every
+// size is installed as given and none are derived.
+static GArray *load_size_policy() {
+  const char *value = client_getenv("FLEXTOP_ICON_SIZES");
+  if (value == NULL || *value == '\0') {
+    return NULL;
+  }
+
+  g_autoptr(GArray) policy = g_array_new(FALSE, FALSE, sizeof(IconSize));
+  g_auto(GStrv) items = g_strsplit(value, ",", -1);
+  for (char **item = items; *item != NULL; item++) {
+    IconSize icon_size = {.scale = 1};
+    char *end;
+
+    icon_size.size = strtol(g_strstrip(*item), &end, 10);
+    if (*end == '@') {
+      icon_size.scale = strtol(end + 1, &end, 10);
+    }
+
+    if (*end != '\0' || icon_size.size <= 0 || icon_size.scale <= 0) {
+      g_warning("Ignoring invalid FLEXTOP_ICON_SIZES: %s", value);
+      return NULL;
+    }
+
+    g_array_append_val(policy, icon_size);
+  }
+
+  return g_steal_pointer(&policy);
+}
+
+static gboolean size_policy_contains(GArray *policy, int size, int scale) {
+  for (int i = 0; i < policy->len; i++) {
+    IconSize *icon_size = &g_array_index(policy, IconSize, i);
+    if (icon_size->size == size && icon_size->scale == scale) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+typedef struct IconInstallContext {
+  FlatpakInfo *info;
+  DataDir *host;
+
+  // The size directories that have already been created during this run, so
+  // batches only pay for the mkdir once per size.
+  GHashTable *ready_dirs;
+
+  // May be NULL if the manifest couldn't be loaded.
+  Manifest *manifest;
+
+  IconStoreStats store_stats;
+  guint derived;
+  guint pruned;
+} IconInstallContext;
+
+static gboolean mkdirat_exists_ok(int dir_fd, const char *name, GError **error) {
+  if (mkdirat(dir_fd, name, 0755) == -1 && errno != EEXIST) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to create %s: %s",
+                name, g_strerror(err));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Creates the apps directory for the size inside hicolor. Only hicolor itself may
+// need its parents created, the rest is made relative to it.
+static gboolean ensure_size_dir(DataDir *host, const char *size_dir, GError **error) {
+  int hicolor_fd = data_dir_get_fd(host, DATA_DIR_HICOLOR, NULL);
+  if (hicolor_fd == -1) {
+    g_autoptr(GFile) hicolor = g_file_get_child(host->icons, "hicolor");
+    if (!mkdir_with_parents_exists_ok(hicolor, error)) {
+      return FALSE;
+    }
+
+    hicolor_fd = data_dir_get_fd(host, DATA_DIR_HICOLOR, error);
+    if (hicolor_fd == -1) {
+      return FALSE;
+    }
+  }
+
+  g_autofree char *apps_dir = g_build_filename(size_dir, "apps", NULL);
+  return mkdirat_exists_ok(hicolor_fd, size_dir, error) &&
+         mkdirat_exists_ok(hicolor_fd, apps_dir, error);
+}
+
+static char *get_dest_path(IconInstallContext *context, const char *name, int size,
+                           int scale, GError **error) {
+  g_autofree char *size_dir = scale == 1
+                                  ? g_strdup_printf("%dx%d", size, size)
+                                  : g_strdup_printf("%dx%d@%d", size, size, scale);
+  g_autofree char *dest_dir =
+      g_build_filename(g_file_peek_path(context->host->icons), "hicolor", size_dir,
+                       "apps", NULL);
+  if (!g_hash_table_contains(context->ready_dirs, size_dir)) {
+    if (!ensure_size_dir(context->host, size_dir, error)) {
+      return NULL;
+    }
+
+    g_hash_table_add(context->ready_dirs, g_steal_pointer(&size_dir));
+  }
+
+  g_autofree char *dest_filename = g_strdup_printf("%s.png", name);
+  return g_build_filename(dest_dir, dest_filename, NULL);
+}
+
+// Installs source at dest and records it in the manifest. source_size is 0 if the
+// file was given at this size, otherwise the size it was scaled down from. Only
+// our own temporary files may be hardlinked into the store, never Chromium's.
+static gboolean install_file(IconInstallContext *context, const char *name,
+                             const char *source, gboolean source_is_temporary,
+                             const char *dest, int source_size, GError **error) {
+  g_autofree char *checksum = NULL;
+  if (!icon_store_install(context->host, source, dest, source_is_temporary,
+                          &context->store_stats, &checksum, error)) {
+    return FALSE;
+  }
+
+  if (context->manifest != NULL) {
+    g_autoptr(GError) manifest_error = NULL;
+    if (!manifest_add_icon_file(context->manifest, name, dest, checksum, source_size,
+                                &manifest_error)) {
+      g_warning("Failed to record icon file %s: %s", dest, manifest_error->message);
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean install(IconInstallContext *context, IconRequest *request,
+                        GError **error) {
+  g_autofree char *dest =
+      get_dest_path(context, request->name, request->size, request->scale, error);
+  if (dest == NULL) {
+    return FALSE;
+  }
+
+  return install_file(context, request->name, request->file, FALSE, dest, 0, error);
+}
+
+// Whether the icon at dest should be (re)generated from a source of source_size.
+// Sizes that were given exactly are never overwritten, and neither are ones that
+// came from a bigger source than this one, since Chromium installs one size per
+// invocation and the biggest may already have been seen.
+static gboolean should_derive(IconInstallContext *context, const char *name,
+                              const char *dest, int source_size) {
+  if (context->manifest == NULL) {
+    return !g_file_test(dest, G_FILE_TEST_EXISTS);
+  }
+
+  const ManifestIconFile *recorded =
+      manifest_lookup_icon_file(context->manifest, name, dest);
+  if (recorded == NULL) {
+    return TRUE;
+  }
+
+  return recorded->source_size != 0 && recorded->source_size < source_size;
+}
+
+static gboolean derive(IconInstallContext *context, IconRequest *source,
+                       IconSize *icon_size, GError **error) {
+  g_autofree char *dest =
+      get_dest_path(context, source->name, icon_size->size, icon_size->scale, error);
+  if (dest == NULL) {
+    return FALSE;
+  }
+
+  if (!should_derive(context, source->name, dest, source->size)) {
+    return TRUE;
+  }
+
+  int pixels = icon_size->size * icon_size->scale;
+  if (pixels == source->size) {
+    // A HiDPI directory that wants exactly the source, e.g. 64px for 32x32@2.
+    return install_file(context, source->name, source->file, FALSE, dest, source->size,
+                        error);
+  }
+
+  // Scale into the store's directory, so the store can link the result into place.
+  g_autofree char *store_path = icon_store_get_path(context->host);
+  g_autoptr(GFile) store_dir = g_file_new_for_path(store_path);
+  if (!mkdir_with_parents_exists_ok(store_dir, error)) {
+    return FALSE;
+  }
+
+  g_autofree char *scaled = g_build_filename(store_path, ".scaled-XXXXXX", NULL);
+  int fd = g_mkstemp_full(scaled, O_RDWR | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Creating %s: %s",
+                scaled, g_strerror(err));
+    return FALSE;
+  }
+
+  close(fd);
+
+  gboolean success =
+      icon_scale_png(source->file, scaled, pixels, error) &&
+      install_file(context, source->name, scaled, TRUE, dest, source->size, error);
+  unlink(scaled);
+
+  if (success) {
+    context->derived++;
+  }
+
+  return success;
+}
+
+// Fills in the policy sizes this invocation didn't provide for each icon, scaling
+// down from the biggest file that was given for it.
+static void derive_missing_sizes(IconInstallContext *context, GPtrArray *requests,
+                                 GArray *policy) {
+  g_autoptr(GHashTable) largest = g_hash_table_new(g_str_hash, g_str_equal);
+  for (int i = 0; i < requests->len; i++) {
+    IconRequest *request = g_ptr_array_index(requests, i);
+    IconRequest *current = g_hash_table_lookup(largest, request->name);
+    if (current == NULL || request->size > current->size) {
+      g_hash_table_insert(largest, request->name, request);
+    }
+  }
+
+  for (int i = 0; i < policy->len; i++) {
+    IconSize *icon_size = &g_array_index(policy, IconSize, i);
+
+    GHashTableIter iter;
+    gpointer source_ptr;
+    g_hash_table_iter_init(&iter, largest);
+    while (g_hash_table_iter_next(&iter, NULL, &source_ptr)) {
+      IconRequest *source = source_ptr;
+      if (source->size < icon_size->size * icon_size->scale) {
+        continue;
+      }
+
+      gboolean given = FALSE;
+      for (int j = 0; j < requests->len && !given; j++) {
+        IconRequest *request = g_ptr_array_index(requests, j);
+        given = request->size == icon_size->size && request->scale == icon_size->scale &&
+                strcmp(request->name, source->name) == 0;
+      }
+
+      if (given) {
+        continue;
+      }
+
+      g_autoptr(TraceSpan) span = trace_span_begin("derive_icon", source->file);
+      g_autoptr(GError) error = NULL;
+      if (!derive(context, source, icon_size, &error)) {
+        // The given sizes are still there, so this isn't fatal.
+        g_warning("Failed to derive %dx%d@%d icon from %s: %s", icon_size->size,
+                  icon_size->size, icon_size->scale, source->file, error->message);
+      }
+    }
+  }
+}
+
+static void usage() {
+  g_warning("usage: xdg-icon-resource install [--noupdate] --mode user --size X "
+            "file name\n"
+            "       xdg-icon-resource install [--noupdate] --mode user --batch "
+            "[X file name]...\n"
+            "       xdg-icon-resource forceupdate [--mode user]");
+}
+
+gboolean icon_resource_parse_args(int argc, char **argv, IconResourceCommand *out_command,
+                                  GPtrArray *out_requests, gboolean *out_read_stdin,
+                                  gboolean *out_noupdate) {
+  *out_read_stdin = FALSE;
+  *out_noupdate = FALSE;
+
+  if (argc < 2) {
+    usage();
+    return FALSE;
+  }
+
+  if (strcmp(argv[1], "forceupdate") == 0) {
+    *out_command = ICON_RESOURCE_COMMAND_FORCEUPDATE;
+    return TRUE;
+  } else if (strcmp(argv[1], "install") != 0) {
+    usage();
+    return FALSE;
+  }
+
+  *out_command = ICON_RESOURCE_COMMAND_INSTALL;
+
+  gboolean batch = FALSE;
+  const char *size_str = NULL;
+  g_autoptr(GPtrArray) positional = g_ptr_array_new();
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--batch") == 0) {
+      batch = TRUE;
+    } else if (strcmp(argv[i], "--noupdate") == 0) {
+      *out_noupdate = TRUE;
+    } else if (strcmp(argv[i], "--mode") == 0 || strcmp(argv[i], "--size") == 0) {
+      if (i + 1 == argc) {
+        usage();
+        return FALSE;
+      }
+
+      if (strcmp(argv[i], "--size") == 0) {
+        size_str = argv[i + 1];
+      }
+
+      i++;
+    } else {
+      g_ptr_array_add(positional, argv[i]);
+    }
+  }
+
+  if (batch) {
+    if (size_str != NULL || positional->len % 3 != 0) {
+      usage();
+      return FALSE;
+    }
+
+    for (int i = 0; i < positional->len; i += 3) {
+      if (!add_request(out_requests, g_ptr_array_index(positional, i),
+                       g_ptr_array_index(positional, i + 1),
+                       g_ptr_array_index(positional, i + 2))) {
+        return FALSE;
+      }
+    }
+
+    *out_read_stdin = positional->len == 0;
+  } else {
+    if (size_str == NULL || positional->len != 2) {
+      usage();
+      return FALSE;
+    }
+
+    if (!add_request(out_requests, size_str, g_ptr_array_index(positional, 0),
+                     g_ptr_array_index(positional, 1))) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+// Builds the command line to send to the service. Everything is passed as one batch
+// on the command line, since the service can't see our stdin, and with absolute
+// paths, since it doesn't share our working directory either.
+GStrv icon_resource_build_service_argv(IconResourceCommand command, GPtrArray *requests,
+                                       gboolean noupdate) {
+  GPtrArray *argv = g_ptr_array_new();
+  g_ptr_array_add(argv, g_strdup("xdg-icon-resource"));
+
+  switch (command) {
+  case ICON_RESOURCE_COMMAND_FORCEUPDATE:
+    g_ptr_array_add(argv, g_strdup("forceupdate"));
+    break;
+  case ICON_RESOURCE_COMMAND_INSTALL:
+    g_ptr_array_add(argv, g_strdup("install"));
+    if (noupdate) {
+      g_ptr_array_add(argv, g_strdup("--noupdate"));
+    }
+    g_ptr_array_add(argv, g_strdup("--mode"));
+    g_ptr_array_add(argv, g_strdup("user"));
+    g_ptr_array_add(argv, g_strdup("--batch"));
+
+    for (int i = 0; i < requests->len; i++) {
+      IconRequest *request = g_ptr_array_index(requests, i);
+      g_ptr_array_add(argv, g_strdup_printf("%d", request->size));
+      g_ptr_array_add(argv, g_canonicalize_filename(request->file, NULL));
+      g_ptr_array_add(argv, g_strdup(request->name));
+    }
+    break;
+  }
+
+  g_ptr_array_add(argv, NULL);
+  return (GStrv)g_ptr_array_free(argv, FALSE);
+}
+
+int icon_resource_install_all(GPtrArray *requests, FlatpakInfo *info, DataDir *host) {
+  g_autoptr(GError) error = NULL;
+
+  // Keep going after a failure so one bad icon doesn't prevent the rest of the
+  // batch from being installed, matching what separate invocations would do.
+  int status = 0;
+  g_autoptr(GArray) policy = load_size_policy();
+  g_autoptr(GHashTable) ready_dirs =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(Manifest) manifest = manifest_load(&error);
+  if (manifest == NULL) {
+    g_warning("Failed to load install manifest: %s", error->message);
+    g_clear_error(&error);
+  }
+
+  IconInstallContext context = {
+      .info = info, .host = host, .ready_dirs = ready_dirs, .manifest = manifest};
+  for (int i = 0; i < requests->len; i++) {
+    IconRequest *request = g_ptr_array_index(requests, i);
+    if (policy != NULL && !size_policy_contains(policy, request->size, request->scale)) {
+      // No shell will look for it, so don't spend the disk space.
+      context.pruned++;
+      continue;
+    }
+
+    g_autoptr(TraceSpan) span = trace_span_begin("install_icon", request->file);
+    if (!install(&context, request, &error)) {
+      g_warning("Failed to install icon file %s: %s", request->file, error->message);
+      g_clear_error(&error);
+      status = 1;
+    }
+  }
+
+  if (policy != NULL) {
+    derive_missing_sizes(&context, requests, policy);
+  }
+
+  IconStoreStats *stats = &context.store_stats;
+  const char *strategy_names[COPY_STRATEGY_N];
+  for (int i = 0; i < COPY_STRATEGY_N; i++) {
+    strategy_names[i] = copy_strategy_to_string(i);
+    g_debug("New icons stored using %s: %u", strategy_names[i],
+            stats->copy_strategy_counts[i]);
+  }
+  trace_counters("icon_copy_strategies", strategy_names, stats->copy_strategy_counts,
+                 COPY_STRATEGY_N);
+
+  g_debug("Icons already stored: %u, written: %u, unchanged: %u", stats->shared,
+          stats->written, stats->unchanged);
+  g_debug("Icons derived: %u, pruned: %u", context.derived, context.pruned);
+
+  return status;
+}
+
+// Installs the requested icons, then (unless Chromium said more are coming with
+// --noupdate) regenerates the icon cache if there is one. forceupdate only does
+// the latter, and creates the cache if it's missing.
+int icon_resource_run(IconResourceCommand command, GPtrArray *requests, gboolean noupdate,
+                      FlatpakInfo *info, DataDir *host) {
+  int status = 0;
+  if (command == ICON_RESOURCE_COMMAND_INSTALL) {
+    status = icon_resource_install_all(requests, info, host);
+    if (noupdate) {
+      return status;
+    }
+  }
+
+  g_autoptr(GError) error = NULL;
+  g_autoptr(TraceSpan) span = trace_span_begin("icon_cache_update", NULL);
+  if (!icon_cache_update(host, command == ICON_RESOURCE_COMMAND_FORCEUPDATE,
+                         &error)) {
+    g_warning("Failed to update icon cache: %s", error->message);
+    return 1;
+  }
+
+  return status;
+}
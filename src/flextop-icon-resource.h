@@ -0,0 +1,44 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "flextop-utils.h"
+
+typedef enum {
+  ICON_RESOURCE_COMMAND_INSTALL,
+  ICON_RESOURCE_COMMAND_FORCEUPDATE,
+} IconResourceCommand;
+
+typedef struct IconRequest {
+  int size;
+  // The HiDPI scale of the destination directory, i.e. 2 for 32x32@2.
+  int scale;
+  char *file;
+  char *name;
+} IconRequest;
+
+void icon_request_free(IconRequest *request);
+
+gboolean icon_resource_parse_args(int argc, char **argv, IconResourceCommand *out_command,
+                                  GPtrArray *out_requests, gboolean *out_read_stdin,
+                                  gboolean *out_noupdate);
+gboolean icon_resource_read_requests_from_stdin(GPtrArray *requests, GError **error);
+GStrv icon_resource_build_service_argv(IconResourceCommand command, GPtrArray *requests,
+                                       gboolean noupdate);
+
+int icon_resource_install_all(GPtrArray *requests, FlatpakInfo *info, DataDir *host);
+int icon_resource_run(IconResourceCommand command, GPtrArray *requests, gboolean noupdate,
+                      FlatpakInfo *info, DataDir *host);
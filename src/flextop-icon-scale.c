@@ -0,0 +1,320 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Scales square PNG icons down with a box filter, i.e. every output pixel is
+// the area-weighted average of the input pixels it covers, done on
+// premultiplied colors so transparent pixels don't bleed into the edges. The
+// input is streamed one row at a time, so memory use only depends on the width
+// of the image, not its height. Each pixel is held in a 4-float vector, so the
+// filter's arithmetic compiles to SIMD instructions.
+
+#include "flextop-icon-scale.h"
+
+#ifdef HAVE_LIBPNG
+
+#include <errno.h>
+#include <png.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef float v4sf __attribute__((vector_size(16)));
+
+typedef struct PngScaler {
+  FILE *in;
+  FILE *out;
+  png_structp read;
+  png_infop read_info;
+  png_structp write;
+  png_infop write_info;
+  jmp_buf jmp;
+  char *error_message;
+
+  guint8 *in_row;
+  guint8 *out_row;
+  v4sf *in_pixels;
+  v4sf *reduced;
+  v4sf *acc;
+
+  // For every output column, the input columns it covers and their weights.
+  int *firsts;
+  int *counts;
+  int *offsets;
+  float *weights;
+} PngScaler;
+
+static void png_scaler_free(PngScaler *scaler) {
+  if (scaler->read != NULL) {
+    png_destroy_read_struct(&scaler->read, &scaler->read_info, NULL);
+  }
+
+  if (scaler->write != NULL) {
+    png_destroy_write_struct(&scaler->write, &scaler->write_info);
+  }
+
+  if (scaler->in != NULL) {
+    fclose(scaler->in);
+  }
+
+  if (scaler->out != NULL) {
+    fclose(scaler->out);
+  }
+
+  g_free(scaler->error_message);
+  g_free(scaler->in_row);
+  g_free(scaler->out_row);
+  g_free(scaler->in_pixels);
+  g_free(scaler->reduced);
+  g_free(scaler->acc);
+  g_free(scaler->firsts);
+  g_free(scaler->counts);
+  g_free(scaler->offsets);
+  g_free(scaler->weights);
+  g_free(scaler);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(PngScaler, png_scaler_free)
+
+static void on_png_error(png_structp png, png_const_charp message) {
+  PngScaler *scaler = png_get_error_ptr(png);
+  g_free(scaler->error_message);
+  scaler->error_message = g_strdup(message);
+  longjmp(scaler->jmp, 1);
+}
+
+static void on_png_warning(png_structp png, png_const_charp message) {
+  g_debug("libpng: %s", message);
+}
+
+static inline v4sf v4sf_splat(float value) { return (v4sf){value, value, value, value}; }
+
+// Works in units of 1/(in_size * out_size) of the image, so every input pixel
+// spans out_size units and every output pixel spans in_size units, and the
+// overlaps are exact.
+static void compute_weights(PngScaler *scaler, int in_size, int out_size) {
+  scaler->firsts = g_new(int, out_size);
+  scaler->counts = g_new(int, out_size);
+  scaler->offsets = g_new(int, out_size);
+  // Each output pixel covers at most in_size / out_size + 2 input pixels.
+  scaler->weights = g_new(float, out_size * (in_size / out_size + 2));
+
+  int offset = 0;
+  for (int x = 0; x < out_size; x++) {
+    gint64 start = (gint64)x * in_size;
+    gint64 end = start + in_size;
+    int first = start / out_size;
+    int last = (end - 1) / out_size;
+
+    scaler->firsts[x] = first;
+    scaler->counts[x] = last - first + 1;
+    scaler->offsets[x] = offset;
+    for (int i = first; i <= last; i++) {
+      gint64 covered =
+          MIN((gint64)(i + 1) * out_size, end) - MAX((gint64)i * out_size, start);
+      scaler->weights[offset++] = (float)covered / in_size;
+    }
+  }
+}
+
+static void reduce_row(PngScaler *scaler, int in_size, int out_size) {
+  const float inv_255 = 1.0f / 255.0f;
+  for (int x = 0; x < in_size; x++) {
+    const guint8 *pixel = scaler->in_row + x * 4;
+    v4sf color = {pixel[0], pixel[1], pixel[2], 255.0f};
+    scaler->in_pixels[x] = color * v4sf_splat(pixel[3] * inv_255);
+  }
+
+  for (int x = 0; x < out_size; x++) {
+    const v4sf *in = scaler->in_pixels + scaler->firsts[x];
+    const float *weights = scaler->weights + scaler->offsets[x];
+    v4sf sum = v4sf_splat(0);
+    for (int i = 0; i < scaler->counts[x]; i++) {
+      sum += in[i] * v4sf_splat(weights[i]);
+    }
+
+    scaler->reduced[x] = sum;
+  }
+}
+
+static void accumulate_row(PngScaler *scaler, int out_size, float weight) {
+  v4sf w = v4sf_splat(weight);
+  for (int x = 0; x < out_size; x++) {
+    scaler->acc[x] += scaler->reduced[x] * w;
+  }
+}
+
+static void emit_row(PngScaler *scaler, int out_size) {
+  for (int x = 0; x < out_size; x++) {
+    v4sf pixel = scaler->acc[x];
+    float alpha = pixel[3];
+    v4sf color = alpha > 0 ? pixel * v4sf_splat(255.0f / alpha) : v4sf_splat(0);
+    color[3] = alpha;
+    color += v4sf_splat(0.5f);
+
+    guint8 *out = scaler->out_row + x * 4;
+    for (int c = 0; c < 4; c++) {
+      out[c] = CLAMP(color[c], 0.0f, 255.0f);
+    }
+
+    scaler->acc[x] = v4sf_splat(0);
+  }
+
+  png_write_row(scaler->write, scaler->out_row);
+}
+
+gboolean icon_scale_png(const char *source, const char *dest, int size, GError **error) {
+  g_autoptr(PngScaler) scaler = g_new0(PngScaler, 1);
+
+  scaler->in = fopen(source, "rb");
+  if (scaler->in == NULL) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open %s: %s",
+                source, g_strerror(err));
+    return FALSE;
+  }
+
+  scaler->out = fopen(dest, "wb");
+  if (scaler->out == NULL) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open %s: %s",
+                dest, g_strerror(err));
+    return FALSE;
+  }
+
+  scaler->read = png_create_read_struct(PNG_LIBPNG_VER_STRING, scaler, on_png_error,
+                                        on_png_warning);
+  scaler->read_info = scaler->read != NULL ? png_create_info_struct(scaler->read) : NULL;
+  scaler->write = png_create_write_struct(PNG_LIBPNG_VER_STRING, scaler, on_png_error,
+                                          on_png_warning);
+  scaler->write_info =
+      scaler->write != NULL ? png_create_info_struct(scaler->write) : NULL;
+  if (scaler->read_info == NULL || scaler->write_info == NULL) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to initialize libpng");
+    return FALSE;
+  }
+
+  if (setjmp(scaler->jmp)) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Scaling %s: %s", source,
+                scaler->error_message);
+    return FALSE;
+  }
+
+  png_init_io(scaler->read, scaler->in);
+  png_read_info(scaler->read, scaler->read_info);
+
+  png_uint_32 width, height;
+  int bit_depth, color_type, interlace;
+  png_get_IHDR(scaler->read, scaler->read_info, &width, &height, &bit_depth, &color_type,
+               &interlace, NULL, NULL);
+  if (interlace != PNG_INTERLACE_NONE) {
+    // Interlaced images can't be streamed a row at a time.
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                "Scaling %s: interlaced images are not supported", source);
+    return FALSE;
+  } else if (width != height || width <= size) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                "Scaling %s: can't scale a %ux%u image down to %dx%d", source, width,
+                height, size, size);
+    return FALSE;
+  }
+
+  // Normalize everything to 8-bit RGBA.
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_set_palette_to_rgb(scaler->read);
+  }
+
+  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
+    png_set_expand_gray_1_2_4_to_8(scaler->read);
+  }
+
+  gboolean has_trns = png_get_valid(scaler->read, scaler->read_info, PNG_INFO_tRNS);
+  if (has_trns) {
+    png_set_tRNS_to_alpha(scaler->read);
+  }
+
+  if (bit_depth == 16) {
+    png_set_strip_16(scaler->read);
+  }
+
+  if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+    png_set_gray_to_rgb(scaler->read);
+  }
+
+  if (!(color_type & PNG_COLOR_MASK_ALPHA) && !has_trns) {
+    png_set_filler(scaler->read, 0xff, PNG_FILLER_AFTER);
+  }
+
+  png_read_update_info(scaler->read, scaler->read_info);
+
+  png_init_io(scaler->write, scaler->out);
+  png_set_IHDR(scaler->write, scaler->write_info, size, size, 8, PNG_COLOR_TYPE_RGBA,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(scaler->write, scaler->write_info);
+
+  scaler->in_row = g_malloc(width * 4);
+  scaler->out_row = g_malloc(size * 4);
+  scaler->in_pixels = g_new(v4sf, width);
+  scaler->reduced = g_new(v4sf, size);
+  scaler->acc = g_new0(v4sf, size);
+  compute_weights(scaler, width, size);
+
+  // Same units as compute_weights, but vertically: as the input rows stream
+  // in, each one is added to the output row it overlaps, and since the image
+  // only shrinks, a row can straddle at most one boundary between output rows.
+  gint64 row_end = height;
+  for (png_uint_32 y = 0; y < height; y++) {
+    png_read_row(scaler->read, scaler->in_row, NULL);
+    reduce_row(scaler, width, size);
+
+    gint64 start = (gint64)y * size;
+    gint64 end = start + size;
+    if (end <= row_end) {
+      accumulate_row(scaler, size, (float)size / height);
+    } else {
+      accumulate_row(scaler, size, (float)(row_end - start) / height);
+      emit_row(scaler, size);
+      row_end += height;
+      accumulate_row(scaler, size, (float)(end - (row_end - height)) / height);
+    }
+
+    if (end == row_end) {
+      emit_row(scaler, size);
+      row_end += height;
+    }
+  }
+
+  png_read_end(scaler->read, NULL);
+  png_write_end(scaler->write, NULL);
+
+  FILE *out = g_steal_pointer(&scaler->out);
+  if (fclose(out) == EOF) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to write %s: %s",
+                dest, g_strerror(err));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+#else
+
+gboolean icon_scale_png(const char *source, const char *dest, int size, GError **error) {
+  g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+              "Scaling icons requires building with libpng");
+  return FALSE;
+}
+
+#endif
@@ -0,0 +1,283 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Icons are stored once per unique content as blobs named after their SHA-256,
+// and the hicolor entries are hardlinks to them. The blob's link count doubles
+// as its reference count: once it drops back to 1, nothing in hicolor uses it
+// anymore.
+//
+// The store has to live inside the host icons directory, since Flatpak exposes
+// that as its own bind mount and hardlinks can't cross mounts.
+//
+// Checking a blob's link count and then acting on it is only safe while nobody
+// else can link or unlink it in between, so that's done under the blob's lock.
+// The blobs are spread over a few locks by checksum, so that installs of different
+// icons rarely wait on each other. Computing checksums, which is the expensive
+// part, happens outside of them.
+
+#include "flextop-icon-store.h"
+#include "flextop-lock.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+char *icon_store_get_path(DataDir *host) {
+  return g_build_filename(g_file_peek_path(host->icons), ".flextop-store", NULL);
+}
+
+static char *get_blob_path(DataDir *host, const char *checksum) {
+  g_autofree char *store = icon_store_get_path(host);
+  g_autofree char *blob_name = g_strdup_printf("%s.png", checksum);
+  return g_build_filename(store, blob_name, NULL);
+}
+
+#define SHA256_HEX_LENGTH 64
+
+// One of 16 locks, picked by the first digit of the checksum.
+static LockFd lock_blob(DataDir *host, const char *checksum, GError **error) {
+  g_autofree char *store = icon_store_get_path(host);
+  if (g_mkdir_with_parents(store, 0755) == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to create icon store %s: %s", store, g_strerror(err));
+    return -1;
+  }
+
+  char lock_name[] = ".lock-?";
+  lock_name[strlen(lock_name) - 1] = checksum[0];
+  g_autofree char *lock_path = g_build_filename(store, lock_name, NULL);
+  return lock_acquire(lock_path, LOCK_MODE_EXCLUSIVE, LOCK_DEFAULT_TIMEOUT_MS, error);
+}
+
+// Removes the blob if nothing in hicolor links to it anymore. Returns whether it
+// did.
+static gboolean release_blob(DataDir *host, const char *checksum) {
+  g_autofree char *blob = get_blob_path(host, checksum);
+
+  g_autoptr(GError) error = NULL;
+  g_auto(LockFd) lock = lock_blob(host, checksum, &error);
+  if (lock == -1) {
+    g_warning("Failed to lock icon blob %s: %s", blob, error->message);
+    return FALSE;
+  }
+
+  struct stat st;
+  if (stat(blob, &st) == -1) {
+    if (errno != ENOENT) {
+      g_warning("Failed to stat icon blob %s: %s", blob, g_strerror(errno));
+    }
+
+    return FALSE;
+  }
+
+  if (st.st_nlink != 1) {
+    return FALSE;
+  }
+
+  g_debug("Removing unused icon blob %s", blob);
+  if (unlink(blob) == -1) {
+    if (errno != ENOENT) {
+      g_warning("Failed to remove icon blob %s: %s", blob, g_strerror(errno));
+    }
+
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Returns the checksum of the blob that path is linked to, if any.
+static char *get_linked_blob_checksum(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_nlink < 2) {
+    return NULL;
+  }
+
+  return compute_file_checksum(path, NULL);
+}
+
+// If out_checksum is given, it's set to the checksum of the installed contents.
+// allow_hardlink says whether source may become the blob itself, which is only
+// the case for our own temporary files, since anyone else's could be modified
+// afterwards.
+gboolean icon_store_install(DataDir *host, const char *source, const char *dest,
+                            gboolean allow_hardlink, IconStoreStats *stats,
+                            char **out_checksum, GError **error) {
+  g_autofree char *checksum = compute_file_checksum(source, error);
+  if (checksum == NULL) {
+    return FALSE;
+  }
+
+  g_autofree char *blob = get_blob_path(host, checksum);
+
+  g_auto(LockFd) lock = lock_blob(host, checksum, error);
+  if (lock == -1) {
+    return FALSE;
+  }
+
+  struct stat blob_st;
+  if (stat(blob, &blob_st) == -1) {
+    if (errno != ENOENT) {
+      int err = errno;
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to stat %s: %s",
+                  blob, g_strerror(err));
+      return FALSE;
+    }
+
+    CopyStrategy strategy;
+    if (!copy_file_fast(source, blob, allow_hardlink, &strategy, error)) {
+      return FALSE;
+    }
+
+    if (stat(blob, &blob_st) == -1) {
+      int err = errno;
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to stat %s: %s",
+                  blob, g_strerror(err));
+      return FALSE;
+    }
+
+    stats->copy_strategy_counts[strategy]++;
+  } else {
+    stats->shared++;
+  }
+
+  struct stat dest_st;
+  gboolean dest_exists = lstat(dest, &dest_st) == 0 && S_ISREG(dest_st.st_mode);
+  if (dest_exists && dest_st.st_dev == blob_st.st_dev &&
+      dest_st.st_ino == blob_st.st_ino) {
+    stats->unchanged++;
+    if (out_checksum != NULL) {
+      *out_checksum = g_steal_pointer(&checksum);
+    }
+
+    return TRUE;
+  }
+
+  // If dest is being replaced, the blob it was linked to may become unused. A
+  // plain copy with the same contents (left from when linking wasn't possible)
+  // is kept as-is, since rewriting it would only make the icon theme reload.
+  gboolean dest_linked = dest_exists && dest_st.st_nlink >= 2;
+  g_autofree char *old_checksum = NULL;
+  if (dest_linked || (dest_exists && dest_st.st_size == blob_st.st_size)) {
+    old_checksum = compute_file_checksum(dest, NULL);
+  }
+
+  if (old_checksum != NULL && strcmp(old_checksum, checksum) == 0) {
+    stats->unchanged++;
+    if (out_checksum != NULL) {
+      *out_checksum = g_steal_pointer(&checksum);
+    }
+
+    return TRUE;
+  }
+
+  if (!dest_linked) {
+    g_clear_pointer(&old_checksum, g_free);
+  }
+
+  g_autoptr(GError) link_error = NULL;
+  if (!replace_with_hardlink(blob, dest, &link_error)) {
+    g_debug("Falling back to copying icon: %s", link_error->message);
+
+    CopyStrategy strategy;
+    if (!copy_file_fast(blob, dest, FALSE, &strategy, error)) {
+      return FALSE;
+    }
+  }
+
+  // The old blob may be under another lock, and holding both at once could deadlock
+  // with an install going the other way.
+  close(lock);
+  lock = -1;
+  if (old_checksum != NULL) {
+    release_blob(host, old_checksum);
+  }
+
+  stats->written++;
+
+  if (out_checksum != NULL) {
+    *out_checksum = g_steal_pointer(&checksum);
+  }
+
+  return TRUE;
+}
+
+gboolean icon_store_remove(DataDir *host, const char *path, GError **error) {
+  // Plain copies don't touch the store. Dropping a link needs no lock, since
+  // release_blob() checks what's left under the blob's.
+  g_autofree char *checksum = get_linked_blob_checksum(path);
+
+  if (unlink(path) == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to delete %s: %s",
+                path, g_strerror(err));
+    return FALSE;
+  }
+
+  if (checksum != NULL) {
+    release_blob(host, checksum);
+  }
+
+  return TRUE;
+}
+
+static gboolean is_blob_name(const char *name) {
+  return strspn(name, "0123456789abcdef") == SHA256_HEX_LENGTH &&
+         strcmp(name + SHA256_HEX_LENGTH, ".png") == 0;
+}
+
+// Removes every blob nothing in hicolor links to anymore. Normally the last icon
+// to go releases its blob, but a tool killed in between the two leaves the blob
+// behind.
+gboolean icon_store_collect_garbage(DataDir *host, GError **error) {
+  g_autofree char *store = icon_store_get_path(host);
+  DIR *dp = opendir(store);
+  if (dp == NULL) {
+    int err = errno;
+    if (err == ENOENT) {
+      return TRUE;
+    }
+
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open %s: %s",
+                store, g_strerror(err));
+    return FALSE;
+  }
+
+  // The link counts are checked again under each blob's lock, since one may have
+  // been linked to since.
+  g_autoptr(GPtrArray) unused = g_ptr_array_new_with_free_func(g_free);
+  struct dirent *dent;
+  while ((dent = readdir(dp)) != NULL) {
+    struct stat st;
+    if (is_blob_name(dent->d_name) &&
+        fstatat(dirfd(dp), dent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        S_ISREG(st.st_mode) && st.st_nlink == 1) {
+      g_ptr_array_add(unused, g_strndup(dent->d_name, SHA256_HEX_LENGTH));
+    }
+  }
+  closedir(dp);
+
+  guint removed = 0;
+  for (int i = 0; i < unused->len; i++) {
+    removed += release_blob(host, g_ptr_array_index(unused, i));
+  }
+
+  g_debug("Removed %u unused icon blobs", removed);
+  return TRUE;
+}
@@ -0,0 +1,37 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "flextop-utils.h"
+
+typedef struct IconStoreStats {
+  // How the blobs that were new to the store got there.
+  guint copy_strategy_counts[COPY_STRATEGY_N];
+  // Icons whose contents were already in the store.
+  guint shared;
+  // Icons that were written to their destination.
+  guint written;
+  // Icons whose destination already had the right contents, and were left alone.
+  guint unchanged;
+} IconStoreStats;
+
+char *icon_store_get_path(DataDir *host);
+
+gboolean icon_store_install(DataDir *host, const char *source, const char *dest,
+                            gboolean allow_hardlink, IconStoreStats *stats,
+                            char **out_checksum, GError **error);
+gboolean icon_store_remove(DataDir *host, const char *path, GError **error);
+gboolean icon_store_collect_garbage(DataDir *host, GError **error);
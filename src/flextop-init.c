@@ -13,84 +13,68 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <https://www.gnu.org/licenses/>. */
 
+#include "flextop-dir-scan.h"
+#include "flextop-lock.h"
+#include "flextop-trace.h"
 #include "flextop-utils.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
-#include <sys/file.h>
-
-typedef int LockFd;
-G_DEFINE_AUTO_CLEANUP_FREE_FUNC(LockFd, close, -1)
-
-LockFd acquire_lock(FlatpakInfo *info, GError **error) {
-  g_autofree char *lock_filename =
-      g_build_filename(g_get_user_runtime_dir(), "app", info->app, ".flextop-lock", NULL);
-  int fd = open(lock_filename, O_CREAT | O_RDWR, 0600);
-  if (fd == -1) {
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIGRATION_STAMP_NAME "prefixed-app-ids"
+
+// Launches only hold the watch lock for an instant, so a watcher that still can't
+// get it after this long is competing with another watcher.
+#define WATCH_LOCK_TIMEOUT_MS 1000
+
+// Points the symlink name inside dir_fd at target, replacing whatever symlink was
+// there with a single rename.
+gboolean atomic_relink(int dir_fd, const char *name, const char *target,
+                       GError **error) {
+  g_autofree char *temp_name = g_strdup_printf("%s.tmp", name);
+
+  if (unlinkat(dir_fd, temp_name, 0) == -1 && errno != ENOENT) {
     int err = errno;
-    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open lock: %s",
-                strerror(err));
-    return -1;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Deleting old symlink %s: %s", temp_name, g_strerror(err));
+    return FALSE;
   }
 
-  if (flock(fd, LOCK_EX) == -1) {
-    close(fd);
-
+  if (symlinkat(target, dir_fd, temp_name) == -1) {
     int err = errno;
-    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to set lock: %s",
-                strerror(err));
-    return -1;
-  }
-
-  return fd;
-}
-
-gboolean atomic_relink(GFile *link, const char *target, GError **error) {
-  g_autofree char *temp_path = g_strdup_printf("%s.tmp", g_file_peek_path(link));
-  g_autoptr(GFile) temp = g_file_new_for_path(temp_path);
-
-  if (!g_file_delete(temp, NULL, error)) {
-    if (!g_error_matches(*error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
-      g_prefix_error(error, "Deleting old symlink: ");
-      return FALSE;
-    }
-
-    g_clear_error(error);
-  }
-
-  if (!g_file_make_symbolic_link(temp, target, NULL, error)) {
-    g_prefix_error(error, "Symlink %s as %s: ", target, temp_path);
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Symlink %s as %s: %s",
+                target, temp_name, g_strerror(err));
     return FALSE;
   }
 
-  if (!g_file_move(temp, link,
-                   G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_NO_FALLBACK_FOR_MOVE |
-                       G_FILE_COPY_OVERWRITE,
-                   NULL, NULL, NULL, error)) {
-    g_prefix_error(error, "Overwriting symlink: ");
+  if (renameat(dir_fd, temp_name, dir_fd, name) == -1) {
+    int err = errno;
+    unlinkat(dir_fd, temp_name, 0);
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Overwriting symlink %s: %s", name, g_strerror(err));
     return FALSE;
   }
 
   return TRUE;
 }
 
-GFile *get_sibling_file(GFile *file, const char *sibling_name) {
-  g_autoptr(GFile) parent = g_file_get_parent(file);
-  return g_file_get_child(parent, sibling_name);
-}
-
-gboolean migrate_prefix_desktop_file(FlatpakInfo *info, GFile *file, GFileInfo *file_info,
-                                     GError **error) {
+gboolean migrate_prefix_desktop_file(FlatpakInfo *info, int dir_fd, const char *path,
+                                     const char *name, GError **error) {
   g_autofree char *prefix = g_strdup_printf("%s.", info->app);
-  if (g_str_has_prefix(g_file_info_get_name(file_info), prefix)) {
+  if (g_str_has_prefix(name, prefix)) {
     // Already migrated.
     return TRUE;
   }
 
   g_autoptr(GKeyFile) key_file = g_key_file_new();
-  if (!g_key_file_load_from_file(key_file, g_file_peek_path(file), G_KEY_FILE_NONE,
-                                 error)) {
+  if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, error)) {
     return FALSE;
   }
 
@@ -101,15 +85,11 @@ gboolean migrate_prefix_desktop_file(FlatpakInfo *info, GFile *file, GFileInfo *
     return TRUE;
   }
 
-  g_debug("Migrate file: %s", g_file_peek_path(file));
+  g_debug("Migrate file: %s", path);
 
-  g_autofree char *prefixed_basename =
-      flatpak_info_add_desktop_file_prefix(info, g_file_info_get_name(file_info));
-  g_autoptr(GFile) prefixed_file = get_sibling_file(file, prefixed_basename);
-
-  if (!g_file_move(file, prefixed_file, G_FILE_COPY_NO_FALLBACK_FOR_MOVE, NULL, NULL,
-                   NULL, error)) {
-    g_prefix_error(error, "Migrating desktop file %s", g_file_peek_path(file));
+  g_autofree char *prefixed_name = flatpak_info_add_desktop_file_prefix(info, name);
+  if (!rename_at_noreplace(dir_fd, name, dir_fd, prefixed_name, error)) {
+    g_prefix_error(error, "Migrating desktop file %s: ", path);
     return FALSE;
   }
 
@@ -123,38 +103,31 @@ gboolean migrate_prefix_all_desktop_files(FlatpakInfo *info, DataDir *priv,
     return FALSE;
   }
 
-  g_autoptr(GFile) migration_stamp = g_file_get_child(flextop_data, "prefixed-app-ids");
+  g_autoptr(GFile) migration_stamp = g_file_get_child(flextop_data, MIGRATION_STAMP_NAME);
   if (g_file_query_exists(migration_stamp, NULL)) {
     // Already migrated.
     return TRUE;
   }
 
-  g_autoptr(GFileEnumerator) enumerator = g_file_enumerate_children(
-      priv->applications,
-      G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
-      G_FILE_QUERY_INFO_NONE, NULL, error);
-  if (enumerator == NULL) {
-    if (g_error_matches(*error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
-      g_clear_error(error);
-    } else {
-      g_prefix_error(error, "Enumerating files to migrate");
+  const char *applications = g_file_peek_path(priv->applications);
+  g_autoptr(GPtrArray) entries = dir_scan_regular_files(applications, ".desktop", error);
+  if (entries == NULL) {
+    g_prefix_error(error, "Enumerating files to migrate");
+    return FALSE;
+  }
+
+  if (entries->len > 0) {
+    // Every move stays inside the folder, so it only has to be resolved once.
+    int applications_fd = data_dir_get_fd(priv, DATA_DIR_APPLICATIONS, error);
+    if (applications_fd == -1) {
       return FALSE;
     }
-  } else {
-    for (;;) {
-      GFileInfo *child_info = NULL;
-      GFile *child = NULL;
-
-      if (!g_file_enumerator_iterate(enumerator, &child_info, &child, NULL, error)) {
-        return FALSE;
-      } else if (child_info == NULL) {
-        // No more files.
-        break;
-      }
 
-      if (g_file_info_get_file_type(child_info) == G_FILE_TYPE_REGULAR &&
-          g_str_has_suffix(g_file_info_get_name(child_info), ".desktop") &&
-          !migrate_prefix_desktop_file(info, child, child_info, error)) {
+    for (int i = 0; i < entries->len; i++) {
+      DirScanEntry *entry = g_ptr_array_index(entries, i);
+      g_autofree char *path = g_build_filename(applications, entry->name, NULL);
+      g_autoptr(TraceSpan) span = trace_span_begin("migrate_prefix_desktop_file", path);
+      if (!migrate_prefix_desktop_file(info, applications_fd, path, entry->name, error)) {
         return FALSE;
       }
     }
@@ -168,46 +141,69 @@ gboolean migrate_prefix_all_desktop_files(FlatpakInfo *info, DataDir *priv,
   return TRUE;
 }
 
+// Checks if a previous run already left the applications folder linked to the
+// host's and migrated, which only takes reads.
+static gboolean applications_folder_is_set_up(DataDir *host, DataDir *priv) {
+  g_autofree char *target = g_file_read_link(g_file_peek_path(priv->applications), NULL);
+  if (g_strcmp0(target, g_file_peek_path(host->applications)) != 0 ||
+      !g_file_test(target, G_FILE_TEST_IS_DIR)) {
+    return FALSE;
+  }
+
+  g_autofree char *migration_stamp =
+      g_build_filename(g_get_user_data_dir(), "flextop", MIGRATION_STAMP_NAME, NULL);
+  return g_file_test(migration_stamp, G_FILE_TEST_EXISTS);
+}
+
 gboolean setup_applications_folder(FlatpakInfo *info, DataDir *host, DataDir *priv,
                                    GError **error) {
+  if (applications_folder_is_set_up(host, priv)) {
+    return TRUE;
+  }
+
+  g_auto(LockFd) lock = lock_acquire_applications(info, LOCK_MODE_EXCLUSIVE, error);
+  if (lock == -1) {
+    return FALSE;
+  }
+
   if (!mkdir_with_parents_exists_ok(host->applications, error)) {
     return FALSE;
   }
 
-  GFileInfo *applications_info =
-      g_file_query_info(priv->applications, G_FILE_ATTRIBUTE_STANDARD_TYPE,
-                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, error);
-  if (!applications_info) {
-    if (!g_error_matches(*error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
-      g_prefix_error(error, "query %s", g_file_peek_path(priv->applications));
+  // Everything below works relative to the private root, so the applications path
+  // can't be swapped out from under the checks by something racing with us.
+  int root_fd = data_dir_get_fd(priv, DATA_DIR_ROOT, error);
+  if (root_fd == -1) {
+    return FALSE;
+  }
+
+  struct stat applications_st;
+  gboolean should_migrate = TRUE;
+  if (fstatat(root_fd, "applications", &applications_st, AT_SYMLINK_NOFOLLOW) == -1) {
+    if (errno != ENOENT) {
+      int err = errno;
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "query %s: %s",
+                  g_file_peek_path(priv->applications), g_strerror(err));
       return FALSE;
     }
 
-    g_clear_error(error);
+    should_migrate = FALSE;
   }
 
-  gboolean should_migrate = applications_info != NULL;
-
   // If the applications path exists as a directory already, then someone has
   // tried installing PWAs or creating shortcuts without flextop. For safety,
   // it's easiest to just rename it to the first other path we can.
-  if (applications_info &&
-      g_file_info_get_file_type(applications_info) == G_FILE_TYPE_DIRECTORY) {
+  if (should_migrate && S_ISDIR(applications_st.st_mode)) {
     for (int i = 0;; i++) {
-      g_autofree char *new_name =
-          g_strdup_printf("%s.%d", g_file_peek_path(priv->applications), i);
-      GFile *new_file = g_file_new_for_path(new_name);
-      if (!g_file_move(priv->applications, new_file,
-                       G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_NO_FALLBACK_FOR_MOVE,
-                       NULL, NULL, NULL, error)) {
+      g_autofree char *new_name = g_strdup_printf("applications.%d", i);
+      if (!rename_at_noreplace(root_fd, "applications", root_fd, new_name, error)) {
         if (g_error_matches(*error, G_IO_ERROR, G_IO_ERROR_EXISTS)) {
           // Just try the next name.
           g_clear_error(error);
           continue;
         }
 
-        g_prefix_error(error, "Rename %s -> %s", g_file_peek_path(priv->applications),
-                       g_file_peek_path(new_file));
+        g_prefix_error(error, "Rename %s: ", g_file_peek_path(priv->applications));
         return FALSE;
       }
 
@@ -215,10 +211,16 @@ gboolean setup_applications_folder(FlatpakInfo *info, DataDir *host, DataDir *pr
     }
   }
 
-  if (!atomic_relink(priv->applications, g_file_peek_path(host->applications), error)) {
+  if (!atomic_relink(root_fd, "applications", g_file_peek_path(host->applications),
+                     error)) {
     return FALSE;
   }
 
+  // Anything opened through the old applications path is stale now.
+  data_dir_close_fd(priv, DATA_DIR_APPLICATIONS);
+
+  g_autoptr(TraceSpan) span =
+      should_migrate ? trace_span_begin("migrate_prefix_all_desktop_files", NULL) : NULL;
   if (should_migrate && !migrate_prefix_all_desktop_files(info, priv, error)) {
     return FALSE;
   }
@@ -226,81 +228,507 @@ gboolean setup_applications_folder(FlatpakInfo *info, DataDir *host, DataDir *pr
   return TRUE;
 }
 
-gboolean delete_invalid_desktop_files(GError **error) {
+#define SWEEP_CACHE_MAGIC "FLXSWEEP3"
+#define SWEEP_CACHE_VERDICT_KEEP 'k'
+
+// Remembers which files on the Desktop were already inspected and kept, so the
+// sweep that runs on every browser launch only has to look at new or changed
+// files. It's only valid for the CHROME_WRAPPER it was built with.
+typedef struct SweepCache {
+  char *chrome_wrapper;
+  guint64 dir_inode;
+  gint64 dir_mtime_sec;
+  gint64 dir_mtime_nsec;
+  // When the Desktop was stat'd, in seconds of the coarse clock that timestamps
+  // come from. Anything with an mtime in or after that second may have changed
+  // again right after it was looked at without its mtime moving, since
+  // filesystem timestamps can be as coarse as a second.
+  gint64 sweep_time_sec;
+  // file name -> DirScanEntry
+  GHashTable *entries;
+} SweepCache;
+
+static SweepCache *sweep_cache_new(const char *chrome_wrapper) {
+  SweepCache *cache = g_new0(SweepCache, 1);
+  cache->chrome_wrapper = g_strdup(chrome_wrapper);
+  cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                         (GDestroyNotify)dir_scan_entry_free);
+  return cache;
+}
+
+static void sweep_cache_add(SweepCache *cache, DirScanEntry *entry) {
+  DirScanEntry *copy = g_new(DirScanEntry, 1);
+  *copy = *entry;
+  copy->name = g_strdup(entry->name);
+  g_hash_table_replace(cache->entries, copy->name, copy);
+}
+
+static void sweep_cache_free(SweepCache *cache) {
+  g_free(cache->chrome_wrapper);
+  g_hash_table_unref(cache->entries);
+  g_free(cache);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(SweepCache, sweep_cache_free)
+
+static char *get_sweep_cache_path(GError **error) {
+  g_autoptr(GFile) flextop_data = get_flextop_data_dir(error);
+  if (flextop_data == NULL) {
+    return NULL;
+  }
+
+  return g_build_filename(g_file_peek_path(flextop_data), "desktop-sweep-cache", NULL);
+}
+
+// Returns NULL if the cache doesn't exist or can't be used, in which case every
+// file gets inspected again.
+static SweepCache *sweep_cache_load(const char *path) {
+  g_autofree char *contents = NULL;
+  if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+    return NULL;
+  }
+
+  g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+  if (g_strv_length(lines) < 3 || strcmp(lines[0], SWEEP_CACHE_MAGIC) != 0) {
+    return NULL;
+  }
+
+  g_autofree char *chrome_wrapper = g_strcompress(lines[1]);
+  g_autoptr(SweepCache) cache = sweep_cache_new(chrome_wrapper);
+  if (sscanf(lines[2],
+             "%" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+             " %" G_GINT64_FORMAT,
+             &cache->dir_inode, &cache->dir_mtime_sec, &cache->dir_mtime_nsec,
+             &cache->sweep_time_sec) != 4) {
+    return NULL;
+  }
+
+  for (char **line = lines + 3; *line != NULL; line++) {
+    if (**line == '\0') {
+      continue;
+    }
+
+    DirScanEntry entry;
+    char verdict;
+    int name_offset;
+    if (sscanf(*line,
+               "%" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+               " %" G_GINT64_FORMAT " %c %n",
+               &entry.inode, &entry.mtime_sec, &entry.mtime_nsec, &entry.size, &verdict,
+               &name_offset) != 5 ||
+        verdict != SWEEP_CACHE_VERDICT_KEEP) {
+      g_debug("Skipping malformed sweep cache entry: %s", *line);
+      continue;
+    }
+
+    g_autofree char *name = g_strcompress(*line + name_offset);
+    entry.name = name;
+    sweep_cache_add(cache, &entry);
+  }
+
+  return g_steal_pointer(&cache);
+}
+
+static gboolean sweep_cache_save(SweepCache *cache, const char *path, GError **error) {
+  g_autoptr(GString) contents = g_string_new(SWEEP_CACHE_MAGIC "\n");
+
+  g_autofree char *escaped_wrapper = g_strescape(cache->chrome_wrapper, NULL);
+  g_string_append_printf(contents, "%s\n", escaped_wrapper);
+  g_string_append_printf(contents,
+                         "%" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+                         " %" G_GINT64_FORMAT "\n",
+                         cache->dir_inode, cache->dir_mtime_sec, cache->dir_mtime_nsec,
+                         cache->sweep_time_sec);
+
+  GHashTableIter iter;
+  gpointer name, value;
+  g_hash_table_iter_init(&iter, cache->entries);
+  while (g_hash_table_iter_next(&iter, &name, &value)) {
+    DirScanEntry *entry = value;
+    g_autofree char *escaped_name = g_strescape(name, NULL);
+    g_string_append_printf(contents,
+                           "%" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+                           " %" G_GINT64_FORMAT " %c %s\n",
+                           entry->inode, entry->mtime_sec, entry->mtime_nsec,
+                           (gint64)entry->size, SWEEP_CACHE_VERDICT_KEEP, escaped_name);
+  }
+
+  return g_file_set_contents(path, contents->str, contents->len, error);
+}
+
+static gboolean sweep_cache_entry_matches(SweepCache *cache, DirScanEntry *current) {
+  if (cache == NULL) {
+    return FALSE;
+  }
+
+  // Racy entries get inspected again, after which the next sweep can trust them.
+  DirScanEntry *entry = g_hash_table_lookup(cache->entries, current->name);
+  return entry != NULL && entry->mtime_sec < cache->sweep_time_sec &&
+         entry->inode == current->inode &&
+         entry->mtime_sec == current->mtime_sec &&
+         entry->mtime_nsec == current->mtime_nsec && entry->size == current->size;
+}
+
+// Unless trust_dir_mtime is FALSE, nothing is done if the Desktop's mtime hasn't
+// changed since the last sweep. That misses files rewritten in place, which
+// callers that know of lost changes have to account for.
+gboolean delete_invalid_desktop_files(gboolean trust_dir_mtime, GError **error) {
   const char *desktop_dir = g_get_user_special_dir(G_USER_DIRECTORY_DESKTOP);
   if (desktop_dir == NULL) {
     return TRUE;
   }
 
-  g_autoptr(GFile) desktop_dir_file = g_file_new_for_path(desktop_dir);
-  g_autoptr(GFileEnumerator) enumerator = g_file_enumerate_children(
-      desktop_dir_file, G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
-      G_FILE_QUERY_INFO_NONE, NULL, error);
-  if (enumerator == NULL) {
-    if (g_error_matches(*error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
-      g_clear_error(error);
+  // Read before the stat, so anything changed after it gets an mtime at or after
+  // this.
+  struct timespec sweep_time;
+  clock_gettime(CLOCK_REALTIME_COARSE, &sweep_time);
+
+  // Plain stat, since this runs even where seccomp rejects statx and the scan below
+  // falls back to GIO.
+  struct stat dir_st;
+  if (stat(desktop_dir, &dir_st) == -1) {
+    int err = errno;
+    if (err == ENOENT) {
       return TRUE;
+    }
+
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to stat %s: %s",
+                desktop_dir, g_strerror(err));
+    return FALSE;
+  }
+
+  // Without a wrapper to compare against there's nothing to remove, and
+  // delete_maybe_invalid_desktop_file() takes care of warning about it.
+  const char *chrome_wrapper = g_getenv("CHROME_WRAPPER");
+
+  g_autoptr(GError) cache_error = NULL;
+  g_autofree char *cache_path = NULL;
+  g_autoptr(SweepCache) old_cache = NULL;
+  g_autoptr(SweepCache) new_cache = NULL;
+  g_auto(LockFd) sweep_lock = -1;
+  if (chrome_wrapper != NULL) {
+    cache_path = get_sweep_cache_path(&cache_error);
+    if (cache_path == NULL) {
+      g_warning("Failed to locate the Desktop sweep cache: %s", cache_error->message);
+      g_clear_error(&cache_error);
     } else {
-      g_prefix_error(error, "Enumerating files to migrate");
+      old_cache = sweep_cache_load(cache_path);
+      if (old_cache != NULL && strcmp(old_cache->chrome_wrapper, chrome_wrapper) != 0) {
+        g_clear_pointer(&old_cache, sweep_cache_free);
+      }
+
+      // Adding, removing, or renaming files on the Desktop all change its mtime,
+      // so if it's the same, nothing needs to be looked at. That doesn't hold if
+      // the mtime was racy when it was cached.
+      if (trust_dir_mtime && old_cache != NULL &&
+          old_cache->dir_mtime_sec < old_cache->sweep_time_sec &&
+          old_cache->dir_inode == dir_st.st_ino &&
+          old_cache->dir_mtime_sec == dir_st.st_mtim.tv_sec &&
+          old_cache->dir_mtime_nsec == dir_st.st_mtim.tv_nsec) {
+        g_debug("Desktop is unchanged since the last sweep");
+        return TRUE;
+      }
+
+      // Concurrent launches would only repeat the same sweep, so whoever finds one
+      // already running leaves it to that one.
+      g_autofree char *lock_path = g_strconcat(cache_path, ".lock", NULL);
+      sweep_lock = lock_acquire(lock_path, LOCK_MODE_EXCLUSIVE, 0, &cache_error);
+      if (sweep_lock == -1) {
+        if (g_error_matches(cache_error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+          g_debug("Desktop sweep is already running");
+          return TRUE;
+        }
+
+        g_warning("Failed to lock the Desktop sweep cache: %s", cache_error->message);
+        g_clear_error(&cache_error);
+      }
+
+      // The directory was stat'd before enumerating, so any changes made while
+      // sweeping (including our own deletions) get picked up next time.
+      new_cache = sweep_cache_new(chrome_wrapper);
+      new_cache->dir_inode = dir_st.st_ino;
+      new_cache->dir_mtime_sec = dir_st.st_mtim.tv_sec;
+      new_cache->dir_mtime_nsec = dir_st.st_mtim.tv_nsec;
+      new_cache->sweep_time_sec = sweep_time.tv_sec;
+    }
+  }
+
+  g_autoptr(GPtrArray) entries = dir_scan_regular_files(desktop_dir, ".desktop", error);
+  if (entries == NULL) {
+    g_prefix_error(error, "Enumerating desktop files: ");
+    return FALSE;
+  }
+
+  // Every path shares the directory, so only the name is swapped out per file.
+  g_autoptr(GString) path = g_string_new(desktop_dir);
+  g_string_append_c(path, G_DIR_SEPARATOR);
+  gsize dir_length = path->len;
+
+  guint inspected = 0, skipped = 0;
+  for (int i = 0; i < entries->len; i++) {
+    DirScanEntry *entry = g_ptr_array_index(entries, i);
+    if (sweep_cache_entry_matches(old_cache, entry)) {
+      skipped++;
+      sweep_cache_add(new_cache, entry);
+      continue;
+    }
+
+    inspected++;
+    g_string_truncate(path, dir_length);
+    g_string_append(path, entry->name);
+    g_autoptr(TraceSpan) span =
+        trace_span_begin("delete_maybe_invalid_desktop_file", path->str);
+    g_autoptr(GError) local_error = NULL;
+    if (!delete_maybe_invalid_desktop_file(path->str, &local_error)) {
+      g_warning("Failed to check desktop file: %s", local_error->message);
+    } else if (new_cache != NULL && access(path->str, F_OK) != -1) {
+      sweep_cache_add(new_cache, entry);
+    }
+  }
+
+  g_debug("Desktop sweep inspected %u files, skipped %u unchanged", inspected, skipped);
+
+  if (new_cache != NULL && !sweep_cache_save(new_cache, cache_path, &cache_error)) {
+    g_warning("Failed to save the Desktop sweep cache: %s", cache_error->message);
+  }
+
+  return TRUE;
+}
+
+static void check_changed_desktop_file(const char *desktop_dir, const char *name) {
+  if (!g_str_has_suffix(name, ".desktop")) {
+    return;
+  }
+
+  g_autofree char *path = g_build_filename(desktop_dir, name, NULL);
+  g_autoptr(TraceSpan) span = trace_span_begin("delete_maybe_invalid_desktop_file", path);
+  g_autoptr(GError) local_error = NULL;
+  if (!delete_maybe_invalid_desktop_file(path, &local_error) &&
+      !g_error_matches(local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+    // Files that are already gone again by the time the event is read are fine.
+    g_warning("Failed to check desktop file: %s", local_error->message);
+  }
+}
+
+#define DESKTOP_WATCH_MASK                                                            \
+  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// Watches the Desktop, or if it doesn't exist, its parent until it's created. Once
+// the Desktop is watched, it gets one sweep for anything that changed before.
+static gboolean start_watching_desktop(int inotify_fd, const char *desktop_dir,
+                                       int *desktop_wd, int *parent_wd,
+                                       GError **error) {
+  for (;;) {
+    *desktop_wd = inotify_add_watch(inotify_fd, desktop_dir, DESKTOP_WATCH_MASK);
+    if (*desktop_wd != -1) {
+      break;
+    }
+
+    int err = errno;
+    if (err != ENOENT) {
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                  "Failed to watch %s: %s", desktop_dir, g_strerror(err));
+      return FALSE;
+    } else if (*parent_wd != -1) {
+      g_debug("Waiting for %s to be created", desktop_dir);
+      return TRUE;
+    }
+
+    // Loops around to try again, in case the Desktop was created before the
+    // parent was watched.
+    g_autofree char *parent_dir = g_path_get_dirname(desktop_dir);
+    *parent_wd = inotify_add_watch(inotify_fd, parent_dir,
+                                   IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if (*parent_wd == -1) {
+      err = errno;
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                  "Failed to watch %s: %s", parent_dir, g_strerror(err));
       return FALSE;
     }
   }
 
+  if (*parent_wd != -1) {
+    inotify_rm_watch(inotify_fd, *parent_wd);
+    *parent_wd = -1;
+  }
+
+  return delete_invalid_desktop_files(TRUE, error);
+}
+
+// Checks each desktop file as soon as it's written or moved onto the Desktop,
+// rather than leaving it for the sweep on the next launch. If the Desktop doesn't
+// exist or goes away, this waits for it to come back. Only returns on errors, or
+// if another watcher is already running.
+static gboolean watch_desktop(FlatpakInfo *info, GError **error) {
+  g_auto(LockFd) watch_lock =
+      lock_acquire_desktop_watch(info, LOCK_MODE_EXCLUSIVE, WATCH_LOCK_TIMEOUT_MS, error);
+  if (watch_lock == -1) {
+    if (g_error_matches(*error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+      g_debug("The Desktop is already being watched");
+      g_clear_error(error);
+      return TRUE;
+    }
+
+    return FALSE;
+  }
+
+  const char *desktop_dir = g_get_user_special_dir(G_USER_DIRECTORY_DESKTOP);
+  if (desktop_dir == NULL) {
+    return TRUE;
+  }
+
+  g_autofree char *desktop_name = g_path_get_basename(desktop_dir);
+
+  g_auto(AutoFd) inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to initialize inotify: %s", g_strerror(err));
+    return FALSE;
+  }
+
+  int desktop_wd = -1, parent_wd = -1;
+  if (!start_watching_desktop(inotify_fd, desktop_dir, &desktop_wd, &parent_wd,
+                              error)) {
+    return FALSE;
+  }
+
+  trace_flush();
+
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
   for (;;) {
-    GFileInfo *child_info = NULL;
-    GFile *child = NULL;
+    ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+    if (length == -1) {
+      int err = errno;
+      if (err == EINTR) {
+        continue;
+      }
 
-    if (!g_file_enumerator_iterate(enumerator, &child_info, &child, NULL, error)) {
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                  "Failed to read Desktop events: %s", g_strerror(err));
       return FALSE;
-    } else if (child_info == NULL) {
-      // No more files.
-      break;
     }
 
-    if (g_file_info_get_file_type(child_info) == G_FILE_TYPE_REGULAR &&
-        g_str_has_suffix(g_file_info_get_name(child_info), ".desktop")) {
-      g_autofree char *path =
-          g_build_filename(desktop_dir, g_file_info_get_name(child_info), NULL);
-      g_autoptr(GError) local_error = NULL;
-      if (!delete_maybe_invalid_desktop_file(path, &local_error)) {
-        g_warning("Failed to check desktop file: %s", local_error->message);
+    for (char *next = buffer; next < buffer + length;) {
+      const struct inotify_event *event = (const struct inotify_event *)next;
+      next += sizeof(struct inotify_event) + event->len;
+
+      // Events for watches that were already removed are dropped by falling
+      // through every branch.
+      if (event->mask & IN_Q_OVERFLOW) {
+        if (desktop_wd == -1) {
+          // The Desktop's creation might be among the dropped events.
+          if (!start_watching_desktop(inotify_fd, desktop_dir, &desktop_wd,
+                                      &parent_wd, error)) {
+            return FALSE;
+          }
+        } else {
+          // Files that were rewritten in place don't change the Desktop's mtime,
+          // so the sweep can't skip based on it.
+          g_debug("Desktop events were dropped, sweeping instead");
+          if (!delete_invalid_desktop_files(FALSE, error)) {
+            return FALSE;
+          }
+        }
+      } else if (event->wd == desktop_wd &&
+                 event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        g_debug("%s went away, waiting for it to come back", desktop_dir);
+        // A moved directory would otherwise stay watched.
+        inotify_rm_watch(inotify_fd, desktop_wd);
+        desktop_wd = -1;
+        if (!start_watching_desktop(inotify_fd, desktop_dir, &desktop_wd, &parent_wd,
+                                    error)) {
+          return FALSE;
+        }
+      } else if (event->wd == desktop_wd && event->len > 0 &&
+                 !(event->mask & IN_ISDIR)) {
+        check_changed_desktop_file(desktop_dir, event->name);
+      } else if (event->wd == parent_wd && event->len > 0 &&
+                 event->mask & IN_ISDIR && strcmp(event->name, desktop_name) == 0) {
+        if (!start_watching_desktop(inotify_fd, desktop_dir, &desktop_wd, &parent_wd,
+                                    error)) {
+          return FALSE;
+        }
       }
     }
+
+    // The process doesn't exit, so the spans would never be written otherwise.
+    trace_flush();
   }
+}
 
-  return TRUE;
+// Whether a `flextop-init --watch` is running, in which case the Desktop doesn't
+// need sweeping.
+static gboolean is_desktop_watched(FlatpakInfo *info) {
+  g_autoptr(GError) error = NULL;
+  g_auto(LockFd) watch_lock =
+      lock_acquire_desktop_watch(info, LOCK_MODE_SHARED, 0, &error);
+  if (watch_lock == -1) {
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+      return TRUE;
+    }
+
+    g_warning("Failed to check for a Desktop watcher: %s", error->message);
+  }
+
+  return FALSE;
 }
 
-int main() {
+int main(int argc, char **argv) {
   g_set_prgname("flextop-init");
+  trace_init("flextop-init");
 
   g_autoptr(GError) error = NULL;
 
+  gboolean watch = FALSE;
+  if (argc == 2 && strcmp(argv[1], "--watch") == 0) {
+    watch = TRUE;
+  } else if (argc != 1) {
+    g_warning("usage: flextop-init [--watch]");
+    return 1;
+  }
+  g_autoptr(TraceSpan) main_span = trace_span_begin("flextop-init", NULL);
+
   if (!ensure_running_inside_flatpak()) {
     return 1;
   }
 
   g_autoptr(FlatpakInfo) info = flatpak_info_new();
+  g_autoptr(TraceSpan) info_span = trace_span_begin("flatpak_info_load", NULL);
   if (!flatpak_info_load(info, &error)) {
     g_warning("Failed to load flatpak info: %s", error->message);
     return 1;
   }
+  g_clear_pointer(&info_span, trace_span_end);
 
-  g_auto(LockFd) lock = acquire_lock(info, &error);
-  if (lock == -1) {
-    g_warning("%s", error->message);
-    return 1;
+  if (watch) {
+    g_clear_pointer(&main_span, trace_span_end);
+    if (!watch_desktop(info, &error)) {
+      g_warning("Failed to watch the Desktop: %s", error->message);
+      return 1;
+    }
+
+    return 0;
   }
 
   g_autoptr(DataDir) host = data_dir_new_host(info);
   g_autoptr(DataDir) priv = data_dir_new_private();
 
+  g_autoptr(TraceSpan) setup_span = trace_span_begin("setup_applications_folder", NULL);
   if (!setup_applications_folder(info, host, priv, &error)) {
     g_warning("Failed to set up applications folder: %s", error->message);
     return 1;
   }
+  g_clear_pointer(&setup_span, trace_span_end);
+
+  if (is_desktop_watched(info)) {
+    g_debug("The Desktop is being watched, skipping the sweep");
+    return 0;
+  }
 
-  if (!delete_invalid_desktop_files(&error)) {
+  g_autoptr(TraceSpan) delete_span =
+      trace_span_begin("delete_invalid_desktop_files", NULL);
+  if (!delete_invalid_desktop_files(TRUE, &error)) {
     g_warning("Failed to delete invalid desktop files: %s", error->message);
     return 1;
   }
@@ -0,0 +1,206 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// flock(2) based locks that can be shared or exclusive and only wait for a bounded
+// time. flock has no timeout of its own, so a contended lock is waited on in a
+// blocking flock(), which a per-thread timer interrupts once the time is up. The
+// waiter is woken as soon as the lock is released, rather than whenever it would
+// next have polled.
+//
+// flock doesn't queue waiters, though: a shared lock is granted whenever no
+// exclusive one is held, even while an exclusive waiter is blocked. Shared holders
+// that keep overlapping can therefore still keep an exclusive waiter out, but only
+// until its timeout, after which it fails with G_IO_ERROR_TIMED_OUT.
+//
+// Lock waits are logged, and show up as spans when tracing is enabled, so
+// contention between concurrent installs can be spotted.
+
+#include "flextop-lock.h"
+#include "flextop-trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+// Only newer glibc names the field SIGEV_THREAD_ID uses.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// Once the timer first fires, it keeps firing this often, in case the first signal
+// landed just before flock() was entered rather than during it.
+#define LOCK_TIMER_INTERVAL_MS 10
+
+static const char *lock_mode_to_string(LockMode mode) {
+  return mode == LOCK_MODE_SHARED ? "shared" : "exclusive";
+}
+
+// The handler does nothing, and is only there so that the signal interrupts
+// flock(). It's installed without SA_RESTART, since flock() would otherwise just
+// go back to sleep.
+static void on_timer_signal(int signum) {}
+
+static void install_timer_signal_handler() {
+  static gsize installed = 0;
+  if (g_once_init_enter(&installed)) {
+    struct sigaction action = {.sa_handler = on_timer_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGRTMIN, &action, NULL);
+    g_once_init_leave(&installed, 1);
+  }
+}
+
+static struct timespec ms_to_timespec(int ms) {
+  return (struct timespec){.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+}
+
+// Blocks in flock() until the lock is taken, returning 0, or until timeout_ms
+// passes, returning ETIMEDOUT. A negative timeout_ms waits forever. Returns flock's
+// errno if it fails for any other reason.
+static int flock_with_timeout(int fd, int operation, int timeout_ms) {
+  if (timeout_ms < 0) {
+    while (flock(fd, operation) == -1) {
+      if (errno != EINTR) {
+        return errno;
+      }
+    }
+
+    return 0;
+  }
+
+  install_timer_signal_handler();
+
+  // The signal goes to this thread only, so the waits on other threads aren't
+  // disturbed.
+  struct sigevent event = {.sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGRTMIN};
+  event.sigev_notify_thread_id = gettid();
+  timer_t timer;
+  if (timer_create(CLOCK_MONOTONIC, &event, &timer) == -1) {
+    return errno;
+  }
+
+  gint64 deadline = g_get_monotonic_time() + timeout_ms * G_TIME_SPAN_MILLISECOND;
+  struct itimerspec spec = {
+      .it_value = ms_to_timespec(MAX(timeout_ms, 1)),
+      .it_interval = ms_to_timespec(LOCK_TIMER_INTERVAL_MS),
+  };
+  int err = 0;
+  if (timer_settime(timer, 0, &spec, NULL) == -1) {
+    err = errno;
+  } else {
+    while (flock(fd, operation) == -1) {
+      err = errno;
+      if (err != EINTR) {
+        break;
+      } else if (g_get_monotonic_time() >= deadline) {
+        // Other signals interrupt flock() too, so only the clock says when to stop.
+        err = ETIMEDOUT;
+        break;
+      }
+
+      err = 0;
+    }
+  }
+
+  // Any signal the timer sent has been handled by the time this returns, so it
+  // can't interrupt anything later on.
+  timer_delete(timer);
+  return err;
+}
+
+// Locks an already open fd. A timeout_ms of 0 only tries once, and a negative one
+// waits forever.
+gboolean lock_fd(int fd, const char *path, LockMode mode, int timeout_ms,
+                 GError **error) {
+  int operation = mode == LOCK_MODE_SHARED ? LOCK_SH : LOCK_EX;
+  if (flock(fd, operation | LOCK_NB) == 0) {
+    return TRUE;
+  } else if (errno != EWOULDBLOCK) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to lock %s: %s",
+                path, g_strerror(err));
+    return FALSE;
+  }
+
+  if (timeout_ms == 0) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK, "%s is locked", path);
+    return FALSE;
+  }
+
+  g_autoptr(TraceSpan) span = trace_span_begin("lock_wait", path);
+  gint64 start = g_get_monotonic_time();
+
+  int err = flock_with_timeout(fd, operation, timeout_ms);
+  if (err == ETIMEDOUT) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                "Timed out after %dms waiting for %s lock on %s", timeout_ms,
+                lock_mode_to_string(mode), path);
+    return FALSE;
+  } else if (err != 0) {
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to lock %s: %s",
+                path, g_strerror(err));
+    return FALSE;
+  }
+
+  g_debug("Waited %.1fms for %s lock on %s",
+          (g_get_monotonic_time() - start) / (double)G_TIME_SPAN_MILLISECOND,
+          lock_mode_to_string(mode), path);
+  return TRUE;
+}
+
+// Opens (creating it if needed) and locks the file at path, returning the fd that
+// holds the lock, or -1 on failure.
+LockFd lock_acquire(const char *path, LockMode mode, int timeout_ms, GError **error) {
+  int fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open %s: %s",
+                path, g_strerror(err));
+    return -1;
+  }
+
+  if (!lock_fd(fd, path, mode, timeout_ms, error)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Drops the lock while keeping the fd open, so it can be taken again later.
+void lock_release(int fd) { flock(fd, LOCK_UN); }
+
+// Guards the layout of the applications folder. flextop-init only takes it
+// exclusively to relink or migrate the folder, while installs and uninstalls share
+// it, so they can run alongside each other but never in the middle of a
+// migration.
+LockFd lock_acquire_applications(FlatpakInfo *info, LockMode mode, GError **error) {
+  g_autofree char *path =
+      g_build_filename(g_get_user_runtime_dir(), "app", info->app, ".flextop-lock", NULL);
+  return lock_acquire(path, mode, LOCK_DEFAULT_TIMEOUT_MS, error);
+}
+
+// Held exclusively by `flextop-init --watch` for as long as it runs, so launches can
+// tell that the Desktop is already being kept clean. Launches only take it shared
+// for long enough to check that.
+LockFd lock_acquire_desktop_watch(FlatpakInfo *info, LockMode mode, int timeout_ms,
+                                  GError **error) {
+  g_autofree char *path = g_build_filename(g_get_user_runtime_dir(), "app", info->app,
+                                           ".flextop-watch-lock", NULL);
+  return lock_acquire(path, mode, timeout_ms, error);
+}
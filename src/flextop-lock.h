@@ -0,0 +1,39 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "flextop-utils.h"
+
+// How long a tool waits on a lock before giving up, rather than hanging forever
+// behind a stuck process.
+#define LOCK_DEFAULT_TIMEOUT_MS 30000
+
+typedef int LockFd;
+G_DEFINE_AUTO_CLEANUP_FREE_FUNC(LockFd, close, -1)
+
+typedef enum {
+  LOCK_MODE_SHARED,
+  LOCK_MODE_EXCLUSIVE,
+} LockMode;
+
+LockFd lock_acquire(const char *path, LockMode mode, int timeout_ms, GError **error);
+gboolean lock_fd(int fd, const char *path, LockMode mode, int timeout_ms,
+                 GError **error);
+void lock_release(int fd);
+
+LockFd lock_acquire_applications(FlatpakInfo *info, LockMode mode, GError **error);
+LockFd lock_acquire_desktop_watch(FlatpakInfo *info, LockMode mode, int timeout_ms,
+                                  GError **error);
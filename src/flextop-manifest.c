@@ -0,0 +1,629 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// The manifest records which icon each installed desktop file uses, and every
+// icon file written for each icon name, so uninstalling never has to scan the
+// icon theme. It's stored as an append-only log of records, one per line, with
+// tab-separated escaped fields:
+//
+//   D <prefixed desktop file> <icon name, may be empty>   desktop file installed
+//   d <prefixed desktop file>                             desktop file removed
+//   I <icon name> <path> <sha256> [source size]           icon file written
+//   i <icon name> <path>                                  icon file removed
+//
+// The source size is only present for icons that were scaled down from a bigger
+// one, rather than given to us at that size.
+//
+// Every record is written with a single append, so a crash can at worst leave a
+// torn last line, which is skipped on load and cut off before the next append.
+// Otherwise, the next record would complete the torn line and make it look like a
+// whole record. Once enough records are obsolete, the log is compacted by
+// atomically replacing it with the live state.
+//
+// The lock is only held while reading or changing the log, so concurrent installs
+// can interleave their records. Before each change, the records appended by
+// others since the last read are picked up, so decisions are made against the
+// latest state.
+
+#include "flextop-manifest.h"
+#include "flextop-lock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MANIFEST_COMPACT_MIN_RECORDS 64
+
+struct Manifest {
+  char *log_path;
+  int log_fd;
+  char *lock_path;
+  int lock_fd;
+
+  // The log file that was read, and how much of it, so later reads only need to
+  // pick up what was appended since.
+  ino_t log_inode;
+  off_t log_offset;
+
+  // Set if the log ends with a partial record, i.e. the last write was torn. The
+  // offset is then where that record starts.
+  gboolean torn_tail;
+  guint n_records;
+
+  // prefixed desktop filename -> icon name ("" if none)
+  GHashTable *desktop_files;
+  // icon name -> GHashTable of path -> ManifestIconFile
+  GHashTable *icons;
+};
+
+static void manifest_icon_file_free(ManifestIconFile *file) {
+  g_free(file->checksum);
+  g_free(file);
+}
+
+static void manifest_set_icon_file(Manifest *manifest, const char *icon, const char *path,
+                                   const char *checksum, int source_size) {
+  GHashTable *files = g_hash_table_lookup(manifest->icons, icon);
+  if (files == NULL) {
+    files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  (GDestroyNotify)manifest_icon_file_free);
+    g_hash_table_insert(manifest->icons, g_strdup(icon), files);
+  }
+
+  ManifestIconFile *file = g_new0(ManifestIconFile, 1);
+  file->checksum = g_strdup(checksum);
+  file->source_size = source_size;
+  g_hash_table_replace(files, g_strdup(path), file);
+}
+
+static void manifest_apply_record(Manifest *manifest, const char *const *fields) {
+  guint n_fields = g_strv_length((char **)fields);
+  const char *type = fields[0];
+
+  if (strcmp(type, "D") == 0 && n_fields == 3) {
+    g_hash_table_replace(manifest->desktop_files, g_strdup(fields[1]),
+                         g_strdup(fields[2]));
+  } else if (strcmp(type, "d") == 0 && n_fields == 2) {
+    g_hash_table_remove(manifest->desktop_files, fields[1]);
+  } else if (strcmp(type, "I") == 0 && (n_fields == 4 || n_fields == 5)) {
+    int source_size = n_fields == 5 ? atoi(fields[4]) : 0;
+    manifest_set_icon_file(manifest, fields[1], fields[2], fields[3], source_size);
+  } else if (strcmp(type, "i") == 0 && n_fields == 3) {
+    GHashTable *files = g_hash_table_lookup(manifest->icons, fields[1]);
+    if (files != NULL) {
+      g_hash_table_remove(files, fields[2]);
+      if (g_hash_table_size(files) == 0) {
+        g_hash_table_remove(manifest->icons, fields[1]);
+      }
+    }
+  } else {
+    g_debug("Skipping malformed manifest record of type '%s'", type);
+  }
+}
+
+static char *format_record(const char *const *fields) {
+  g_autoptr(GString) line = g_string_new(NULL);
+  for (const char *const *field = fields; *field != NULL; field++) {
+    if (field != fields) {
+      g_string_append_c(line, '\t');
+    }
+
+    g_autofree char *escaped = g_strescape(*field, NULL);
+    g_string_append(line, escaped);
+  }
+
+  g_string_append_c(line, '\n');
+  return g_string_free(g_steal_pointer(&line), FALSE);
+}
+
+// Returns how much of contents was made up of whole records.
+static gsize manifest_parse_log(Manifest *manifest, const char *contents, gsize length) {
+  const char *line = contents;
+  const char *end = contents + length;
+
+  manifest->torn_tail = FALSE;
+
+  while (line < end) {
+    const char *newline = memchr(line, '\n', end - line);
+    if (newline == NULL) {
+      g_debug("Skipping torn record at the end of the manifest");
+      manifest->torn_tail = TRUE;
+      break;
+    }
+
+    g_autofree char *record = g_strndup(line, newline - line);
+    g_auto(GStrv) fields = g_strsplit(record, "\t", -1);
+    for (char **field = fields; *field != NULL; field++) {
+      char *compressed = g_strcompress(*field);
+      g_free(*field);
+      *field = compressed;
+    }
+
+    if (fields[0] != NULL) {
+      manifest_apply_record(manifest, (const char *const *)fields);
+      manifest->n_records++;
+    }
+
+    line = newline + 1;
+  }
+
+  return line - contents;
+}
+
+// Opens the log for appending, creating it if needed, and returns its stat
+// information in out_st.
+static gboolean manifest_open_log(Manifest *manifest, struct stat *out_st,
+                                  GError **error) {
+  if (manifest->log_fd != -1) {
+    close(manifest->log_fd);
+  }
+
+  manifest->log_fd =
+      open(manifest->log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (manifest->log_fd == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open %s: %s",
+                manifest->log_path, g_strerror(err));
+    return FALSE;
+  }
+
+  if (fstat(manifest->log_fd, out_st) == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to stat %s: %s",
+                manifest->log_path, g_strerror(err));
+    return FALSE;
+  }
+
+  manifest->log_inode = out_st->st_ino;
+  return TRUE;
+}
+
+static char *manifest_read_log_range(Manifest *manifest, off_t offset, gsize length,
+                                     GError **error) {
+  g_auto(AutoFd) fd = open(manifest->log_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open %s: %s",
+                manifest->log_path, g_strerror(err));
+    return NULL;
+  }
+
+  g_autofree char *contents = g_malloc(length);
+  gsize total = 0;
+  while (total < length) {
+    ssize_t bytes = pread(fd, contents + total, length - total, offset + total);
+    if (bytes == -1 && errno == EINTR) {
+      continue;
+    } else if (bytes <= 0) {
+      int err = bytes == -1 ? errno : EIO;
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to read %s: %s",
+                  manifest->log_path, g_strerror(err));
+      return NULL;
+    }
+
+    total += bytes;
+  }
+
+  return g_steal_pointer(&contents);
+}
+
+// Brings the in-memory state up to date with the log, which may have been
+// appended to or compacted by another process. Must be called with the lock held.
+static gboolean manifest_refresh(Manifest *manifest, GError **error) {
+  struct stat st;
+  if (stat(manifest->log_path, &st) == -1) {
+    if (errno != ENOENT) {
+      int err = errno;
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to stat %s: %s",
+                  manifest->log_path, g_strerror(err));
+      return FALSE;
+    }
+
+    st.st_ino = 0;
+    st.st_size = 0;
+  }
+
+  if (manifest->log_fd == -1 || st.st_ino != manifest->log_inode ||
+      st.st_size < manifest->log_offset) {
+    // Replaced by a compaction (or never read), so start over.
+    g_hash_table_remove_all(manifest->desktop_files);
+    g_hash_table_remove_all(manifest->icons);
+    manifest->n_records = 0;
+    manifest->torn_tail = FALSE;
+    manifest->log_offset = 0;
+
+    if (!manifest_open_log(manifest, &st, error)) {
+      g_prefix_error(error, "Loading install manifest: ");
+      return FALSE;
+    }
+  }
+
+  if (st.st_size > manifest->log_offset) {
+    gsize length = st.st_size - manifest->log_offset;
+    g_autofree char *contents =
+        manifest_read_log_range(manifest, manifest->log_offset, length, error);
+    if (contents == NULL) {
+      g_prefix_error(error, "Loading install manifest: ");
+      return FALSE;
+    }
+
+    // A torn record is read again next time, in case it has been cut off by then.
+    manifest->log_offset += manifest_parse_log(manifest, contents, length);
+  }
+
+  return TRUE;
+}
+
+Manifest *manifest_load(GError **error) {
+  g_autoptr(GFile) flextop_data = get_flextop_data_dir(error);
+  if (flextop_data == NULL) {
+    return NULL;
+  }
+
+  g_autoptr(Manifest) manifest = g_new0(Manifest, 1);
+  manifest->log_fd = -1;
+  manifest->lock_fd = -1;
+  manifest->desktop_files =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  manifest->icons = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify)g_hash_table_unref);
+  manifest->log_path =
+      g_build_filename(g_file_peek_path(flextop_data), "install-manifest", NULL);
+
+  // Compaction replaces the log, so the lock has to live in a separate file.
+  manifest->lock_path =
+      g_build_filename(g_file_peek_path(flextop_data), "install-manifest.lock", NULL);
+  manifest->lock_fd = lock_acquire(manifest->lock_path, LOCK_MODE_SHARED,
+                                   LOCK_DEFAULT_TIMEOUT_MS, error);
+  if (manifest->lock_fd == -1) {
+    g_prefix_error(error, "Locking the install manifest: ");
+    return NULL;
+  }
+
+  gboolean success = manifest_refresh(manifest, error);
+  lock_release(manifest->lock_fd);
+  if (!success) {
+    return NULL;
+  }
+
+  return g_steal_pointer(&manifest);
+}
+
+void manifest_free(Manifest *manifest) {
+  if (manifest->log_fd != -1) {
+    close(manifest->log_fd);
+  }
+
+  if (manifest->lock_fd != -1) {
+    close(manifest->lock_fd);
+  }
+
+  g_free(manifest->log_path);
+  g_free(manifest->lock_path);
+  g_clear_pointer(&manifest->desktop_files, g_hash_table_unref);
+  g_clear_pointer(&manifest->icons, g_hash_table_unref);
+  g_free(manifest);
+}
+
+static guint manifest_count_live_records(Manifest *manifest) {
+  guint count = g_hash_table_size(manifest->desktop_files);
+
+  GHashTableIter iter;
+  gpointer files;
+  g_hash_table_iter_init(&iter, manifest->icons);
+  while (g_hash_table_iter_next(&iter, NULL, &files)) {
+    count += g_hash_table_size(files);
+  }
+
+  return count;
+}
+
+static gboolean manifest_write_snapshot(Manifest *manifest, GError **error) {
+  g_autoptr(GString) contents = g_string_new(NULL);
+
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init(&iter, manifest->desktop_files);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    const char *fields[] = {"D", key, value, NULL};
+    g_autofree char *record = format_record(fields);
+    g_string_append(contents, record);
+  }
+
+  g_hash_table_iter_init(&iter, manifest->icons);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    GHashTableIter files_iter;
+    gpointer path, file_ptr;
+    g_hash_table_iter_init(&files_iter, value);
+    while (g_hash_table_iter_next(&files_iter, &path, &file_ptr)) {
+      ManifestIconFile *file = file_ptr;
+      g_autofree char *source_size = file->source_size != 0
+                                         ? g_strdup_printf("%d", file->source_size)
+                                         : NULL;
+      const char *fields[] = {"I", key, path, file->checksum, source_size, NULL};
+      g_autofree char *record = format_record(fields);
+      g_string_append(contents, record);
+    }
+  }
+
+  if (!g_file_set_contents(manifest->log_path, contents->str, contents->len, error)) {
+    g_prefix_error(error, "Writing install manifest: ");
+    return FALSE;
+  }
+
+  manifest->n_records = manifest_count_live_records(manifest);
+  manifest->torn_tail = FALSE;
+  manifest->log_offset = contents->len;
+
+  struct stat st;
+  return manifest_open_log(manifest, &st, error);
+}
+
+// Must be called with the lock held exclusively, so nobody else can be appending.
+static gboolean manifest_append(Manifest *manifest, const char *const *fields,
+                                GError **error) {
+  g_autofree char *record = format_record(fields);
+  gsize length = strlen(record);
+
+  if (manifest->torn_tail) {
+    g_debug("Removing torn record at the end of the manifest");
+    if (ftruncate(manifest->log_fd, manifest->log_offset) == -1) {
+      int err = errno;
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                  "Failed to remove torn record from install manifest: %s",
+                  g_strerror(err));
+      return FALSE;
+    }
+
+    manifest->torn_tail = FALSE;
+  }
+
+  // O_APPEND writes of a single record either land completely or leave a torn
+  // line, which the loader knows how to skip.
+  ssize_t written = write(manifest->log_fd, record, length);
+  if (written != length) {
+    int err = written == -1 ? errno : EIO;
+    manifest->torn_tail = written > 0;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to append to install manifest: %s", g_strerror(err));
+    return FALSE;
+  }
+
+  manifest->n_records++;
+  manifest->log_offset += length;
+
+  manifest_apply_record(manifest, fields);
+
+  guint live_records = manifest_count_live_records(manifest);
+  if (manifest->n_records > MANIFEST_COMPACT_MIN_RECORDS &&
+      manifest->n_records > 2 * live_records) {
+    g_debug("Compacting install manifest (%u records, %u live)", manifest->n_records,
+            live_records);
+    return manifest_write_snapshot(manifest, error);
+  }
+
+  return TRUE;
+}
+
+gboolean manifest_lookup_desktop_file(Manifest *manifest, const char *prefixed_filename,
+                                      const char **out_icon) {
+  gpointer icon;
+  if (!g_hash_table_lookup_extended(manifest->desktop_files, prefixed_filename, NULL,
+                                    &icon)) {
+    return FALSE;
+  }
+
+  *out_icon = icon;
+  return TRUE;
+}
+
+// Returns the recorded files for the icon, mapping each path to its
+// ManifestIconFile, or NULL if none are known.
+GHashTable *manifest_get_icon_files(Manifest *manifest, const char *icon) {
+  return g_hash_table_lookup(manifest->icons, icon);
+}
+
+const ManifestIconFile *manifest_lookup_icon_file(Manifest *manifest, const char *icon,
+                                                  const char *path) {
+  GHashTable *files = manifest_get_icon_files(manifest, icon);
+  return files != NULL ? g_hash_table_lookup(files, path) : NULL;
+}
+
+static gboolean manifest_record_is_applied(Manifest *manifest,
+                                           const char *const *fields) {
+  const char *type = fields[0];
+  const char *recorded_icon = NULL;
+  const ManifestIconFile *recorded_file = NULL;
+
+  if (strcmp(type, "D") == 0) {
+    return manifest_lookup_desktop_file(manifest, fields[1], &recorded_icon) &&
+           strcmp(recorded_icon, fields[2]) == 0;
+  } else if (strcmp(type, "d") == 0) {
+    return !manifest_lookup_desktop_file(manifest, fields[1], &recorded_icon);
+  } else if (strcmp(type, "I") == 0) {
+    recorded_file = manifest_lookup_icon_file(manifest, fields[1], fields[2]);
+    int source_size = fields[4] != NULL ? atoi(fields[4]) : 0;
+    return recorded_file != NULL && strcmp(recorded_file->checksum, fields[3]) == 0 &&
+           recorded_file->source_size == source_size;
+  } else if (strcmp(type, "i") == 0) {
+    return manifest_lookup_icon_file(manifest, fields[1], fields[2]) == NULL;
+  }
+
+  return FALSE;
+}
+
+static gboolean manifest_lock(Manifest *manifest, GError **error) {
+  if (!lock_fd(manifest->lock_fd, manifest->lock_path, LOCK_MODE_EXCLUSIVE,
+               LOCK_DEFAULT_TIMEOUT_MS, error)) {
+    g_prefix_error(error, "Locking the install manifest: ");
+    return FALSE;
+  }
+
+  if (!manifest_refresh(manifest, error)) {
+    lock_release(manifest->lock_fd);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Appends the record unless it wouldn't change anything.
+static gboolean manifest_update(Manifest *manifest, const char *const *fields,
+                                GError **error) {
+  if (!manifest_lock(manifest, error)) {
+    return FALSE;
+  }
+
+  gboolean success = manifest_record_is_applied(manifest, fields) ||
+                     manifest_append(manifest, fields, error);
+  lock_release(manifest->lock_fd);
+  return success;
+}
+
+gboolean manifest_add_desktop_file(Manifest *manifest, const char *prefixed_filename,
+                                   const char *icon, GError **error) {
+  const char *fields[] = {"D", prefixed_filename, icon != NULL ? icon : "", NULL};
+  return manifest_update(manifest, fields, error);
+}
+
+gboolean manifest_remove_desktop_file(Manifest *manifest, const char *prefixed_filename,
+                                      GError **error) {
+  const char *fields[] = {"d", prefixed_filename, NULL};
+  return manifest_update(manifest, fields, error);
+}
+
+// source_size is the size of the icon this one was scaled down from, or 0 if it
+// was installed as given.
+gboolean manifest_add_icon_file(Manifest *manifest, const char *icon, const char *path,
+                                const char *checksum, int source_size, GError **error) {
+  g_autofree char *source_size_str =
+      source_size != 0 ? g_strdup_printf("%d", source_size) : NULL;
+  const char *fields[] = {"I", icon, path, checksum, source_size_str, NULL};
+  return manifest_update(manifest, fields, error);
+}
+
+gboolean manifest_remove_icon_file(Manifest *manifest, const char *icon,
+                                   const char *path, GError **error) {
+  const char *fields[] = {"i", icon, path, NULL};
+  return manifest_update(manifest, fields, error);
+}
+
+static void manifest_rebuild_icon(Manifest *manifest, DataDir *host, const char *icon) {
+  g_autoptr(GError) error = NULL;
+
+  // XXX: We're tied to .png icons for now.
+  g_autofree char *icon_filename = g_strdup_printf("%s.png", icon);
+
+  g_autoptr(GFile) hicolor = g_file_get_child(host->icons, "hicolor");
+  g_autoptr(GFileEnumerator) size_dirs =
+      g_file_enumerate_children(hicolor, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, &error);
+  if (size_dirs == NULL) {
+    g_warning("Failed to iterate over icon size dirs: %s", error->message);
+    return;
+  }
+
+  for (;;) {
+    GFileInfo *size_dir_info = NULL;
+    GFile *size_dir_file = NULL;
+    if (!g_file_enumerator_iterate(size_dirs, &size_dir_info, &size_dir_file, NULL,
+                                   &error)) {
+      g_warning("Failed to continue iteration over icon size dirs: %s", error->message);
+      break;
+    } else if (size_dir_info == NULL) {
+      break;
+    }
+
+    g_autofree char *path = g_build_filename(g_file_peek_path(size_dir_file), "apps",
+                                             icon_filename, NULL);
+    g_autofree char *checksum = compute_file_checksum(path, NULL);
+    if (checksum == NULL) {
+      continue;
+    }
+
+    // Whether this was scaled down is lost, so it's treated like it was given.
+    manifest_set_icon_file(manifest, icon, path, checksum, 0);
+  }
+}
+
+static gboolean manifest_rebuild_locked(Manifest *manifest, FlatpakInfo *info,
+                                        DataDir *host, GError **error) {
+  g_hash_table_remove_all(manifest->desktop_files);
+  g_hash_table_remove_all(manifest->icons);
+
+  g_autoptr(GError) enumerate_error = NULL;
+  g_autoptr(GFileEnumerator) enumerator = g_file_enumerate_children(
+      host->applications, G_FILE_ATTRIBUTE_STANDARD_NAME, G_FILE_QUERY_INFO_NONE, NULL,
+      &enumerate_error);
+  if (enumerator == NULL) {
+    if (!g_error_matches(enumerate_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+      g_propagate_prefixed_error(error, g_steal_pointer(&enumerate_error),
+                                 "Enumerating installed desktop files: ");
+      return FALSE;
+    }
+  } else {
+    for (;;) {
+      GFileInfo *child_info = NULL;
+      GFile *child = NULL;
+      if (!g_file_enumerator_iterate(enumerator, &child_info, &child, NULL, error)) {
+        return FALSE;
+      } else if (child_info == NULL) {
+        break;
+      }
+
+      const char *name = g_file_info_get_name(child_info);
+      if (!g_str_has_prefix(name, info->desktop_file_prefix) ||
+          !g_str_has_suffix(name, ".desktop")) {
+        continue;
+      }
+
+      g_autoptr(GKeyFile) key_file = g_key_file_new();
+      g_autoptr(GError) local_error = NULL;
+      if (!g_key_file_load_from_file(key_file, g_file_peek_path(child), G_KEY_FILE_NONE,
+                                     &local_error)) {
+        g_warning("Failed to load %s: %s", g_file_peek_path(child), local_error->message);
+        continue;
+      }
+
+      g_autofree char *icon = g_key_file_get_string(key_file, G_KEY_FILE_DESKTOP_GROUP,
+                                                    G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+      g_hash_table_replace(manifest->desktop_files, g_strdup(name),
+                           g_strdup(icon != NULL ? icon : ""));
+      if (icon != NULL && !g_hash_table_contains(manifest->icons, icon)) {
+        manifest_rebuild_icon(manifest, host, icon);
+      }
+    }
+  }
+
+  return manifest_write_snapshot(manifest, error);
+}
+
+// Recreates the manifest from the installed desktop files and the icons they
+// reference, for when it was lost or got out of sync.
+gboolean manifest_rebuild(Manifest *manifest, FlatpakInfo *info, DataDir *host,
+                          GError **error) {
+  if (!lock_fd(manifest->lock_fd, manifest->lock_path, LOCK_MODE_EXCLUSIVE,
+               LOCK_DEFAULT_TIMEOUT_MS, error)) {
+    g_prefix_error(error, "Locking the install manifest: ");
+    return FALSE;
+  }
+
+  gboolean success = manifest_rebuild_locked(manifest, info, host, error);
+  lock_release(manifest->lock_fd);
+  return success;
+}
@@ -0,0 +1,49 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "flextop-utils.h"
+
+typedef struct Manifest Manifest;
+
+typedef struct ManifestIconFile {
+  char *checksum;
+  // The size of the icon this was scaled down from, or 0 if it was given as-is.
+  int source_size;
+} ManifestIconFile;
+
+Manifest *manifest_load(GError **error);
+void manifest_free(Manifest *manifest);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(Manifest, manifest_free)
+
+gboolean manifest_lookup_desktop_file(Manifest *manifest, const char *prefixed_filename,
+                                      const char **out_icon);
+GHashTable *manifest_get_icon_files(Manifest *manifest, const char *icon);
+const ManifestIconFile *manifest_lookup_icon_file(Manifest *manifest, const char *icon,
+                                                  const char *path);
+
+gboolean manifest_add_desktop_file(Manifest *manifest, const char *prefixed_filename,
+                                   const char *icon, GError **error);
+gboolean manifest_remove_desktop_file(Manifest *manifest, const char *prefixed_filename,
+                                      GError **error);
+gboolean manifest_add_icon_file(Manifest *manifest, const char *icon, const char *path,
+                                const char *checksum, int source_size, GError **error);
+gboolean manifest_remove_icon_file(Manifest *manifest, const char *icon,
+                                   const char *path, GError **error);
+
+gboolean manifest_rebuild(Manifest *manifest, FlatpakInfo *info, DataDir *host,
+                          GError **error);
@@ -0,0 +1,267 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Maintains the mimeinfo.cache in the host's applications dir, which maps each
+// MIME type to the desktop files that handle it, in the same format that
+// update-desktop-database writes. Instead of rescanning every desktop file, only
+// the entries of the files being installed or removed are updated.
+//
+// Other installs may save the cache while this one is running, so changes are
+// only remembered until saving, then applied to the latest cache under a lock.
+
+#include "flextop-mime-cache.h"
+#include "flextop-lock.h"
+
+#include <string.h>
+
+#define MIME_CACHE_NAME "mimeinfo.cache"
+#define MIME_CACHE_LOCK_NAME ".mimeinfo.cache.lock"
+#define MIME_CACHE_GROUP "MIME Cache"
+
+struct MimeCache {
+  char *path;
+  GFile *applications;
+  GKeyFile *key_file;
+
+  // Set if there was no cache yet, so the first addition has to pick up the
+  // desktop files that are already installed.
+  gboolean needs_seed;
+  gboolean modified;
+
+  // desktop file ID -> the MIME types it was given (NULL if it was removed)
+  GHashTable *changes;
+};
+
+static gboolean mime_cache_read(MimeCache *cache, GError **error) {
+  g_clear_pointer(&cache->key_file, g_key_file_unref);
+  cache->key_file = g_key_file_new();
+  cache->needs_seed = FALSE;
+  cache->modified = FALSE;
+
+  g_autoptr(GError) local_error = NULL;
+  if (!g_key_file_load_from_file(cache->key_file, cache->path, G_KEY_FILE_NONE,
+                                 &local_error)) {
+    if (!g_error_matches(local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+      g_propagate_prefixed_error(error, g_steal_pointer(&local_error), "Loading %s: ",
+                                 cache->path);
+      return FALSE;
+    }
+
+    cache->needs_seed = TRUE;
+  }
+
+  return TRUE;
+}
+
+MimeCache *mime_cache_load(DataDir *host, GError **error) {
+  g_autoptr(MimeCache) cache = g_new0(MimeCache, 1);
+  cache->applications = g_object_ref(host->applications);
+  cache->path =
+      g_build_filename(g_file_peek_path(host->applications), MIME_CACHE_NAME, NULL);
+  cache->changes =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_strfreev);
+
+  if (!mime_cache_read(cache, error)) {
+    return NULL;
+  }
+
+  return g_steal_pointer(&cache);
+}
+
+void mime_cache_free(MimeCache *cache) {
+  g_clear_pointer(&cache->changes, g_hash_table_unref);
+  g_free(cache->path);
+  g_clear_object(&cache->applications);
+  g_clear_pointer(&cache->key_file, g_key_file_unref);
+  g_free(cache);
+}
+
+static void remove_desktop_file(MimeCache *cache, const char *desktop_id) {
+  g_auto(GStrv) mime_types =
+      g_key_file_get_keys(cache->key_file, MIME_CACHE_GROUP, NULL, NULL);
+  if (mime_types == NULL) {
+    return;
+  }
+
+  for (char **mime_type = mime_types; *mime_type != NULL; mime_type++) {
+    gsize n_handlers = 0;
+    g_auto(GStrv) handlers = g_key_file_get_string_list(
+        cache->key_file, MIME_CACHE_GROUP, *mime_type, &n_handlers, NULL);
+    if (handlers == NULL || !g_strv_contains((const char *const *)handlers, desktop_id)) {
+      continue;
+    }
+
+    g_autoptr(GPtrArray) remaining = g_ptr_array_new();
+    for (char **handler = handlers; *handler != NULL; handler++) {
+      if (strcmp(*handler, desktop_id) != 0) {
+        g_ptr_array_add(remaining, *handler);
+      }
+    }
+
+    if (remaining->len == 0) {
+      g_key_file_remove_key(cache->key_file, MIME_CACHE_GROUP, *mime_type, NULL);
+    } else {
+      g_key_file_set_string_list(cache->key_file, MIME_CACHE_GROUP, *mime_type,
+                                 (const char *const *)remaining->pdata, remaining->len);
+    }
+
+    cache->modified = TRUE;
+  }
+}
+
+static void add_desktop_file(MimeCache *cache, const char *desktop_id,
+                             char **mime_types) {
+  for (char **mime_type = mime_types; *mime_type != NULL; mime_type++) {
+    if (**mime_type == '\0') {
+      continue;
+    }
+
+    gsize n_handlers = 0;
+    g_auto(GStrv) handlers = g_key_file_get_string_list(
+        cache->key_file, MIME_CACHE_GROUP, *mime_type, &n_handlers, NULL);
+    if (handlers != NULL &&
+        g_strv_contains((const char *const *)handlers, desktop_id)) {
+      continue;
+    }
+
+    g_autoptr(GPtrArray) updated = g_ptr_array_new();
+    for (gsize i = 0; i < n_handlers; i++) {
+      g_ptr_array_add(updated, handlers[i]);
+    }
+
+    g_ptr_array_add(updated, (char *)desktop_id);
+    g_key_file_set_string_list(cache->key_file, MIME_CACHE_GROUP, *mime_type,
+                               (const char *const *)updated->pdata, updated->len);
+    cache->modified = TRUE;
+  }
+}
+
+// Adds the desktop files in dir (and its subdirectories, whose names become part
+// of the desktop file IDs) to the cache.
+static void seed_from_dir(MimeCache *cache, GFile *dir, const char *id_prefix) {
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFileEnumerator) enumerator = g_file_enumerate_children(
+      dir, G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
+      G_FILE_QUERY_INFO_NONE, NULL, &error);
+  if (enumerator == NULL) {
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+      g_warning("Failed to enumerate %s: %s", g_file_peek_path(dir), error->message);
+    }
+
+    return;
+  }
+
+  for (;;) {
+    GFileInfo *child_info = NULL;
+    GFile *child = NULL;
+    if (!g_file_enumerator_iterate(enumerator, &child_info, &child, NULL, &error)) {
+      g_warning("Failed to enumerate %s: %s", g_file_peek_path(dir), error->message);
+      break;
+    } else if (child_info == NULL) {
+      break;
+    }
+
+    const char *name = g_file_info_get_name(child_info);
+    g_autofree char *id = g_strconcat(id_prefix, name, NULL);
+    if (g_file_info_get_file_type(child_info) == G_FILE_TYPE_DIRECTORY) {
+      g_autofree char *child_prefix = g_strconcat(id, "-", NULL);
+      seed_from_dir(cache, child, child_prefix);
+      continue;
+    } else if (!g_str_has_suffix(name, ".desktop")) {
+      continue;
+    }
+
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    if (!g_key_file_load_from_file(key_file, g_file_peek_path(child), G_KEY_FILE_NONE,
+                                   NULL)) {
+      continue;
+    }
+
+    g_auto(GStrv) mime_types = g_key_file_get_string_list(
+        key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_MIME_TYPE, NULL, NULL);
+    if (mime_types != NULL) {
+      add_desktop_file(cache, id, mime_types);
+    }
+  }
+}
+
+static void apply_desktop_file(MimeCache *cache, const char *desktop_id,
+                               char **mime_types) {
+  gboolean has_mime_types = mime_types != NULL && *mime_types != NULL;
+  if (cache->needs_seed) {
+    if (!has_mime_types) {
+      // Nothing to add, and nothing to remove from a cache that doesn't exist.
+      return;
+    }
+
+    g_debug("Seeding %s from the installed desktop files", cache->path);
+    seed_from_dir(cache, cache->applications, "");
+    cache->needs_seed = FALSE;
+    cache->modified = TRUE;
+  }
+
+  remove_desktop_file(cache, desktop_id);
+  if (has_mime_types) {
+    add_desktop_file(cache, desktop_id, mime_types);
+  }
+}
+
+// Replaces the MIME types handled by the desktop file. If mime_types is NULL or
+// empty, the desktop file is removed from the cache.
+void mime_cache_set_desktop_file(MimeCache *cache, const char *desktop_id,
+                                 char **mime_types) {
+  g_hash_table_replace(cache->changes, g_strdup(desktop_id), g_strdupv(mime_types));
+  cache->modified = TRUE;
+}
+
+gboolean mime_cache_save(MimeCache *cache, GError **error) {
+  if (!cache->modified) {
+    return TRUE;
+  }
+
+  g_autofree char *lock_path = g_build_filename(g_file_peek_path(cache->applications),
+                                                MIME_CACHE_LOCK_NAME, NULL);
+  g_auto(LockFd) lock =
+      lock_acquire(lock_path, LOCK_MODE_EXCLUSIVE, LOCK_DEFAULT_TIMEOUT_MS, error);
+  if (lock == -1) {
+    return FALSE;
+  }
+
+  // Start over from whatever the cache is now, in case another install saved it
+  // since it was loaded.
+  if (!mime_cache_read(cache, error)) {
+    return FALSE;
+  }
+
+  GHashTableIter iter;
+  gpointer desktop_id, mime_types;
+  g_hash_table_iter_init(&iter, cache->changes);
+  while (g_hash_table_iter_next(&iter, &desktop_id, &mime_types)) {
+    apply_desktop_file(cache, desktop_id, mime_types);
+  }
+
+  if (cache->modified) {
+    gsize length;
+    g_autofree char *contents = g_key_file_to_data(cache->key_file, &length, NULL);
+    if (!write_file_with_durability(cache->path, contents, length, get_durability(),
+                                    error)) {
+      return FALSE;
+    }
+  }
+
+  cache->modified = FALSE;
+  g_hash_table_remove_all(cache->changes);
+  return TRUE;
+}
@@ -0,0 +1,29 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "flextop-utils.h"
+
+typedef struct MimeCache MimeCache;
+
+MimeCache *mime_cache_load(DataDir *host, GError **error);
+void mime_cache_free(MimeCache *cache);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(MimeCache, mime_cache_free)
+
+void mime_cache_set_desktop_file(MimeCache *cache, const char *desktop_id,
+                                 char **mime_types);
+gboolean mime_cache_save(MimeCache *cache, GError **error);
@@ -0,0 +1,217 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "flextop-service-ipc.h"
+#include "flextop-utils.h"
+
+#include <gio/gunixsocketaddress.h>
+#include <unistd.h>
+
+// Messages are tiny (an argv and a few warnings), so anything larger than this
+// means the peer is confused.
+#define MAX_MESSAGE_SIZE (1024 * 1024)
+
+// Bulk installs are handled in one request, so this has to be generous.
+#define CLIENT_TIMEOUT_SECONDS 60
+
+// The variables that change what the tools do. The service was started with
+// whatever environment the first client had, so each request carries the
+// client's own values of these.
+const char *const service_forwarded_env[] = {
+    "CHROME_WRAPPER",
+    "FLEXTOP_DURABILITY",
+    "FLEXTOP_ICON_SIZES",
+    NULL,
+};
+
+char *service_get_runtime_path(const char *app_id, const char *name) {
+  return g_build_filename(g_get_user_runtime_dir(), "app", app_id, name, NULL);
+}
+
+gboolean service_write_message(GOutputStream *stream, GVariant *message, GError **error) {
+  g_autoptr(GVariant) normal = g_variant_get_normal_form(message);
+  gsize size = g_variant_get_size(normal);
+  guint32 header = GUINT32_TO_LE(size);
+
+  if (!g_output_stream_write_all(stream, &header, sizeof(header), NULL, NULL, error) ||
+      !g_output_stream_write_all(stream, g_variant_get_data(normal), size, NULL, NULL,
+                                 error)) {
+    g_prefix_error(error, "Writing message: ");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+GVariant *service_read_message(GInputStream *stream, const char *type, GError **error) {
+  guint32 header;
+  gsize bytes_read;
+  if (!g_input_stream_read_all(stream, &header, sizeof(header), &bytes_read, NULL,
+                               error)) {
+    g_prefix_error(error, "Reading message header: ");
+    return NULL;
+  }
+
+  if (bytes_read != sizeof(header)) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                "Connection closed before message header");
+    return NULL;
+  }
+
+  gsize size = GUINT32_FROM_LE(header);
+  if (size > MAX_MESSAGE_SIZE) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                "Message too large (%" G_GSIZE_FORMAT " bytes)", size);
+    return NULL;
+  }
+
+  g_autofree char *data = g_malloc(size);
+  if (!g_input_stream_read_all(stream, data, size, &bytes_read, NULL, error)) {
+    g_prefix_error(error, "Reading message: ");
+    return NULL;
+  }
+
+  if (bytes_read != size) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                "Connection closed in the middle of a message");
+    return NULL;
+  }
+
+  g_autoptr(GBytes) bytes = g_bytes_new_take(g_steal_pointer(&data), size);
+  g_autoptr(GVariant) message =
+      g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(type), bytes, FALSE));
+  if (!g_variant_is_normal_form(message)) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Malformed message");
+    return NULL;
+  }
+
+  return g_steal_pointer(&message);
+}
+
+static void child_setup_new_session(gpointer user_data) { setsid(); }
+
+// Builds with -Dtest_hooks=true let FLEXTOP_TEST_BINDIR point at an uninstalled
+// build's service instead of the installed one.
+static char *get_service_path() {
+#ifdef FLEXTOP_TEST_HOOKS
+  const char *bindir = g_getenv("FLEXTOP_TEST_BINDIR");
+  if (bindir != NULL) {
+    return g_build_filename(bindir, SERVICE_EXECUTABLE, NULL);
+  }
+#endif
+
+  return g_build_filename(FLEXTOP_BINDIR, SERVICE_EXECUTABLE, NULL);
+}
+
+static void start_service() {
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = get_service_path();
+  char *argv[] = {path, NULL};
+
+  // The client exits right away, so make sure the service doesn't keep any of
+  // Chromium's pipes open or get killed along with the client's session.
+  if (!g_spawn_async(NULL, argv, NULL,
+                     G_SPAWN_STDIN_FROM_DEV_NULL | G_SPAWN_STDOUT_TO_DEV_NULL |
+                         G_SPAWN_STDERR_TO_DEV_NULL,
+                     child_setup_new_session, NULL, NULL, &error)) {
+    g_debug("Failed to start %s: %s", path, error->message);
+  }
+}
+
+static GVariant *build_request_env() {
+  GVariantBuilder builder;
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("a{ss}"));
+  for (const char *const *name = service_forwarded_env; *name != NULL; name++) {
+    const char *value = g_getenv(*name);
+    if (value != NULL) {
+      g_variant_builder_add(&builder, "{ss}", *name, value);
+    }
+  }
+
+  // The Desktop comes from the user-dirs config, which the service would otherwise
+  // have cached as of when it started.
+  const char *desktop_dir = g_get_user_special_dir(G_USER_DIRECTORY_DESKTOP);
+  if (desktop_dir != NULL) {
+    g_variant_builder_add(&builder, "{ss}", CLIENT_ENV_DESKTOP_DIR, desktop_dir);
+  }
+
+  return g_variant_builder_end(&builder);
+}
+
+// Tries to run the given command line inside the flextop service. Any paths in argv
+// must already be absolute. Returns SERVICE_FORWARD_DONE with the exit status if
+// the service ran it, otherwise the caller should do the work itself.
+ServiceForwardResult service_forward(const char *tool, char **argv, int *out_status) {
+  g_autoptr(GError) error = NULL;
+
+  if (g_strcmp0(g_getenv(SERVICE_ENV_ENABLE), "1") != 0) {
+    return SERVICE_FORWARD_UNAVAILABLE;
+  }
+
+  // FLATPAK_ID saves having to parse the Flatpak info just to find the socket.
+  const char *app_id = g_getenv("FLATPAK_ID");
+  if (app_id == NULL) {
+    return SERVICE_FORWARD_UNAVAILABLE;
+  }
+
+  g_autofree char *socket_path = service_get_runtime_path(app_id, ".flextop-service");
+  g_autoptr(GSocketAddress) address = g_unix_socket_address_new(socket_path);
+  g_autoptr(GSocketClient) client = g_socket_client_new();
+  g_socket_client_set_timeout(client, CLIENT_TIMEOUT_SECONDS);
+
+  g_autoptr(GSocketConnection) connection =
+      g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address), NULL, &error);
+  if (connection == NULL) {
+    g_debug("Could not connect to %s: %s", socket_path, error->message);
+    start_service();
+    return SERVICE_FORWARD_UNAVAILABLE;
+  }
+
+  // The arrays are passed as GVariants, which the format has to say with '@'.
+  GVariant *argv_variant = g_variant_new_strv((const char *const *)argv, -1);
+  g_autoptr(GVariant) request = g_variant_ref_sink(
+      g_variant_new("(s@as@a{ss})", tool, argv_variant, build_request_env()));
+  if (!service_write_message(g_io_stream_get_output_stream(G_IO_STREAM(connection)),
+                             request, &error)) {
+    g_debug("Failed to send request to service: %s", error->message);
+    return SERVICE_FORWARD_UNAVAILABLE;
+  }
+
+  // The most likely cause is the service shutting down due to being idle before
+  // accepting us, in which case the request was never run. It may also have been
+  // partway through it though, which the caller has to allow for.
+  g_autoptr(GVariant) reply = service_read_message(
+      g_io_stream_get_input_stream(G_IO_STREAM(connection)), SERVICE_REPLY_TYPE, &error);
+  if (reply == NULL) {
+    g_debug("Failed to read reply from service: %s", error->message);
+    return SERVICE_FORWARD_REPLY_LOST;
+  }
+
+  int status;
+  g_autoptr(GVariantIter) warnings = NULL;
+  g_variant_get(reply, "(ias)", &status, &warnings);
+
+  const char *warning;
+  while (g_variant_iter_next(warnings, "&s", &warning)) {
+    g_warning("%s", warning);
+  }
+
+  if (status == SERVICE_STATUS_FALLBACK) {
+    return SERVICE_FORWARD_UNAVAILABLE;
+  }
+
+  *out_status = status;
+  return SERVICE_FORWARD_DONE;
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+
+// Requests are (tool, argv, environment), replies are (exit status, warnings). The
+// paths in argv are absolute, since the service doesn't share the client's working
+// directory, and the environment only holds the variables in service_forwarded_env
+// that the client has set.
+#define SERVICE_REQUEST_TYPE "(sasa{ss})"
+#define SERVICE_REPLY_TYPE "(ias)"
+
+// Returned by the service when a request has to be run by the client itself,
+// e.g. because it needs to read stdin or show a dialog.
+#define SERVICE_STATUS_FALLBACK -1
+
+#define SERVICE_ENV_ENABLE "FLEXTOP_SERVICE"
+#define SERVICE_EXECUTABLE "flextop-service"
+
+extern const char *const service_forwarded_env[];
+
+char *service_get_runtime_path(const char *app_id, const char *name);
+
+gboolean service_write_message(GOutputStream *stream, GVariant *message, GError **error);
+GVariant *service_read_message(GInputStream *stream, const char *type, GError **error);
+
+typedef enum {
+  // The service ran the command, and out_status is its exit status.
+  SERVICE_FORWARD_DONE,
+  // The service didn't run the command, so the caller has to.
+  SERVICE_FORWARD_UNAVAILABLE,
+  // The request was sent but no reply came back, so the service may have run some
+  // or all of the command already.
+  SERVICE_FORWARD_REPLY_LOST,
+} ServiceForwardResult;
+
+ServiceForwardResult service_forward(const char *tool, char **argv, int *out_status);
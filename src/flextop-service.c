@@ -0,0 +1,287 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "flextop-desktop-menu.h"
+#include "flextop-icon-resource.h"
+#include "flextop-lock.h"
+#include "flextop-service-ipc.h"
+#include "flextop-trace.h"
+#include "flextop-utils.h"
+
+#include <errno.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib.h>
+
+#define IDLE_TIMEOUT_SECONDS 30
+// Requests are handled one at a time, so a client that stalls while sending one
+// mustn't be allowed to hold up everyone else for long.
+#define REQUEST_TIMEOUT_SECONDS 5
+
+typedef struct Service {
+  FlatpakInfo *info;
+  DataDir *host;
+  gboolean has_host_access;
+
+  GMainLoop *loop;
+  guint idle_source;
+
+  // Warnings logged while handling the current request, which are sent back to
+  // the client so they still end up in Chromium's logs. Workers handling the
+  // request's files can log too, so it's guarded by the lock.
+  GPtrArray *warnings;
+  GMutex warnings_lock;
+} Service;
+
+static GLogWriterOutput service_log_writer(GLogLevelFlags log_level,
+                                           const GLogField *fields, gsize n_fields,
+                                           gpointer user_data) {
+  Service *service = user_data;
+
+  if (log_level & (G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING | G_LOG_LEVEL_MESSAGE)) {
+    g_mutex_lock(&service->warnings_lock);
+    for (gsize i = 0; service->warnings != NULL && i < n_fields; i++) {
+      if (strcmp(fields[i].key, "MESSAGE") == 0) {
+        g_ptr_array_add(service->warnings, g_strdup(fields[i].value));
+        break;
+      }
+    }
+    g_mutex_unlock(&service->warnings_lock);
+  }
+
+  return g_log_writer_default(log_level, fields, n_fields, user_data);
+}
+
+static gboolean on_idle_timeout(gpointer user_data) {
+  Service *service = user_data;
+
+  g_debug("Exiting due to inactivity");
+  service->idle_source = 0;
+  g_main_loop_quit(service->loop);
+  return G_SOURCE_REMOVE;
+}
+
+static void reset_idle_timeout(Service *service) {
+  if (service->idle_source != 0) {
+    g_source_remove(service->idle_source);
+  }
+
+  service->idle_source =
+      g_timeout_add_seconds(IDLE_TIMEOUT_SECONDS, on_idle_timeout, service);
+}
+
+static gboolean ensure_host_access(Service *service) {
+  // Access can only change by restarting the sandbox, which restarts us too, so
+  // a success can be remembered. Failures are rechecked, since the client shows
+  // a dialog for them.
+  if (!service->has_host_access) {
+    service->has_host_access = data_dir_test_access(service->host);
+  }
+
+  return service->has_host_access;
+}
+
+static int run_desktop_menu(Service *service, int argc, char **argv) {
+  DesktopMenuCommand command;
+  g_autoptr(GPtrArray) files = g_ptr_array_new();
+  if (!desktop_menu_parse_args(argc, argv, &command, files)) {
+    return 1;
+  }
+
+  if (command == DESKTOP_MENU_COMMAND_INSTALL && !ensure_host_access(service)) {
+    return SERVICE_STATUS_FALLBACK;
+  }
+
+  return desktop_menu_run(command, files, FALSE, service->info, service->host);
+}
+
+static int run_icon_resource(Service *service, int argc, char **argv) {
+  g_autoptr(GPtrArray) requests =
+      g_ptr_array_new_with_free_func((GDestroyNotify)icon_request_free);
+  IconResourceCommand command;
+  gboolean read_stdin, noupdate;
+  if (!icon_resource_parse_args(argc, argv, &command, requests, &read_stdin, &noupdate)) {
+    return 1;
+  }
+
+  // Clients read their stdin themselves and pass the batch on the command line.
+  if (read_stdin) {
+    return SERVICE_STATUS_FALLBACK;
+  }
+
+  if (!ensure_host_access(service)) {
+    g_warning("Warning: no host access");
+    return 1;
+  }
+
+  return icon_resource_run(command, requests, noupdate, service->info, service->host);
+}
+
+static int run_request(Service *service, GVariant *request) {
+  const char *tool = NULL;
+  g_autofree char **argv = NULL;
+  g_autoptr(GVariantIter) env_iter = NULL;
+  g_variant_get(request, "(&s^a&sa{ss})", &tool, &argv, &env_iter);
+
+  int argc = g_strv_length(argv);
+
+  g_debug("Handling request for %s", tool);
+
+  // The strings are owned by the request, which outlives the table.
+  g_autoptr(GHashTable) env = g_hash_table_new(g_str_hash, g_str_equal);
+  const char *name, *value;
+  while (g_variant_iter_next(env_iter, "{&s&s}", &name, &value)) {
+    g_hash_table_insert(env, (gpointer)name, (gpointer)value);
+  }
+
+  int status;
+  client_env_set(env);
+  if (strcmp(tool, "xdg-desktop-menu") == 0) {
+    status = run_desktop_menu(service, argc, argv);
+  } else if (strcmp(tool, "xdg-icon-resource") == 0) {
+    status = run_icon_resource(service, argc, argv);
+  } else {
+    g_warning("Unknown tool: %s", tool);
+    status = SERVICE_STATUS_FALLBACK;
+  }
+  client_env_set(NULL);
+
+  return status;
+}
+
+static gboolean on_incoming(GSocketService *socket_service, GSocketConnection *connection,
+                            GObject *source_object, gpointer user_data) {
+  Service *service = user_data;
+  g_autoptr(GError) error = NULL;
+
+  reset_idle_timeout(service);
+  g_socket_set_timeout(g_socket_connection_get_socket(connection),
+                       REQUEST_TIMEOUT_SECONDS);
+
+  // Requests are handled one at a time, which keeps them from racing with each
+  // other the same way separate processes could.
+  GInputStream *input = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+  g_autoptr(GVariant) request = service_read_message(input, SERVICE_REQUEST_TYPE, &error);
+  if (request == NULL) {
+    g_warning("Failed to read request: %s", error->message);
+    return TRUE;
+  }
+
+  g_autoptr(GPtrArray) warnings = g_ptr_array_new_with_free_func(g_free);
+  service->warnings = warnings;
+  TraceSpan *span = trace_span_begin("run_request", NULL);
+  int status = run_request(service, request);
+  service->warnings = NULL;
+
+  // The directories may be removed and recreated before the next request, so
+  // don't hang on to them.
+  for (int i = 0; i < DATA_DIR_N; i++) {
+    data_dir_close_fd(service->host, i);
+  }
+  if (span != NULL) {
+    trace_span_end(span);
+    // The service can run for a while, so don't hold the events until it exits.
+    trace_flush();
+  }
+
+  g_ptr_array_add(warnings, NULL);
+  GVariant *warnings_variant =
+      g_variant_new_strv((const char *const *)warnings->pdata, warnings->len - 1);
+  g_autoptr(GVariant) reply =
+      g_variant_ref_sink(g_variant_new("(i@as)", status, warnings_variant));
+  if (!service_write_message(g_io_stream_get_output_stream(G_IO_STREAM(connection)),
+                             reply, &error)) {
+    g_warning("Failed to send reply: %s", error->message);
+  }
+
+  reset_idle_timeout(service);
+  return TRUE;
+}
+
+// Only one service may run per app. Whoever holds this lock owns the socket.
+static LockFd try_acquire_service_lock(FlatpakInfo *info, GError **error) {
+  g_autofree char *lock_filename =
+      service_get_runtime_path(info->app, ".flextop-service-lock");
+  return lock_acquire(lock_filename, LOCK_MODE_EXCLUSIVE, 0, error);
+}
+
+int main() {
+  g_set_prgname("flextop-service");
+  trace_init("flextop-service");
+
+  g_autoptr(GError) error = NULL;
+
+  if (!ensure_running_inside_flatpak()) {
+    return 1;
+  }
+
+  Service service = {0};
+  g_mutex_init(&service.warnings_lock);
+  g_log_set_writer_func(service_log_writer, &service, NULL);
+
+  g_autoptr(FlatpakInfo) info = flatpak_info_new();
+  if (!flatpak_info_load(info, &error)) {
+    g_warning("Failed to load flatpak info: %s", error->message);
+    return 1;
+  }
+
+  g_auto(LockFd) lock = try_acquire_service_lock(info, &error);
+  if (lock == -1) {
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+      g_debug("Service is already running");
+      return 0;
+    }
+
+    g_warning("%s", error->message);
+    return 1;
+  }
+
+  g_autoptr(DataDir) host = data_dir_new_host(info);
+  service.info = info;
+  service.host = host;
+
+  // Holding the lock means any existing socket is left over from a service that
+  // died without cleaning up.
+  g_autofree char *socket_path = service_get_runtime_path(info->app, ".flextop-service");
+  if (unlink(socket_path) == -1 && errno != ENOENT) {
+    int err = errno;
+    g_warning("Failed to remove stale socket %s: %s", socket_path, g_strerror(err));
+    return 1;
+  }
+
+  g_autoptr(GSocketAddress) address = g_unix_socket_address_new(socket_path);
+  g_autoptr(GSocketService) socket_service = g_socket_service_new();
+  if (!g_socket_listener_add_address(G_SOCKET_LISTENER(socket_service), address,
+                                     G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                                     NULL, NULL, &error)) {
+    g_warning("Failed to listen on %s: %s", socket_path, error->message);
+    return 1;
+  }
+
+  g_signal_connect(socket_service, "incoming", G_CALLBACK(on_incoming), &service);
+  g_socket_service_start(socket_service);
+
+  g_autoptr(GMainLoop) loop = g_main_loop_new(NULL, FALSE);
+  service.loop = loop;
+  reset_idle_timeout(&service);
+  g_main_loop_run(loop);
+
+  // Remove the socket before closing the listener, so new clients fall back
+  // instead of connecting to a service that will never answer.
+  unlink(socket_path);
+  g_socket_service_stop(socket_service);
+  g_socket_listener_close(G_SOCKET_LISTENER(socket_service));
+
+  return 0;
+}
@@ -0,0 +1,227 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "flextop-trace.h"
+#include "flextop-utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRACE_FILENAME "flextop-trace.json"
+
+gboolean trace_enabled = FALSE;
+
+// Events are buffered and only written out by trace_flush(), so tracing doesn't
+// add writes in the middle of the phases being measured. Spans can end on worker
+// threads, so the buffer is guarded by the lock.
+static GString *pending_events = NULL;
+static GMutex pending_events_lock;
+
+typedef struct IoCounts {
+  guint64 syscr;
+  guint64 syscw;
+} IoCounts;
+
+struct TraceSpan {
+  char *name;
+  char *file;
+  gint64 start;
+  IoCounts io;
+};
+
+// Reads the read and write syscall counts from /proc/self/io. These include the
+// couple of syscalls it takes to read the file itself.
+static void read_io_counts(IoCounts *counts) {
+  memset(counts, 0, sizeof(*counts));
+
+  char buffer[512];
+  int fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+
+  ssize_t bytes = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (bytes <= 0) {
+    return;
+  }
+
+  buffer[bytes] = '\0';
+  for (char *line = buffer; line != NULL && *line != '\0';) {
+    char *next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+
+    if (g_str_has_prefix(line, "syscr: ")) {
+      counts->syscr = g_ascii_strtoull(line + strlen("syscr: "), NULL, 10);
+    } else if (g_str_has_prefix(line, "syscw: ")) {
+      counts->syscw = g_ascii_strtoull(line + strlen("syscw: "), NULL, 10);
+    }
+
+    line = next;
+  }
+}
+
+static void append_json_string(GString *out, const char *str) {
+  g_string_append_c(out, '"');
+  for (const char *c = str; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      g_string_append_c(out, '\\');
+      g_string_append_c(out, *c);
+    } else if ((guchar)*c < 0x20) {
+      g_string_append_printf(out, "\\u%04x", (guchar)*c);
+    } else {
+      g_string_append_c(out, *c);
+    }
+  }
+  g_string_append_c(out, '"');
+}
+
+static void on_exit_flush() { trace_flush(); }
+
+void trace_init(const char *process_name) {
+  const char *value = g_getenv("FLEXTOP_TRACE");
+  if (value == NULL || *value == '\0' || strcmp(value, "0") == 0) {
+    return;
+  }
+
+  trace_enabled = TRUE;
+  pending_events = g_string_new(NULL);
+
+  g_string_append_printf(pending_events,
+                         "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                         "\"args\":{\"name\":",
+                         getpid());
+  append_json_string(pending_events, process_name);
+  g_string_append(pending_events, "}},\n");
+
+  atexit(on_exit_flush);
+}
+
+TraceSpan *trace_span_begin_real(const char *name, const char *file) {
+  TraceSpan *span = g_new0(TraceSpan, 1);
+  span->name = g_strdup(name);
+  span->file = g_strdup(file);
+  read_io_counts(&span->io);
+  span->start = g_get_monotonic_time();
+  return span;
+}
+
+void trace_span_end(TraceSpan *span) {
+  gint64 end = g_get_monotonic_time();
+  IoCounts io;
+  read_io_counts(&io);
+
+  // Complete events only need to be well-nested per thread, which they are as
+  // long as spans are ended in reverse order.
+  g_mutex_lock(&pending_events_lock);
+  g_string_append(pending_events, "{\"name\":");
+  append_json_string(pending_events, span->name);
+  g_string_append_printf(pending_events,
+                         ",\"cat\":\"flextop\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+                         ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d,"
+                         "\"args\":{\"syscr\":%" G_GUINT64_FORMAT
+                         ",\"syscw\":%" G_GUINT64_FORMAT,
+                         span->start, end - span->start, getpid(), gettid(),
+                         io.syscr - span->io.syscr, io.syscw - span->io.syscw);
+  if (span->file != NULL) {
+    g_string_append(pending_events, ",\"file\":");
+    append_json_string(pending_events, span->file);
+  }
+  g_string_append(pending_events, "}},\n");
+  g_mutex_unlock(&pending_events_lock);
+
+  g_free(span->name);
+  g_free(span->file);
+  g_free(span);
+}
+
+void trace_counters_real(const char *name, const char *const *keys, const guint *values,
+                         gsize n_values) {
+  g_mutex_lock(&pending_events_lock);
+  g_string_append(pending_events, "{\"name\":");
+  append_json_string(pending_events, name);
+  g_string_append_printf(pending_events,
+                         ",\"cat\":\"flextop\",\"ph\":\"C\",\"ts\":%" G_GINT64_FORMAT
+                         ",\"pid\":%d,\"args\":{",
+                         g_get_monotonic_time(), getpid());
+  for (gsize i = 0; i < n_values; i++) {
+    if (i > 0) {
+      g_string_append_c(pending_events, ',');
+    }
+    append_json_string(pending_events, keys[i]);
+    g_string_append_printf(pending_events, ":%u", values[i]);
+  }
+  g_string_append(pending_events, "}},\n");
+  g_mutex_unlock(&pending_events_lock);
+}
+
+// Appends the buffered events to the trace file. The file is a JSON array that's
+// never closed, which the trace viewers accept, so any number of processes can
+// keep appending to it.
+void trace_flush() {
+  if (!trace_enabled || pending_events->len == 0) {
+    return;
+  }
+
+  g_autofree char *path =
+      g_build_filename(g_get_user_runtime_dir(), TRACE_FILENAME, NULL);
+  g_auto(AutoFd) fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    int err = errno;
+    g_debug("Failed to open trace file %s: %s", path, g_strerror(err));
+    return;
+  }
+
+  // Keep concurrent tools from interleaving their writes or both starting the
+  // array.
+  if (flock(fd, LOCK_EX) == -1) {
+    int err = errno;
+    g_debug("Failed to lock trace file %s: %s", path, g_strerror(err));
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size == 0) {
+    g_string_prepend(pending_events, "[\n");
+  }
+
+  const char *data = pending_events->str;
+  gsize remaining = pending_events->len;
+  while (remaining > 0) {
+    ssize_t bytes = write(fd, data, remaining);
+    if (bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      int err = errno;
+      g_debug("Failed to write trace file %s: %s", path, g_strerror(err));
+      break;
+    }
+
+    data += bytes;
+    remaining -= bytes;
+  }
+
+  g_string_truncate(pending_events, 0);
+}
@@ -0,0 +1,50 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <glib.h>
+
+// Opt-in phase timing, enabled by setting FLEXTOP_TRACE=1. Spans are appended to
+// $XDG_RUNTIME_DIR/flextop-trace.json in Chrome's trace-event format, which can
+// be opened directly in Perfetto or chrome://tracing.
+
+typedef struct TraceSpan TraceSpan;
+
+extern gboolean trace_enabled;
+
+void trace_init(const char *process_name);
+void trace_flush();
+
+TraceSpan *trace_span_begin_real(const char *name, const char *file);
+void trace_span_end(TraceSpan *span);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(TraceSpan, trace_span_end)
+
+void trace_counters_real(const char *name, const char *const *keys, const guint *values,
+                         gsize n_values);
+
+// Returns NULL without doing anything else when tracing is disabled, so spans
+// cost a single branch in normal runs. file may be NULL.
+static inline TraceSpan *trace_span_begin(const char *name, const char *file) {
+  return G_UNLIKELY(trace_enabled) ? trace_span_begin_real(name, file) : NULL;
+}
+
+// Records a set of named counts at this point, e.g. how many files took each path.
+static inline void trace_counters(const char *name, const char *const *keys,
+                                  const guint *values, gsize n_values) {
+  if (G_UNLIKELY(trace_enabled)) {
+    trace_counters_real(name, keys, values, n_values);
+  }
+}
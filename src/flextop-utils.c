@@ -16,12 +16,30 @@
 #include "flextop-utils.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
-#include <gtk/gtk.h>
+#include <linux/fs.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Builds with -Dtest_hooks=true let the sandbox be faked by pointing
+// FLEXTOP_TEST_FLATPAK_INFO at a flatpak-info file.
+const char *get_flatpak_info_path() {
+#ifdef FLEXTOP_TEST_HOOKS
+  const char *path = g_getenv("FLEXTOP_TEST_FLATPAK_INFO");
+  if (path != NULL) {
+    return path;
+  }
+#endif
+
+  return FLATPAK_INFO_PATH;
+}
 
 gboolean ensure_running_inside_flatpak() {
-  g_autoptr(GFile) flatpak_info = g_file_new_for_path("/.flatpak-info");
+  g_autoptr(GFile) flatpak_info = g_file_new_for_path(get_flatpak_info_path());
   if (!g_file_query_exists(flatpak_info, NULL)) {
     g_printerr("This may only be run inside a Flatpak!\n");
     return FALSE;
@@ -30,6 +48,34 @@ gboolean ensure_running_inside_flatpak() {
   return TRUE;
 }
 
+// Only changed by the service in between requests, while no workers are running.
+static GHashTable *client_env = NULL;
+
+// Makes client_getenv() return the values in env, which must hold every variable
+// the client has set that may be looked up, until it's reset with NULL.
+void client_env_set(GHashTable *env) { client_env = env; }
+
+const char *client_getenv(const char *name) {
+  if (client_env != NULL) {
+    return g_hash_table_lookup(client_env, name);
+  }
+
+  return g_getenv(name);
+}
+
+// Inside the service, a client that didn't send its Desktop gets the service's own,
+// which only differs if the user-dirs config changed since the service started.
+const char *client_get_desktop_dir() {
+  if (client_env != NULL) {
+    const char *desktop_dir = g_hash_table_lookup(client_env, CLIENT_ENV_DESKTOP_DIR);
+    if (desktop_dir != NULL) {
+      return desktop_dir;
+    }
+  }
+
+  return g_get_user_special_dir(G_USER_DIRECTORY_DESKTOP);
+}
+
 gboolean mkdir_with_parents_exists_ok(GFile *dir, GError **error) {
   g_autoptr(GError) local_error = NULL;
   if (!g_file_make_directory_with_parents(dir, NULL, &local_error) &&
@@ -52,8 +98,293 @@ GFile *get_flextop_data_dir(GError **error) {
   return g_steal_pointer(&file);
 }
 
+const char *copy_strategy_to_string(CopyStrategy strategy) {
+  switch (strategy) {
+  case COPY_STRATEGY_REFLINK:
+    return "reflink";
+  case COPY_STRATEGY_COPY_FILE_RANGE:
+    return "copy_file_range";
+  case COPY_STRATEGY_HARDLINK:
+    return "hardlink";
+  case COPY_STRATEGY_FALLBACK:
+    return "copy";
+  case COPY_STRATEGY_N:
+    break;
+  }
+
+  g_return_val_if_reached(NULL);
+}
+
+static gboolean copy_fd_with_copy_file_range(int source_fd, int dest_fd, goffset size) {
+  while (size > 0) {
+    ssize_t copied = copy_file_range(source_fd, NULL, dest_fd, NULL, size, 0);
+    if (copied == -1) {
+      int err = errno;
+      g_debug("copy_file_range failed: %s", g_strerror(err));
+      return FALSE;
+    } else if (copied == 0) {
+      // The source shrank underneath us.
+      break;
+    }
+
+    size -= copied;
+  }
+
+  return TRUE;
+}
+
+// Tries to place source at dest without copying the data through userspace,
+// trying in order: a reflink, copy_file_range, and (if allowed, i.e. the
+// source won't be modified afterwards) a hardlink. If none of those work, this
+// falls back to a regular copy. Every strategy writes to a temporary file that is
+// then renamed over dest.
+gboolean copy_file_fast(const char *source, const char *dest, gboolean allow_hardlink,
+                        CopyStrategy *out_strategy, GError **error) {
+  g_auto(AutoFd) source_fd = open(source, O_RDONLY | O_CLOEXEC);
+  struct stat source_st;
+  if (source_fd == -1 || fstat(source_fd, &source_st) == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to open %s: %s",
+                source, g_strerror(err));
+    return FALSE;
+  }
+
+  g_autofree char *temp_path = g_strdup_printf("%s.XXXXXX", dest);
+  g_auto(AutoFd) dest_fd = g_mkstemp_full(temp_path, O_WRONLY | O_CLOEXEC, 0644);
+  if (dest_fd == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to create temporary file for %s: %s", dest, g_strerror(err));
+    return FALSE;
+  }
+
+  gboolean placed = FALSE;
+  CopyStrategy strategy = COPY_STRATEGY_FALLBACK;
+
+#ifdef FICLONE
+  if (ioctl(dest_fd, FICLONE, source_fd) == 0) {
+    placed = TRUE;
+    strategy = COPY_STRATEGY_REFLINK;
+  }
+#endif
+
+  if (!placed) {
+    if (copy_fd_with_copy_file_range(source_fd, dest_fd, source_st.st_size)) {
+      placed = TRUE;
+      strategy = COPY_STRATEGY_COPY_FILE_RANGE;
+    } else if (ftruncate(dest_fd, 0) == -1) {
+      g_debug("Failed to truncate %s: %s", temp_path, g_strerror(errno));
+    }
+  }
+
+  if (!placed && allow_hardlink) {
+    // link() won't replace the temporary file, so it has to go first.
+    if (unlink(temp_path) == 0 && link(source, temp_path) == 0) {
+      placed = TRUE;
+      strategy = COPY_STRATEGY_HARDLINK;
+    } else {
+      g_debug("Failed to link %s to %s: %s", source, temp_path, g_strerror(errno));
+    }
+  }
+
+  if (!placed) {
+    // Readers must never see a partially copied dest, so this still goes through
+    // the temporary file.
+    g_autoptr(GFile) source_file = g_file_new_for_path(source);
+    g_autoptr(GFile) temp_file = g_file_new_for_path(temp_path);
+    if (!g_file_copy(source_file, temp_file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL,
+                     error)) {
+      unlink(temp_path);
+      return FALSE;
+    }
+  }
+
+  if (rename(temp_path, dest) == -1) {
+    int err = errno;
+    unlink(temp_path);
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to rename %s to %s: %s", temp_path, dest, g_strerror(err));
+    return FALSE;
+  }
+
+  g_debug("Copied %s to %s using %s", source, dest, copy_strategy_to_string(strategy));
+  if (out_strategy != NULL) {
+    *out_strategy = strategy;
+  }
+
+  return TRUE;
+}
+
+// Atomically replaces dest with a hardlink to target.
+gboolean replace_with_hardlink(const char *target, const char *dest, GError **error) {
+  // Reserve a unique name, then swap the placeholder out for the link, since
+  // link() won't overwrite anything.
+  g_autofree char *temp_path = g_strdup_printf("%s.XXXXXX", dest);
+  g_auto(AutoFd) temp_fd = g_mkstemp_full(temp_path, O_WRONLY | O_CLOEXEC, 0644);
+  if (temp_fd == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to create temporary file for %s: %s", dest, g_strerror(err));
+    return FALSE;
+  }
+
+  if (unlink(temp_path) == -1 || link(target, temp_path) == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to link %s: %s",
+                target, g_strerror(err));
+    return FALSE;
+  }
+
+  if (rename(temp_path, dest) == -1) {
+    int err = errno;
+    unlink(temp_path);
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to rename %s to %s: %s", temp_path, dest, g_strerror(err));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Renames old_name to new_name relative to the given directory fds, failing with
+// G_IO_ERROR_EXISTS instead of replacing new_name.
+gboolean rename_at_noreplace(int old_dir_fd, const char *old_name, int new_dir_fd,
+                             const char *new_name, GError **error) {
+  int rc = renameat2(old_dir_fd, old_name, new_dir_fd, new_name, RENAME_NOREPLACE);
+  if (rc == -1 && errno == EINVAL) {
+    // Not every filesystem supports RENAME_NOREPLACE, in which case this has to
+    // settle for checking first, like GIO does.
+    struct stat st;
+    if (fstatat(new_dir_fd, new_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      errno = EEXIST;
+    } else if (errno == ENOENT) {
+      rc = renameat(old_dir_fd, old_name, new_dir_fd, new_name);
+    }
+  }
+
+  if (rc == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to rename %s to %s: %s", old_name, new_name, g_strerror(err));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+char *compute_file_checksum(const char *path, GError **error) {
+  g_autoptr(GMappedFile) mapped = g_mapped_file_new(path, FALSE, error);
+  if (mapped == NULL) {
+    g_prefix_error(error, "Hashing %s: ", path);
+    return NULL;
+  }
+
+  return g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+                                     (const guchar *)g_mapped_file_get_contents(mapped),
+                                     g_mapped_file_get_length(mapped));
+}
+
+// Checks whether path already holds exactly the given contents, so rewriting it
+// (and waking up everything watching it) can be skipped.
+gboolean file_has_contents(const char *path, const char *contents, gsize length) {
+  struct stat st;
+  if (stat(path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size != length) {
+    return FALSE;
+  }
+
+  if (length == 0) {
+    return TRUE;
+  }
+
+  g_autoptr(GMappedFile) mapped = g_mapped_file_new(path, FALSE, NULL);
+  return mapped != NULL && g_mapped_file_get_length(mapped) == length &&
+         memcmp(g_mapped_file_get_contents(mapped), contents, length) == 0;
+}
+
+// Reads the durability policy from $FLEXTOP_DURABILITY: "file" (the default),
+// "batch", or "none".
+Durability get_durability() {
+  const char *value = client_getenv("FLEXTOP_DURABILITY");
+  if (value == NULL || strcmp(value, "file") == 0) {
+    return DURABILITY_FILE;
+  } else if (strcmp(value, "batch") == 0) {
+    return DURABILITY_BATCH;
+  } else if (strcmp(value, "none") == 0) {
+    return DURABILITY_NONE;
+  }
+
+  g_warning("Unknown FLEXTOP_DURABILITY '%s', using 'file'", value);
+  return DURABILITY_FILE;
+}
+
+// Atomically replaces path with the given contents. Only DURABILITY_FILE syncs
+// the new contents before they replace the old ones, which is what
+// g_file_set_contents() does.
+gboolean write_file_with_durability(const char *path, const char *contents, gsize length,
+                                    Durability durability, GError **error) {
+  if (durability == DURABILITY_FILE) {
+    return g_file_set_contents(path, contents, length, error);
+  }
+
+  g_autofree char *temp_path = g_strdup_printf("%s.XXXXXX", path);
+  g_auto(AutoFd) fd = g_mkstemp_full(temp_path, O_WRONLY | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to create temporary file for %s: %s", path, g_strerror(err));
+    return FALSE;
+  }
+
+  while (length > 0) {
+    ssize_t written = write(fd, contents, length);
+    if (written == -1) {
+      int err = errno;
+      if (err == EINTR) {
+        continue;
+      }
+
+      unlink(temp_path);
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                  "Failed to write %s: %s", temp_path, g_strerror(err));
+      return FALSE;
+    }
+
+    contents += written;
+    length -= written;
+  }
+
+  if (rename(temp_path, path) == -1) {
+    int err = errno;
+    unlink(temp_path);
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to rename %s to %s: %s", temp_path, path, g_strerror(err));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Makes everything written to dir during a DURABILITY_BATCH batch durable. A
+// directory fsync wouldn't cover the files' contents, so this syncs the whole
+// filesystem at once instead.
+gboolean finish_batch_with_durability(GFile *dir, Durability durability, GError **error) {
+  if (durability != DURABILITY_BATCH) {
+    return TRUE;
+  }
+
+  g_auto(AutoFd) fd = open(g_file_peek_path(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1 || syncfs(fd) == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to sync %s: %s",
+                g_file_peek_path(dir), g_strerror(err));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 static const char *get_chrome_wrapper() {
-  const char *chrome_wrapper = g_getenv("CHROME_WRAPPER");
+  const char *chrome_wrapper = client_getenv("CHROME_WRAPPER");
   if (chrome_wrapper == NULL) {
     static gsize displayed_warning = FALSE;
     if (g_once_init_enter(&displayed_warning)) {
@@ -65,16 +396,126 @@ static const char *get_chrome_wrapper() {
   return chrome_wrapper;
 }
 
-gboolean delete_maybe_invalid_desktop_file(const char *path, GError **error) {
-  g_debug("Inspect desktop file '%s'", path);
+typedef enum {
+  EXEC_SCAN_REJECT,
+  EXEC_SCAN_MAYBE,
+} ExecScanResult;
 
-  const char *chrome_wrapper = get_chrome_wrapper();
-  if (chrome_wrapper == NULL) {
+// Looks for the [Desktop Entry] group's Exec= key in the raw file contents,
+// without building a GKeyFile, to tell whether argv[0] can possibly be the
+// wrapper. It only ever rejects: anything it isn't sure about (quoting, escapes,
+// duplicate groups or keys) is left to the GKeyFile path, as are the files that
+// do look like they point to the wrapper. The line and byte searches go through
+// memchr, which glibc vectorizes.
+static ExecScanResult scan_desktop_entry_exec(const char *data, gsize length,
+                                              const char *chrome_wrapper) {
+  const char *end = data + length;
+  const char *exec = NULL;
+  const char *exec_end = NULL;
+  gboolean in_desktop_entry = FALSE;
+  gboolean seen_desktop_entry = FALSE;
+  gsize desktop_group_length = strlen(G_KEY_FILE_DESKTOP_GROUP);
+
+  const char *line = data;
+  while (line < end) {
+    const char *line_end = memchr(line, '\n', end - line);
+    if (line_end == NULL) {
+      line_end = end;
+    }
+
+    const char *p = line;
+    while (p < line_end && g_ascii_isspace(*p)) {
+      p++;
+    }
+
+    if (p == line_end || *p == '#') {
+      // Blank line or comment.
+    } else if (*p == '[') {
+      // Like GKeyFile, take everything up to the last ']' as the group name.
+      const char *name_end = line_end;
+      while (name_end > p + 1 && name_end[-1] != ']') {
+        name_end--;
+      }
+
+      if (name_end == p + 1) {
+        return EXEC_SCAN_MAYBE;
+      }
+
+      gsize name_length = name_end - 1 - (p + 1);
+      in_desktop_entry = name_length == desktop_group_length &&
+                         memcmp(p + 1, G_KEY_FILE_DESKTOP_GROUP, name_length) == 0;
+      if (in_desktop_entry) {
+        if (seen_desktop_entry) {
+          return EXEC_SCAN_MAYBE;
+        }
+
+        seen_desktop_entry = TRUE;
+      }
+    } else if (in_desktop_entry && line_end - p > 4 && memcmp(p, "Exec", 4) == 0) {
+      const char *q = p + 4;
+      while (q < line_end && g_ascii_isspace(*q)) {
+        q++;
+      }
+
+      if (q < line_end && *q == '=') {
+        if (exec != NULL) {
+          return EXEC_SCAN_MAYBE;
+        }
+
+        exec = q + 1;
+        exec_end = line_end;
+        while (exec < exec_end && g_ascii_isspace(*exec)) {
+          exec++;
+        }
+      }
+    }
+
+    line = line_end + 1;
+  }
+
+  if (exec == NULL) {
+    return EXEC_SCAN_REJECT;
+  }
+
+  if (exec < exec_end && *exec == '#') {
+    return EXEC_SCAN_MAYBE;
+  }
+
+  // Without any quoting or escapes, argv[0] is just the first word.
+  const char *word_end = exec;
+  while (word_end < exec_end && !g_ascii_isspace(*word_end)) {
+    if (*word_end == '\'' || *word_end == '"' || *word_end == '\\' || *word_end == '\0') {
+      return EXEC_SCAN_MAYBE;
+    }
+
+    word_end++;
+  }
+
+  gsize wrapper_length = strlen(chrome_wrapper);
+  if (word_end - exec == wrapper_length &&
+      memcmp(exec, chrome_wrapper, wrapper_length) == 0) {
+    return EXEC_SCAN_MAYBE;
+  }
+
+  return EXEC_SCAN_REJECT;
+}
+
+// Sets out_is_wrapper to whether the desktop file's Exec= runs chrome_wrapper.
+// Unless allow_scan is FALSE, most files that don't are rejected by
+// scan_desktop_entry_exec() first, which also means some files that GKeyFile
+// couldn't load count as not running it instead of failing.
+gboolean desktop_file_exec_is_wrapper(const char *data, gsize length,
+                                      const char *chrome_wrapper, gboolean allow_scan,
+                                      gboolean *out_is_wrapper, GError **error) {
+  *out_is_wrapper = FALSE;
+
+  if (allow_scan &&
+      scan_desktop_entry_exec(data, length, chrome_wrapper) == EXEC_SCAN_REJECT) {
     return TRUE;
   }
 
   g_autoptr(GKeyFile) key_file = g_key_file_new();
-  if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, error)) {
+  if (!g_key_file_load_from_data(key_file, data, length, G_KEY_FILE_NONE, error)) {
     return FALSE;
   }
 
@@ -86,11 +527,36 @@ gboolean delete_maybe_invalid_desktop_file(const char *path, GError **error) {
 
   g_auto(GStrv) argv = NULL;
   if (!g_shell_parse_argv(exec, NULL, &argv, error)) {
-    g_prefix_error(error, "Checking Exec= in '%s': ", path);
+    g_prefix_error(error, "Parsing Exec=: ");
+    return FALSE;
+  }
+
+  *out_is_wrapper = argv != NULL && g_strcmp0(argv[0], chrome_wrapper) == 0;
+  return TRUE;
+}
+
+gboolean delete_maybe_invalid_desktop_file(const char *path, GError **error) {
+  g_debug("Inspect desktop file '%s'", path);
+
+  const char *chrome_wrapper = get_chrome_wrapper();
+  if (chrome_wrapper == NULL) {
+    return TRUE;
+  }
+
+  g_autoptr(GMappedFile) mapped = g_mapped_file_new(path, FALSE, error);
+  if (mapped == NULL) {
+    return FALSE;
+  }
+
+  gboolean is_wrapper;
+  if (!desktop_file_exec_is_wrapper(g_mapped_file_get_contents(mapped),
+                                    g_mapped_file_get_length(mapped), chrome_wrapper,
+                                    TRUE, &is_wrapper, error)) {
+    g_prefix_error(error, "Checking '%s': ", path);
     return FALSE;
   }
 
-  if (argv != NULL && g_strcmp0(argv[0], chrome_wrapper) == 0) {
+  if (is_wrapper) {
     g_debug("Removing invalid desktop file: %s", path);
     if (unlink(path) == -1) {
       g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
@@ -104,9 +570,10 @@ gboolean delete_maybe_invalid_desktop_file(const char *path, GError **error) {
 
 FlatpakInfo *flatpak_info_new() { return g_new0(FlatpakInfo, 1); }
 
-gboolean flatpak_info_load(FlatpakInfo *info, GError **error) {
+static gboolean flatpak_info_parse(FlatpakInfo *info, GError **error) {
   g_autoptr(GKeyFile) key_file = g_key_file_new();
-  if (!g_key_file_load_from_file(key_file, "/.flatpak-info", G_KEY_FILE_NONE, error)) {
+  if (!g_key_file_load_from_file(key_file, get_flatpak_info_path(), G_KEY_FILE_NONE,
+                                 error)) {
     return FALSE;
   }
 
@@ -138,14 +605,209 @@ gboolean flatpak_info_load(FlatpakInfo *info, GError **error) {
   return TRUE;
 }
 
+char *drop_expected_path_suffixes(const char *path, ...) {
+  g_autoptr(GSList) suffixes = NULL;
+
+  // The suffixes need to be removed starting with the last one, so load them
+  // up into an SList first, that way they'll end up reversed when we start
+  // iterating over them.
+
+  va_list va;
+  va_start(va, path);
+
+  for (;;) {
+    const char *suffix = va_arg(va, const char *);
+    if (suffix == NULL) {
+      break;
+    }
+
+    suffixes = g_slist_prepend(suffixes, (gpointer)suffix);
+  }
+
+  va_end(va);
+
+  g_autofree char *result = g_strdup(path);
+  gsize result_len = strlen(result);
+
+  for (GSList *node = suffixes; node != NULL; node = node->next) {
+    const char *suffix = node->data;
+    gsize suffix_len = strlen(suffix);
+
+    if (suffix_len + 1 >= result_len) {
+      return NULL;
+    }
+
+    char *to_strip = &result[result_len - suffix_len - 1];
+    if (*to_strip != '/' || strcmp(to_strip + 1, suffix) != 0) {
+      return NULL;
+    }
+
+    *to_strip = '\0';
+    result_len -= suffix_len + 1;
+  }
+
+  return g_steal_pointer(&result);
+}
+
+static void flatpak_info_derive(FlatpakInfo *info) {
+  info->installation_root =
+      drop_expected_path_suffixes(info->app_path, "app", info->app, info->arch,
+                                  info->branch, info->app_commit, "files", NULL);
+  if (info->installation_root != NULL) {
+    info->wrapper_exe =
+        g_build_filename(info->installation_root, "exports", "bin", info->app, NULL);
+  }
+
+  info->desktop_file_prefix = g_strdup_printf("%s.flextop.", info->app);
+  info->exec_app_arg = g_shell_quote(info->app);
+}
+
+// The snapshot is keyed by the identity of the Flatpak info file rather than
+// its contents. Flatpak writes a new file for every instance it starts, so an
+// update that changes the app-commit always changes the key too.
+typedef struct FlatpakInfoSnapshotHeader {
+  char magic[8];
+  guint64 device;
+  guint64 inode;
+  gint64 mtime_sec;
+  gint64 mtime_nsec;
+  guint64 size;
+} FlatpakInfoSnapshotHeader;
+
+#define FLATPAK_INFO_SNAPSHOT_MAGIC "FLXINFO1"
+#define FLATPAK_INFO_SNAPSHOT_N_FIELDS 9
+
+// The fields that can be empty in a valid snapshot, stored as empty strings.
+#define FLATPAK_INFO_SNAPSHOT_OPTIONAL_FIELDS(i) ((i) == 5 || (i) == 6)
+
+static void get_snapshot_fields(FlatpakInfo *info,
+                                char **fields[FLATPAK_INFO_SNAPSHOT_N_FIELDS]) {
+  fields[0] = &info->app;
+  fields[1] = &info->branch;
+  fields[2] = &info->arch;
+  fields[3] = &info->app_commit;
+  fields[4] = &info->app_path;
+  fields[5] = &info->installation_root;
+  fields[6] = &info->wrapper_exe;
+  fields[7] = &info->desktop_file_prefix;
+  fields[8] = &info->exec_app_arg;
+}
+
+static void init_snapshot_header(FlatpakInfoSnapshotHeader *header, struct stat *st) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, FLATPAK_INFO_SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->device = st->st_dev;
+  header->inode = st->st_ino;
+  header->mtime_sec = st->st_mtim.tv_sec;
+  header->mtime_nsec = st->st_mtim.tv_nsec;
+  header->size = st->st_size;
+}
+
+static char *get_snapshot_path() {
+  return g_build_filename(g_get_user_runtime_dir(), ".flextop-flatpak-info", NULL);
+}
+
+static gboolean flatpak_info_load_snapshot(FlatpakInfo *info, const char *path,
+                                           const FlatpakInfoSnapshotHeader *expected) {
+  g_autoptr(GMappedFile) mapped = g_mapped_file_new(path, FALSE, NULL);
+  if (mapped == NULL) {
+    return FALSE;
+  }
+
+  const char *data = g_mapped_file_get_contents(mapped);
+  gsize length = g_mapped_file_get_length(mapped);
+  if (length < sizeof(*expected) || memcmp(data, expected, sizeof(*expected)) != 0) {
+    g_debug("Flatpak info snapshot is out of date");
+    return FALSE;
+  }
+
+  const char *values[FLATPAK_INFO_SNAPSHOT_N_FIELDS];
+  const char *current = data + sizeof(*expected);
+  const char *end = data + length;
+  for (int i = 0; i < FLATPAK_INFO_SNAPSHOT_N_FIELDS; i++) {
+    const char *terminator = memchr(current, '\0', end - current);
+    if (terminator == NULL ||
+        (terminator == current && !FLATPAK_INFO_SNAPSHOT_OPTIONAL_FIELDS(i))) {
+      g_debug("Flatpak info snapshot is corrupt");
+      return FALSE;
+    }
+
+    values[i] = current;
+    current = terminator + 1;
+  }
+
+  char **fields[FLATPAK_INFO_SNAPSHOT_N_FIELDS];
+  get_snapshot_fields(info, fields);
+  for (int i = 0; i < FLATPAK_INFO_SNAPSHOT_N_FIELDS; i++) {
+    *fields[i] = *values[i] != '\0' ? g_strdup(values[i]) : NULL;
+  }
+
+  return TRUE;
+}
+
+static void flatpak_info_save_snapshot(FlatpakInfo *info, const char *path,
+                                       const FlatpakInfoSnapshotHeader *header) {
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GString) data = g_string_new(NULL);
+  g_string_append_len(data, (const char *)header, sizeof(*header));
+
+  char **fields[FLATPAK_INFO_SNAPSHOT_N_FIELDS];
+  get_snapshot_fields(info, fields);
+  for (int i = 0; i < FLATPAK_INFO_SNAPSHOT_N_FIELDS; i++) {
+    if (*fields[i] != NULL) {
+      g_string_append(data, *fields[i]);
+    }
+
+    g_string_append_c(data, '\0');
+  }
+
+  if (!g_file_set_contents(path, data->str, data->len, &error)) {
+    g_debug("Failed to save Flatpak info snapshot: %s", error->message);
+  }
+}
+
+gboolean flatpak_info_load(FlatpakInfo *info, GError **error) {
+  const char *path = get_flatpak_info_path();
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "Failed to stat %s: %s",
+                path, g_strerror(err));
+    return FALSE;
+  }
+
+  FlatpakInfoSnapshotHeader header;
+  init_snapshot_header(&header, &st);
+
+  g_autofree char *snapshot_path = get_snapshot_path();
+  if (flatpak_info_load_snapshot(info, snapshot_path, &header)) {
+    return TRUE;
+  }
+
+  if (!flatpak_info_parse(info, error)) {
+    return FALSE;
+  }
+
+  flatpak_info_derive(info);
+  flatpak_info_save_snapshot(info, snapshot_path, &header);
+  return TRUE;
+}
+
 char *flatpak_info_add_desktop_file_prefix(FlatpakInfo *info, const char *unprefixed) {
-  return g_strdup_printf("%s.flextop.%s", info->app, unprefixed);
+  return g_strconcat(info->desktop_file_prefix, unprefixed, NULL);
 }
 
 void flatpak_info_free(FlatpakInfo *info) {
   g_clear_pointer(&info->app, g_free);
   g_clear_pointer(&info->branch, g_free);
   g_clear_pointer(&info->arch, g_free);
+  g_clear_pointer(&info->app_commit, g_free);
+  g_clear_pointer(&info->app_path, g_free);
+  g_clear_pointer(&info->installation_root, g_free);
+  g_clear_pointer(&info->wrapper_exe, g_free);
+  g_clear_pointer(&info->desktop_file_prefix, g_free);
+  g_clear_pointer(&info->exec_app_arg, g_free);
+  g_free(info);
 }
 
 DataDir *data_dir_new_for_root(GFile *root) {
@@ -153,11 +815,22 @@ DataDir *data_dir_new_for_root(GFile *root) {
   result->root = g_object_ref(root);
   result->applications = g_file_get_child(root, "applications");
   result->icons = g_file_get_child(root, "icons");
+  for (int i = 0; i < DATA_DIR_N; i++) {
+    result->fds[i] = -1;
+  }
 
   return result;
 }
 
 DataDir *data_dir_new_host(FlatpakInfo *info) {
+#ifdef FLEXTOP_TEST_HOOKS
+  const char *override = g_getenv("FLEXTOP_TEST_HOST_DATA_DIR");
+  if (override != NULL) {
+    g_autoptr(GFile) override_file = g_file_new_for_path(override);
+    return data_dir_new_for_root(override_file);
+  }
+#endif
+
   const char *home = g_get_home_dir();
   g_autofree char *share = g_build_filename(home, ".local", "share", NULL);
   g_autoptr(GFile) share_file = g_file_new_for_path(share);
@@ -228,20 +901,27 @@ static void get_lowest_existing_parent_info(GFile *file, guint32 *out_device,
   }
 }
 
-gboolean data_dir_test_access(DataDir *dir) {
+static gboolean data_dir_test_access_uncached(DataDir *dir) {
   g_autoptr(GFile) root_file = g_file_new_for_path("/");
   guint32 root_device = 0;
   g_warn_if_fail(query_path_info(root_file, &root_device, NULL, NULL));
 
   g_debug("root_device = %" G_GUINT32_FORMAT, root_device);
 
+  gboolean check_device = TRUE;
+#ifdef FLEXTOP_TEST_HOOKS
+  // A synthetic host data dir is usually on the same filesystem as /, so only
+  // whether it's writable can be checked.
+  check_device = g_getenv("FLEXTOP_TEST_HOST_DATA_DIR") == NULL;
+#endif
+
   GFile *files_to_check[] = {dir->applications, dir->icons};
   for (gsize i = 0; i < G_N_ELEMENTS(files_to_check); i++) {
     guint32 device;
     gboolean writable;
     get_lowest_existing_parent_info(files_to_check[i], &device, &writable);
 
-    if (root_device == device || !writable) {
+    if ((check_device && root_device == device) || !writable) {
       g_debug("device = %" G_GUINT32_FORMAT ", writable = %d", device, writable);
       return FALSE;
     }
@@ -250,7 +930,151 @@ gboolean data_dir_test_access(DataDir *dir) {
   return TRUE;
 }
 
+// Adds the identity of the directory the uncached check ends up looking at for the
+// file, i.e. its lowest existing parent, along with which of the components below
+// that are missing.
+static void add_access_identity(GChecksum *checksum, GFile *file) {
+  g_autofree char *path = g_strdup(g_file_peek_path(file));
+  for (;;) {
+    struct stat st;
+    g_autofree char *identity = NULL;
+    if (stat(path, &st) == 0) {
+      identity = g_strdup_printf("%s:%lu:%lu:%o:%u:%u", path, (gulong)st.st_dev,
+                                 (gulong)st.st_ino, st.st_mode, st.st_uid, st.st_gid);
+      g_checksum_update(checksum, (const guchar *)identity, strlen(identity) + 1);
+      return;
+    }
+
+    identity = g_strdup_printf("%s:missing:%d", path, errno);
+    g_checksum_update(checksum, (const guchar *)identity, strlen(identity) + 1);
+
+    char *slash = strrchr(path, '/');
+    if (slash == NULL || strcmp(path, "/") == 0) {
+      return;
+    }
+
+    // Keep the / itself when reaching the top.
+    slash[slash == path] = '\0';
+  }
+}
+
+// The access check can only change if the mounts covering the data dir change,
+// which in practice means a new sandbox instance and thus a new mount namespace, or
+// if the directories it looks at are replaced or have their ownership or mode
+// changed. The key covers both, but leaves out the timestamps, which change
+// whenever anything gets installed.
+static char *data_dir_get_access_cache_key(DataDir *dir) {
+  char ns[64];
+  ssize_t ns_len = readlink("/proc/self/ns/mnt", ns, sizeof(ns) - 1);
+  if (ns_len == -1) {
+    return NULL;
+  }
+
+  ns[ns_len] = '\0';
+
+  g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  GFile *files_to_check[] = {dir->applications, dir->icons};
+  for (gsize i = 0; i < G_N_ELEMENTS(files_to_check); i++) {
+    add_access_identity(checksum, files_to_check[i]);
+  }
+
+  return g_strdup_printf("%s %s", ns, g_checksum_get_string(checksum));
+}
+
+gboolean data_dir_test_access(DataDir *dir) {
+  g_autoptr(GError) error = NULL;
+  g_autofree char *cache_path =
+      g_build_filename(g_get_user_runtime_dir(), ".flextop-access-cache", NULL);
+
+  // The cache is stored as the key on one line, followed by 0 or 1.
+  g_autofree char *key = data_dir_get_access_cache_key(dir);
+  if (key != NULL) {
+    g_autofree char *cached = NULL;
+    gsize key_len = strlen(key);
+    if (g_file_get_contents(cache_path, &cached, NULL, NULL) &&
+        g_str_has_prefix(cached, key) && cached[key_len] == '\n' &&
+        (cached[key_len + 1] == '0' || cached[key_len + 1] == '1')) {
+      g_debug("Using cached host access result");
+      return cached[key_len + 1] == '1';
+    }
+  }
+
+  gboolean has_access = data_dir_test_access_uncached(dir);
+
+  if (key != NULL) {
+    g_autofree char *contents = g_strdup_printf("%s\n%d\n", key, has_access);
+    if (!g_file_set_contents(cache_path, contents, -1, &error)) {
+      g_debug("Failed to save host access result: %s", error->message);
+    }
+  }
+
+  return has_access;
+}
+
+// How each location is opened: by name relative to its parent, except for the root,
+// which has no parent and is opened by path.
+static const struct {
+  DataDirLocation parent;
+  const char *name;
+} data_dir_locations[DATA_DIR_N] = {
+    [DATA_DIR_ROOT] = {DATA_DIR_N, NULL},
+    [DATA_DIR_APPLICATIONS] = {DATA_DIR_ROOT, "applications"},
+    [DATA_DIR_ICONS] = {DATA_DIR_ROOT, "icons"},
+    [DATA_DIR_HICOLOR] = {DATA_DIR_ICONS, "hicolor"},
+};
+
+// Returns an O_PATH fd for the location that the *at() functions can resolve names
+// relative to, so the full path doesn't have to be walked again on every call. The
+// fd is owned by dir. Locations that don't exist yet aren't cached, so this can be
+// called again once they've been created.
+int data_dir_get_fd(DataDir *dir, DataDirLocation location, GError **error) {
+  g_return_val_if_fail(location < DATA_DIR_N, -1);
+
+  if (dir->fds[location] != -1) {
+    return dir->fds[location];
+  }
+
+  DataDirLocation parent = data_dir_locations[location].parent;
+  const char *name = data_dir_locations[location].name;
+
+  int fd = -1;
+  if (parent == DATA_DIR_N) {
+    fd = open(g_file_peek_path(dir->root), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  } else {
+    int parent_fd = data_dir_get_fd(dir, parent, error);
+    if (parent_fd == -1) {
+      return -1;
+    }
+
+    fd = openat(parent_fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  }
+
+  if (fd == -1) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+                "Failed to open %s in %s: %s", name != NULL ? name : "root",
+                g_file_peek_path(dir->root), g_strerror(err));
+    return -1;
+  }
+
+  dir->fds[location] = fd;
+  return fd;
+}
+
+// Drops the cached fd, e.g. after the location was replaced, so that the next
+// data_dir_get_fd() call opens whatever is there now.
+void data_dir_close_fd(DataDir *dir, DataDirLocation location) {
+  if (dir->fds[location] != -1) {
+    close(dir->fds[location]);
+    dir->fds[location] = -1;
+  }
+}
+
 void data_dir_free(DataDir *dir) {
+  for (int i = 0; i < DATA_DIR_N; i++) {
+    data_dir_close_fd(dir, i);
+  }
+
   g_object_unref(dir->root);
   g_object_unref(dir->applications);
   g_object_unref(dir->icons);
@@ -17,15 +17,67 @@
 
 #include <gio/gio.h>
 #include <glib.h>
+#include <unistd.h>
 
 #define DESKTOP_KEY_X_FLATPAK_PART_OF "X-Flatpak-Part-Of"
 
+#define FLATPAK_INFO_PATH "/.flatpak-info"
+
+typedef int AutoFd;
+G_DEFINE_AUTO_CLEANUP_FREE_FUNC(AutoFd, close, -1)
+
+const char *get_flatpak_info_path();
 gboolean ensure_running_inside_flatpak();
 
+// The service runs requests on behalf of clients whose environment can differ from
+// the one it was started with, so anything that depends on the environment reads
+// it through these. Outside of a request, they return our own values.
+#define CLIENT_ENV_DESKTOP_DIR "XDG_DESKTOP_DIR"
+
+void client_env_set(GHashTable *env);
+const char *client_getenv(const char *name);
+const char *client_get_desktop_dir();
+
 gboolean mkdir_with_parents_exists_ok(GFile *dir, GError **error);
 
 GFile *get_flextop_data_dir(GError **error);
 
+typedef enum {
+  COPY_STRATEGY_REFLINK,
+  COPY_STRATEGY_COPY_FILE_RANGE,
+  COPY_STRATEGY_HARDLINK,
+  COPY_STRATEGY_FALLBACK,
+  COPY_STRATEGY_N,
+} CopyStrategy;
+
+const char *copy_strategy_to_string(CopyStrategy strategy);
+gboolean copy_file_fast(const char *source, const char *dest, gboolean allow_hardlink,
+                        CopyStrategy *out_strategy, GError **error);
+gboolean replace_with_hardlink(const char *target, const char *dest, GError **error);
+gboolean rename_at_noreplace(int old_dir_fd, const char *old_name, int new_dir_fd,
+                             const char *new_name, GError **error);
+
+char *compute_file_checksum(const char *path, GError **error);
+gboolean file_has_contents(const char *path, const char *contents, gsize length);
+
+typedef enum {
+  // Every file is synced before it's renamed into place.
+  DURABILITY_FILE,
+  // Files are only renamed into place, then the filesystem is synced once at the
+  // end of the batch.
+  DURABILITY_BATCH,
+  // Nothing is synced, leaving it up to the kernel's writeback.
+  DURABILITY_NONE,
+} Durability;
+
+Durability get_durability();
+gboolean write_file_with_durability(const char *path, const char *contents, gsize length,
+                                    Durability durability, GError **error);
+gboolean finish_batch_with_durability(GFile *dir, Durability durability, GError **error);
+
+gboolean desktop_file_exec_is_wrapper(const char *data, gsize length,
+                                      const char *chrome_wrapper, gboolean allow_scan,
+                                      gboolean *out_is_wrapper, GError **error);
 gboolean delete_maybe_invalid_desktop_file(const char *path, GError **error);
 
 typedef struct FlatpakInfo {
@@ -34,19 +86,38 @@ typedef struct FlatpakInfo {
   char *arch;
   char *app_commit;
   char *app_path;
+
+  // Derived from the fields above. installation_root and wrapper_exe are NULL
+  // if the installation root could not be determined from app_path.
+  char *installation_root;
+  char *wrapper_exe;
+  char *desktop_file_prefix;
+  char *exec_app_arg;
 } FlatpakInfo;
 
 FlatpakInfo *flatpak_info_new();
 gboolean flatpak_info_load(FlatpakInfo *info, GError **error);
 char *flatpak_info_add_desktop_file_prefix(FlatpakInfo *info, const char *unprefixed);
+char *drop_expected_path_suffixes(const char *path, ...) G_GNUC_NULL_TERMINATED;
 void flatpak_info_free(FlatpakInfo *info);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(FlatpakInfo, flatpak_info_free)
 
+typedef enum {
+  DATA_DIR_ROOT,
+  DATA_DIR_APPLICATIONS,
+  DATA_DIR_ICONS,
+  DATA_DIR_HICOLOR,
+  DATA_DIR_N,
+} DataDirLocation;
+
 typedef struct DataDir {
   GFile *root;
   GFile *applications;
   GFile *icons;
+
+  // O_PATH fds for each location, opened on first use. -1 if not open yet.
+  int fds[DATA_DIR_N];
 } DataDir;
 
 DataDir *data_dir_new_for_root(GFile *root);
@@ -55,6 +126,9 @@ DataDir *data_dir_new_private();
 
 gboolean data_dir_test_access(DataDir *dir);
 
+int data_dir_get_fd(DataDir *dir, DataDirLocation location, GError **error);
+void data_dir_close_fd(DataDir *dir, DataDirLocation location);
+
 void data_dir_free(DataDir *dir);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(DataDir, data_dir_free)
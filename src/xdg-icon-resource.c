@@ -13,54 +13,44 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <https://www.gnu.org/licenses/>. */
 
+#include "flextop-icon-resource.h"
+#include "flextop-service-ipc.h"
+#include "flextop-trace.h"
 #include "flextop-utils.h"
 
-gboolean install(FlatpakInfo *info, DataDir *host, const char *icon_file,
-                 const char *icon_name, int size, GError **error) {
-  g_autofree char *size_dir = g_strdup_printf("%dx%d", size, size);
-  g_autofree char *dest_dir =
-      g_build_filename(g_file_peek_path(host->icons), "hicolor", size_dir, "apps", NULL);
-  g_autoptr(GFile) dest_dir_file = g_file_new_for_path(dest_dir);
-  if (!mkdir_with_parents_exists_ok(dest_dir_file, error)) {
-    return FALSE;
-  }
-
-  g_autoptr(GFile) source_file = g_file_new_for_path(icon_file);
-  g_autofree char *dest_filename = g_strdup_printf("%s.png", icon_name);
-  g_autoptr(GFile) dest_file = g_file_get_child(dest_dir_file, dest_filename);
-  if (!g_file_copy(source_file, dest_file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL,
-                   error)) {
-    return FALSE;
-  }
-
-  return TRUE;
-}
-
 int main(int argc, char **argv) {
   g_set_prgname("xdg-icon-resource");
+  trace_init("xdg-icon-resource");
 
   g_autoptr(GError) error = NULL;
 
-  if (argc != 8) {
-    g_warning("usage: xdg-icon-resource install --mode user --size X file name");
+  g_autoptr(GPtrArray) requests =
+      g_ptr_array_new_with_free_func((GDestroyNotify)icon_request_free);
+  IconResourceCommand command;
+  gboolean read_stdin, noupdate;
+  if (!icon_resource_parse_args(argc, argv, &command, requests, &read_stdin, &noupdate)) {
     return 1;
   }
 
-  char *size_str = argv[5];
-  char *icon_file = argv[6];
-  char *icon_name = argv[7];
-
-  char *size_end;
-  int size = g_strtod(size_str, &size_end);
-  if (*size_end != '\0') {
-    g_warning("Invalid size: %s", size_str);
+  if (!ensure_running_inside_flatpak()) {
     return 1;
   }
 
-  if (!ensure_running_inside_flatpak()) {
+  if (read_stdin && !icon_resource_read_requests_from_stdin(requests, &error)) {
+    g_warning("Failed to read icons to install: %s", error->message);
     return 1;
   }
 
+  // Installing icons again is harmless, so anything short of the service finishing
+  // the request is simply redone here.
+  int status;
+  g_auto(GStrv) service_argv =
+      icon_resource_build_service_argv(command, requests, noupdate);
+  if (service_forward("xdg-icon-resource", service_argv, &status) ==
+      SERVICE_FORWARD_DONE) {
+    return status;
+  }
+
   g_autoptr(FlatpakInfo) info = flatpak_info_new();
   if (!flatpak_info_load(info, &error)) {
     g_warning("Failed to load flatpak info: %s", error->message);
@@ -75,10 +65,5 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if (!install(info, host, icon_file, icon_name, size, &error)) {
-    g_warning("Failed to install icon file: %s", error->message);
-    return 1;
-  }
-
-  return 0;
+  return icon_resource_run(command, requests, noupdate, info, host);
 }
@@ -0,0 +1,140 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Counts the allocations a process makes, for check-allocations.py. Loaded with
+// LD_PRELOAD, it wraps malloc and friends around glibc's own __libc_* entry points,
+// and when the process exits, appends a line with its pid and counts to the file
+// named by $FLEXTOP_ALLOC_COUNTER_OUTPUT. Anything allocated and never freed by
+// then shows up as live. Micro-benchmarks link it in directly instead, and read
+// the counts with alloc_counter_get_allocations().
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+// Updated from every thread, but only read at exit.
+static unsigned long allocations;
+static unsigned long frees;
+static unsigned long reallocations;
+
+static void count(unsigned long *counter) {
+  __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+  void *ptr = __libc_malloc(size);
+  if (ptr != NULL) {
+    count(&allocations);
+  }
+
+  return ptr;
+}
+
+void *calloc(size_t n, size_t size) {
+  void *ptr = __libc_calloc(n, size);
+  if (ptr != NULL) {
+    count(&allocations);
+  }
+
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return malloc(size);
+  } else if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  void *result = __libc_realloc(ptr, size);
+  if (result != NULL) {
+    count(&reallocations);
+  }
+
+  return result;
+}
+
+void free(void *ptr) {
+  if (ptr != NULL) {
+    count(&frees);
+    __libc_free(ptr);
+  }
+}
+
+void *memalign(size_t alignment, size_t size) {
+  void *ptr = __libc_memalign(alignment, size);
+  if (ptr != NULL) {
+    count(&allocations);
+  }
+
+  return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) { return memalign(alignment, size); }
+
+int posix_memalign(void **out_ptr, size_t alignment, size_t size) {
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+
+  void *ptr = memalign(alignment, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+
+  *out_ptr = ptr;
+  return 0;
+}
+
+// Includes reallocations, since those may have to allocate too.
+unsigned long alloc_counter_get_allocations() {
+  return __atomic_load_n(&allocations, __ATOMIC_RELAXED) +
+         __atomic_load_n(&reallocations, __ATOMIC_RELAXED);
+}
+
+// Runs after the process's own destructors, since the preloaded library was
+// loaded first.
+__attribute__((destructor)) static void write_counts() {
+  const char *output = getenv("FLEXTOP_ALLOC_COUNTER_OUTPUT");
+  if (output == NULL) {
+    return;
+  }
+
+  int fd = open(output, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return;
+  }
+
+  // A single write per process, so lines from concurrent processes don't mix.
+  char line[128];
+  unsigned long live = allocations - frees;
+  int length = snprintf(line, sizeof(line), "%ld %lu %lu %lu %lu\n", (long)getpid(),
+                        allocations, frees, reallocations, live);
+  if (write(fd, line, length) != length) {
+    // Nothing to report it to.
+  }
+
+  close(fd);
+}
@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+# Copyright (c) 2020 Endless OS Foundation LLC.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+# Runs the end-to-end benchmark scenarios (see benchmarks/run-benchmarks.py) with
+# every allocation counted by alloc-counter.c, at two scales, and checks how much
+# each tool allocates and leaks per PWA against allocation-budgets.json. Anything
+# that's allocated once per process cancels out between the scales, so a leak per
+# PWA means memory that grows with the number of files handled. Needs a build with
+# -Dtest_hooks=true.
+
+import argparse
+import importlib.util
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+DEFAULT_SCALES = [10, 50]
+# How far over its budget a scenario may allocate before it fails, since small
+# changes to GLib or libc shift the counts a little.
+ALLOCATION_TOLERANCE = 0.1
+
+
+def load_module(name, filename):
+    path = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+                        'benchmarks', filename)
+    spec = importlib.util.spec_from_file_location(name, path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+class ToolError(Exception):
+    pass
+
+
+class Counts:
+    def __init__(self, allocations, frees, reallocations, live):
+        self.allocations = allocations
+        self.frees = frees
+        self.reallocations = reallocations
+        self.live = live
+
+
+def run(bindir, env, argv, stdin, counts_path):
+    """Runs a tool to completion, returning its own counts, not those of anything
+    it spawned."""
+    if os.path.exists(counts_path):
+        os.unlink(counts_path)
+
+    argv = [os.path.join(bindir, argv[0])] + argv[1:]
+    proc = subprocess.Popen(argv, env=env, stdin=subprocess.PIPE,
+                            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    _, stderr = proc.communicate(stdin)
+    if proc.returncode != 0:
+        raise ToolError(f'{" ".join(argv[:3])}... exited with {proc.returncode}:\n'
+                        f'{stderr.decode(errors="replace")}')
+
+    with open(counts_path) as f:
+        for line in f:
+            pid, *values = [int(value) for value in line.split()]
+            if pid == proc.pid:
+                return Counts(*values)
+
+    raise ToolError(f'{argv[0]} did not report its allocations')
+
+
+def measure(benchmarks, generator, bindir, counter, workdir, scale):
+    inputs_dir = os.path.join(workdir, f'inputs-{scale}')
+    home_dir = os.path.join(workdir, f'home-{scale}')
+    counts_path = os.path.join(workdir, 'counts')
+    apps = generator.generate_inputs(inputs_dir, scale, generator.DEFAULT_ICON_SIZES)
+
+    env = dict(os.environ)
+    env.update(generator.generate_home(home_dir, apps, scale))
+    env['PATH'] = bindir + os.pathsep + env.get('PATH', '')
+    env['LD_PRELOAD'] = counter
+    env['FLEXTOP_ALLOC_COUNTER_OUTPUT'] = counts_path
+    # GLib's slice allocator would hide allocations inside its own blocks.
+    env['G_SLICE'] = 'always-malloc'
+    for name in ['G_MESSAGES_DEBUG', 'FLEXTOP_SERVICE', 'FLEXTOP_TRACE']:
+        env.pop(name, None)
+
+    results = {}
+    for name, argv, stdin in benchmarks.get_scenarios(apps):
+        results[name] = run(bindir, env, argv, stdin, counts_path)
+
+    shutil.rmtree(inputs_dir, ignore_errors=True)
+    shutil.rmtree(home_dir, ignore_errors=True)
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Check allocations against budgets.')
+    parser.add_argument('--bindir', required=True,
+                        help='build directory containing the tools')
+    parser.add_argument('--counter', required=True,
+                        help='the alloc-counter module to preload')
+    parser.add_argument('--budgets', required=True, help='the budgets JSON file')
+    parser.add_argument('--update-budgets', action='store_true',
+                        help='record the measured allocations as the new budgets')
+    args = parser.parse_args()
+
+    with open(args.budgets) as f:
+        budgets = json.load(f)
+    scales = budgets.get('scales', DEFAULT_SCALES)
+
+    benchmarks = load_module('run_benchmarks', 'run-benchmarks.py')
+    generator = benchmarks.load_generator()
+    bindir = os.path.abspath(args.bindir)
+    counter = os.path.abspath(args.counter)
+
+    with tempfile.TemporaryDirectory(prefix='flextop-allocations-') as workdir:
+        try:
+            small, large = [measure(benchmarks, generator, bindir, counter, workdir,
+                                    scale) for scale in scales]
+        except ToolError as e:
+            sys.exit(str(e))
+
+    apps = scales[1] - scales[0]
+    failures = []
+    print(f'{"scenario":<26} {"allocs/app":>11} {"budget":>9} {"leaks/app":>10} '
+          f'{"budget":>7}')
+    for name, counts in large.items():
+        budget = budgets['scenarios'].setdefault(name, {})
+        allocations = (counts.allocations - small[name].allocations) / apps
+        leaks = (counts.live - small[name].live) / apps
+        allocation_budget = budget.get('allocations_per_app')
+        leak_budget = budget.setdefault('leaks_per_app', 0)
+
+        print(f'{name:<26} {allocations:>11.1f} '
+              f'{allocation_budget if allocation_budget is not None else "-":>9} '
+              f'{leaks:>10.2f} {leak_budget:>7}')
+
+        if args.update_budgets:
+            budget['allocations_per_app'] = round(allocations, 1)
+        elif allocation_budget is None:
+            print(f'{name}: no allocation budget recorded yet, run with '
+                  '--update-budgets to record one', file=sys.stderr)
+        elif allocations > allocation_budget * (1 + ALLOCATION_TOLERANCE):
+            failures.append(f'{name}: {allocations:.1f} allocations per PWA, over the '
+                            f'budget of {allocation_budget}')
+
+        # Leaks are never recorded automatically, only allowed by hand.
+        if leaks > leak_budget:
+            failures.append(f'{name}: leaks {leaks:.2f} allocations per PWA, over the '
+                            f'budget of {leak_budget}')
+
+    if args.update_budgets:
+        with open(args.budgets, 'w') as f:
+            json.dump(budgets, f, indent=2)
+            f.write('\n')
+
+    if failures:
+        sys.exit('\n'.join(failures))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+# Copyright (c) 2020 Endless OS Foundation LLC.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+# Checks that xdg-icon-resource stores icons with the fastest copy the filesystems
+# involved support: a reflink where extents can be shared, copy_file_range where
+# they can't, and a regular copy when the icons come from another filesystem. Each
+# pair of source and home directories is probed with the same syscalls first, and
+# the strategies flextop picked are read back from the counters in its trace.
+# Strategies that none of the directories support are reported as skipped, so pass
+# --dir a btrfs or XFS mount to cover reflinks. Needs a build with
+# -Dtest_hooks=true.
+
+import argparse
+import fcntl
+import importlib.util
+import itertools
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+APPS = 4
+ICON_SIZES = [16, 48, 128]
+# _IOW(0x94, 9, int) from linux/fs.h.
+FICLONE = 0x40049409
+STRATEGIES = ['reflink', 'copy_file_range', 'copy']
+
+
+def load_module(name, filename):
+    path = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+                        'benchmarks', filename)
+    spec = importlib.util.spec_from_file_location(name, path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+class ToolError(Exception):
+    pass
+
+
+def probe(source_dir, dest_dir):
+    """Returns the strategy copy_file_fast() should pick to store a file from
+    source_dir in dest_dir, trying the same things in the same order. Chromium's
+    icons are never hardlinked into the store."""
+    source = os.path.join(source_dir, '.flextop-probe-source')
+    dest = os.path.join(dest_dir, '.flextop-probe-dest')
+    with open(source, 'wb') as f:
+        f.write(b'probe' * 1024)
+
+    try:
+        with open(source, 'rb') as source_file, open(dest, 'wb') as dest_file:
+            try:
+                fcntl.ioctl(dest_file.fileno(), FICLONE, source_file.fileno())
+                return 'reflink'
+            except OSError:
+                pass
+
+            try:
+                os.copy_file_range(source_file.fileno(), dest_file.fileno(),
+                                   os.fstat(source_file.fileno()).st_size)
+                return 'copy_file_range'
+            except OSError:
+                return 'copy'
+    finally:
+        for path in [source, dest]:
+            try:
+                os.unlink(path)
+            except FileNotFoundError:
+                pass
+
+
+def read_counters(env, name):
+    path = os.path.join(env['XDG_RUNTIME_DIR'], 'flextop-trace.json')
+    with open(path) as f:
+        # The array is left open for other processes to append to.
+        events = json.loads(f.read().rstrip().rstrip(',') + ']')
+
+    counters = [event['args'] for event in events
+                if event.get('ph') == 'C' and event['name'] == name]
+    if not counters:
+        raise ToolError(f'No {name} counters in {path}')
+    return counters[-1]
+
+
+def check(generator, bindir, source_dir, home_dir):
+    """Installs icons from source_dir into a home in home_dir. Returns the expected
+    strategy and the counts of each that was used."""
+    apps = generator.generate_inputs(source_dir, APPS, ICON_SIZES)
+    env = dict(os.environ)
+    env.update(generator.generate_home(home_dir, apps, 0, shortcut_ratio=0))
+    for name in ['G_MESSAGES_DEBUG', 'FLEXTOP_SERVICE', 'FLEXTOP_ICON_SIZES']:
+        env.pop(name, None)
+    env['FLEXTOP_TRACE'] = '1'
+
+    # The store is created on first use, so probe the directory it'll go in.
+    store_parent = env['FLEXTOP_TEST_HOST_DATA_DIR']
+    expected = probe(os.path.dirname(apps[0]['icons'][0]['path']), store_parent)
+
+    argv = [os.path.join(bindir, 'xdg-icon-resource'), 'install', '--noupdate',
+            '--mode', 'user', '--batch']
+    batch = ''.join(f'{icon["size"]} \'{icon["path"]}\' {app["icon_name"]}\n'
+                    for app in apps for icon in app['icons'])
+    proc = subprocess.run(argv, env=env, input=batch.encode(), stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE)
+    if proc.returncode != 0:
+        raise ToolError(f'{argv[0]} exited with {proc.returncode}:\n'
+                        f'{proc.stderr.decode(errors="replace")}')
+
+    return expected, read_counters(env, 'icon_copy_strategies')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Check the icon copy strategies.')
+    parser.add_argument('--bindir', required=True,
+                        help='build directory containing the tools')
+    parser.add_argument('--dir', action='append', default=[],
+                        help='a directory on another filesystem to check, which may '
+                             'be given more than once (default: also /dev/shm)')
+    args = parser.parse_args()
+
+    generator = load_module('generate_home', 'generate-home.py')
+    bindir = os.path.abspath(args.bindir)
+
+    roots = [tempfile.mkdtemp(prefix='flextop-copy-strategies-')]
+    for parent in args.dir or ['/dev/shm']:
+        if os.path.isdir(parent) and os.access(parent, os.W_OK):
+            roots.append(tempfile.mkdtemp(prefix='flextop-copy-strategies-',
+                                          dir=parent))
+
+    covered = set()
+    failures = []
+    try:
+        # Every directory on its own, then icons from each into a home on each other.
+        for index, (source_root, home_root) in enumerate(
+                itertools.chain(zip(roots, roots), itertools.permutations(roots, 2))):
+            source_dir = os.path.join(source_root, f'inputs-{index}')
+            home_dir = os.path.join(home_root, f'home-{index}')
+            expected, counts = check(generator, bindir, source_dir, home_dir)
+
+            stored = sum(counts.values())
+            print(f'{source_root} -> {home_root}: expected {expected}, got '
+                  + ', '.join(f'{name} {count}' for name, count in counts.items()
+                              if count))
+            if stored == 0 or counts.get(expected, 0) != stored:
+                failures.append(f'{source_root} -> {home_root}: expected every icon to '
+                                f'be stored using {expected}')
+            covered.add(expected)
+    except ToolError as e:
+        failures.append(str(e))
+    finally:
+        for root in roots:
+            shutil.rmtree(root, ignore_errors=True)
+
+    for strategy in STRATEGIES:
+        if strategy not in covered:
+            print(f'{strategy}: skipped, since no directory given supports it')
+
+    if failures:
+        sys.exit('\n'.join(failures))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+# Copyright (c) 2020 Endless OS Foundation LLC.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+# Checks that flextop-init's Desktop sweep cache doesn't trust a desktop file that was
+# rewritten in the same second as the sweep that cached it, which a filesystem with
+# one-second timestamps can't tell apart from the old contents. The coarse timestamps
+# are faked by setting the mtimes by hand. Needs a build with -Dtest_hooks=true.
+
+import argparse
+import importlib.util
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+# How many times to retry if a sweep slips into the next second.
+ATTEMPTS = 5
+NS_PER_SEC = 1000000000
+
+
+def load_module(name, filename):
+    path = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+                        'benchmarks', filename)
+    spec = importlib.util.spec_from_file_location(name, path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+class ToolError(Exception):
+    pass
+
+
+def run_init(bindir, env):
+    argv = [os.path.join(bindir, 'flextop-init')]
+    proc = subprocess.run(argv, env=env, stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE)
+    if proc.returncode != 0:
+        raise ToolError(f'{argv[0]} exited with {proc.returncode}:\n'
+                        f'{proc.stderr.decode(errors="replace")}')
+
+
+def get_sweep_time(env):
+    path = os.path.join(env['XDG_DATA_HOME'], 'flextop', 'desktop-sweep-cache')
+    with open(path) as f:
+        lines = f.read().splitlines()
+    # The third line holds the Desktop's inode and mtime, then the sweep time.
+    return int(lines[2].split()[3])
+
+
+def get_desktop_file(exec_line):
+    # Padded so that the shortcut is the same size as what it replaces.
+    return ('[Desktop Entry]\n'
+            'Type=Application\n'
+            'Name=Shortcut\n'
+            f'Exec={exec_line:<40}\n')
+
+
+def write_with_mtime(path, contents, mtime_ns):
+    with open(path, 'w') as f:
+        f.write(contents)
+    os.utime(path, ns=(mtime_ns, mtime_ns))
+
+
+def check(generator, bindir, workdir, attempt):
+    env = dict(os.environ)
+    env.update(generator.generate_home(os.path.join(workdir, f'home-{attempt}'), [], 0))
+    for name in ['G_MESSAGES_DEBUG', 'FLEXTOP_SERVICE', 'FLEXTOP_TRACE']:
+        env.pop(name, None)
+
+    desktop = os.path.join(env['HOME'], 'Desktop')
+    racy = os.path.join(desktop, 'racy.desktop')
+    old = os.path.join(desktop, 'old.desktop')
+    unrelated = get_desktop_file('/usr/bin/unrelated')
+    shortcut = get_desktop_file(f'{env["CHROME_WRAPPER"]} --app-id=abc')
+
+    # Start just after a second boundary, so that the sweep lands in the same second
+    # as the mtimes below.
+    time.sleep(1.05 - time.time() % 1)
+    now_ns = int(time.time()) * NS_PER_SEC
+    write_with_mtime(racy, unrelated, now_ns)
+    write_with_mtime(old, unrelated, now_ns - 60 * NS_PER_SEC)
+    os.utime(desktop, ns=(now_ns, now_ns))
+
+    run_init(bindir, env)
+    if get_sweep_time(env) != now_ns // NS_PER_SEC:
+        return False
+
+    # Turn both into shortcuts flextop-init has to remove, without changing anything
+    # a one-second stat could see.
+    write_with_mtime(racy, shortcut, now_ns)
+    write_with_mtime(old, shortcut, now_ns - 60 * NS_PER_SEC)
+    os.utime(desktop, ns=(now_ns, now_ns))
+
+    run_init(bindir, env)
+    if os.path.exists(racy):
+        raise ToolError('racy.desktop was rewritten in the same second as the sweep '
+                        'but was not inspected again')
+    # Anything older is still skipped, or the cache isn't doing its job.
+    if not os.path.exists(old):
+        raise ToolError('old.desktop was inspected again, but its mtime was older '
+                        'than the sweep')
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Check the Desktop sweep cache.')
+    parser.add_argument('--bindir', required=True,
+                        help='build directory containing the tools')
+    args = parser.parse_args()
+
+    generator = load_module('generate_home', 'generate-home.py')
+    bindir = os.path.abspath(args.bindir)
+
+    with tempfile.TemporaryDirectory(prefix='flextop-desktop-sweep-') as workdir:
+        try:
+            for attempt in range(ATTEMPTS):
+                if check(generator, bindir, workdir, attempt):
+                    return
+        except ToolError as e:
+            sys.exit(str(e))
+
+    sys.exit(f'Every sweep slipped into the next second in {ATTEMPTS} attempts')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,359 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Checks that desktop_file_rewrite_data() produces exactly the same output,
+// warnings, icon and MIME types whether a file is streamed or goes through
+// GKeyFile, since an installed file is only recognized as unchanged if both agree.
+// The inputs are a corpus of the kinds of files Chromium writes, plus the oddities
+// that make the streaming path give up, and random mutations of them.
+
+#include "flextop-desktop-rewrite.h"
+
+#include <string.h>
+
+#define APP "com.example.Browser"
+#define WRAPPER "/app/bin/chromium"
+#define PWA_HEADER                                                                    \
+  "#!/usr/bin/env xdg-open\n"                                                         \
+  "[Desktop Entry]\n"                                                                 \
+  "Version=1.0\n"                                                                     \
+  "Terminal=false\n"                                                                  \
+  "Type=Application\n"                                                                \
+  "Name=Example\n"
+
+typedef struct {
+  gboolean ok;
+  gboolean streamed;
+  char *contents;
+  char *icon;
+  GStrv mime_types;
+  GStrv warnings;
+} Result;
+
+static void result_clear(Result *result) {
+  g_free(result->contents);
+  g_free(result->icon);
+  g_strfreev(result->mime_types);
+  g_strfreev(result->warnings);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(Result, result_clear)
+
+static void rewrite(const char *data, gsize length, FlatpakInfo *info,
+                    gboolean allow_streaming, Result *out_result) {
+  g_auto(DesktopFileRewrite) rewrite = {NULL};
+  g_autoptr(GPtrArray) warnings = g_ptr_array_new_with_free_func(g_free);
+  g_autoptr(GError) error = NULL;
+
+  memset(out_result, 0, sizeof(*out_result));
+  out_result->ok =
+      desktop_file_rewrite_data("test.desktop", data, length, info, allow_streaming,
+                                &rewrite, warnings, &out_result->streamed, &error);
+  g_ptr_array_add(warnings, NULL);
+  out_result->warnings = (GStrv)g_ptr_array_free(g_steal_pointer(&warnings), FALSE);
+  if (!out_result->ok) {
+    return;
+  }
+
+  out_result->contents = g_strndup(rewrite.contents->str, rewrite.contents->len);
+  out_result->icon = g_strdup(rewrite.icon);
+  out_result->mime_types = g_strdupv((GStrv)rewrite.mime_types->pdata);
+}
+
+static void assert_strv_equal(GStrv a, GStrv b) {
+  g_assert_cmpint(g_strv_length(a), ==, g_strv_length(b));
+  for (guint i = 0; a[i] != NULL; i++) {
+    g_assert_cmpstr(a[i], ==, b[i]);
+  }
+}
+
+// Returns whether the streaming path was used.
+static gboolean assert_paths_agree(const char *data, gsize length, FlatpakInfo *info) {
+  g_auto(Result) expected = {FALSE};
+  g_auto(Result) actual = {FALSE};
+  rewrite(data, length, info, FALSE, &expected);
+  rewrite(data, length, info, TRUE, &actual);
+  g_assert_false(expected.streamed);
+
+  if (expected.ok != actual.ok || g_strcmp0(expected.contents, actual.contents) != 0) {
+    g_autofree char *escaped = g_strescape(data, NULL);
+    g_test_message("Disagreement on: \"%s\"", escaped);
+  }
+
+  g_assert_cmpint(actual.ok, ==, expected.ok);
+  if (expected.ok) {
+    g_assert_cmpstr(actual.contents, ==, expected.contents);
+    g_assert_cmpstr(actual.icon, ==, expected.icon);
+    assert_strv_equal(actual.mime_types, expected.mime_types);
+    assert_strv_equal(actual.warnings, expected.warnings);
+  }
+
+  return actual.streamed;
+}
+
+typedef struct {
+  const char *contents;
+  // Whether the streaming path is expected to handle it, rather than GKeyFile.
+  gboolean streams;
+} Case;
+
+static const Case cases[] = {
+    // What Chromium writes for a PWA.
+    {PWA_HEADER "Name[de]=Beispiel\n"
+                "Exec=" WRAPPER " --profile-directory=Default --app-id=abc\n"
+                "Icon=chrome-abc-Default\n"
+                "StartupWMClass=crx_abc\n",
+     TRUE},
+    // With shortcut menu actions.
+    {PWA_HEADER "Exec=" WRAPPER " --app-id=abc %U\n"
+                "Icon=chrome-abc-Default\n"
+                "Actions=New;Private;\n"
+                "\n"
+                "[Desktop Action New]\n"
+                "Name=New Window\n"
+                "Name[fr]=Nouvelle fenêtre\n"
+                "Exec=" WRAPPER " --app-id=abc --new-window\n"
+                "\n"
+                "[Desktop Action Private]\n"
+                "Name=Private\n"
+                "Exec=" WRAPPER " --app-id=abc --incognito\n",
+     TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\nActions=New\n[Desktop Action New]\nExec=" WRAPPER
+                "\n",
+     TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\nActions=New;\n[Desktop Action Other]\nExec=x\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\nActions=New;\n[Desktop Action New]\nName=New\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\nActions=;\n", TRUE},
+    // Comments and blank lines, including at the end of the main group, which is
+    // where GKeyFile adds the keys it's missing.
+    {"# Leading comment\n\n" PWA_HEADER "# Before Exec\nExec=" WRAPPER "\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\n# Trailing comment\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\n\n\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\n  # Indented comment\n\t\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\nActions=New;\n# Comment\n\n"
+                "[Desktop Action New]\nExec=" WRAPPER "\n",
+     TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\n\n# About the next group\n[Other]\nKey=Value\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\n[Other]\nKey=Value\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER, TRUE},
+    // Locale keys.
+    {PWA_HEADER "Name[de_DE@euro]=Beispiel\nComment[sr@latin]=Primer\n"
+                "GenericName[pt_BR]=Aplicativo\nExec=" WRAPPER "\n",
+     TRUE},
+    // Keys that are replaced or read.
+    {PWA_HEADER "Exec=" WRAPPER "\nTryExec=/usr/bin/old\nX-Flatpak-Part-Of=old\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\nMimeType=text/html;x-scheme-handler/https;\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\nMimeType=text/html\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\nMimeType=;\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER "\nIcon=\n", TRUE},
+    {PWA_HEADER "Exec = " WRAPPER " --x\nIcon\t=\tchrome-abc\n", TRUE},
+    // Exec values that need quoting.
+    {PWA_HEADER "Exec=\"" WRAPPER "\" '--arg with spaces' \"it's\" %U\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER " --flag=\"a;b\" 'x\"y'\n", TRUE},
+    {PWA_HEADER "Exec=" WRAPPER " --title=Ünïcödé\n", TRUE},
+    // A missing Exec key only warns.
+    {PWA_HEADER "Icon=chrome-abc-Default\n", TRUE},
+    // Escaped values, which are left to GKeyFile.
+    {PWA_HEADER "Exec=" WRAPPER "\\s--app-id=abc\n", FALSE},
+    {PWA_HEADER "Exec=" WRAPPER " --path=C:\\\\Users\n", FALSE},
+    {PWA_HEADER "Exec=" WRAPPER " \"--title=a\\\\\"b\"\n", FALSE},
+    {PWA_HEADER "Exec=" WRAPPER "\nIcon=a\\sb\n", FALSE},
+    {PWA_HEADER "Exec=" WRAPPER "\nMimeType=text/a\\;b;\n", FALSE},
+    {PWA_HEADER "Exec=" WRAPPER "\nActions=A\\;B;\n", FALSE},
+    // Other oddities the streaming path gives up on.
+    {PWA_HEADER "  Exec=" WRAPPER "\n", FALSE},
+    {PWA_HEADER "Exec=" WRAPPER "\nExec=" WRAPPER " --x\n", FALSE},
+    {PWA_HEADER "Exec=" WRAPPER "\n[Desktop Entry]\nIcon=x\n", FALSE},
+    {"[Desktop Action New]\nExec=" WRAPPER "\n" PWA_HEADER "Exec=x\nActions=New;\n",
+     FALSE},
+    {PWA_HEADER "Exec=" WRAPPER "\nActions=New;New;\n", FALSE},
+    {"[Desktop Entry]\r\nExec=" WRAPPER "\r\n", FALSE},
+    {PWA_HEADER "Exec=" WRAPPER "\nName=\xff\n", FALSE},
+    {PWA_HEADER "Exec=" WRAPPER "\nX_Under=score\n", FALSE},
+    {"[Other]\nKey=Value\n", FALSE},
+    // Files neither path can rewrite.
+    {"Exec=" WRAPPER "\n" PWA_HEADER, FALSE},
+    {PWA_HEADER "Not a key\n", FALSE},
+    {PWA_HEADER "Exec=\"" WRAPPER "\n", FALSE},
+    {PWA_HEADER "Exec=\n", FALSE},
+    {PWA_HEADER "Exec=   \n", FALSE},
+    {"", FALSE},
+};
+
+static FlatpakInfo *create_info(gboolean has_wrapper_exe) {
+  FlatpakInfo *info = g_new0(FlatpakInfo, 1);
+  info->app = g_strdup(APP);
+  info->exec_app_arg = g_shell_quote(APP);
+  if (has_wrapper_exe) {
+    info->wrapper_exe = g_strdup("/var/lib/flatpak/exports/bin/" APP);
+  }
+
+  return info;
+}
+
+static void test_cases() {
+  g_autoptr(FlatpakInfo) info = create_info(TRUE);
+  g_autoptr(FlatpakInfo) info_without_wrapper = create_info(FALSE);
+
+  for (gsize i = 0; i < G_N_ELEMENTS(cases); i++) {
+    const char *contents = cases[i].contents;
+    gsize length = strlen(contents);
+    assert_paths_agree(contents, length, info);
+    assert_paths_agree(contents, length, info_without_wrapper);
+  }
+}
+
+static void test_streams() {
+  g_autoptr(FlatpakInfo) info = create_info(TRUE);
+
+  // The streaming path is never used if GKeyFile adds keys somewhere it doesn't
+  // know about, in which case the cases above only covered GKeyFile.
+  if (!assert_paths_agree(cases[0].contents, strlen(cases[0].contents), info)) {
+    g_test_skip("GKeyFile adds keys in an unrecognized place with this GLib");
+    return;
+  }
+
+  for (gsize i = 0; i < G_N_ELEMENTS(cases); i++) {
+    const char *contents = cases[i].contents;
+    if (assert_paths_agree(contents, strlen(contents), info) != cases[i].streams) {
+      g_autofree char *escaped = g_strescape(contents, NULL);
+      g_test_message("Unexpected path taken for: \"%s\"", escaped);
+      g_test_fail();
+    }
+  }
+}
+
+// What desktop_file_build_exec_command() has to produce, built by quoting every
+// argument with g_shell_quote() and joining them.
+static char *build_expected_command(const char *exec, FlatpakInfo *info) {
+  int argc;
+  g_auto(GStrv) argv = NULL;
+  g_assert_true(g_shell_parse_argv(exec, &argc, &argv, NULL));
+
+  g_autoptr(GPtrArray) parts = g_ptr_array_new_with_free_func(g_free);
+  g_ptr_array_add(parts, g_strdup("flatpak"));
+  g_ptr_array_add(parts, g_shell_quote("run"));
+
+  g_autofree char *command_arg = g_strconcat("--command=", argv[0], NULL);
+  g_ptr_array_add(parts, g_shell_quote(command_arg));
+  g_ptr_array_add(parts, g_strdup(info->exec_app_arg));
+  for (int i = 1; i < argc; i++) {
+    g_ptr_array_add(parts, g_shell_quote(argv[i]));
+  }
+
+  g_ptr_array_add(parts, NULL);
+  return g_strjoinv(" ", (char **)parts->pdata);
+}
+
+static void test_exec_quoting() {
+  static const char *const execs[] = {
+      WRAPPER,
+      WRAPPER " --profile-directory=Default --app-id=abc %U",
+      "\"" WRAPPER "\" '--arg with spaces' \"it's\"",
+      WRAPPER " \"'\" \"''\" \"a'b'c\" \"'start\" \"end'\"",
+      WRAPPER " '' \"\"",
+      WRAPPER " \"back\\\\slash\" \"dollar $HOME\" \"tab\tand\nnewline\"",
+      WRAPPER " --title=Ünïcödé",
+      "\"/opt/it's here/chromium\" --x",
+  };
+
+  g_autoptr(FlatpakInfo) info = create_info(TRUE);
+  for (gsize i = 0; i < G_N_ELEMENTS(execs); i++) {
+    g_autoptr(GPtrArray) warnings = g_ptr_array_new_with_free_func(g_free);
+    g_autoptr(GError) error = NULL;
+    g_autofree char *command = NULL;
+    g_assert_true(desktop_file_build_exec_command(execs[i], G_KEY_FILE_DESKTOP_GROUP,
+                                                  info, warnings, &command, &error));
+    g_assert_no_error(error);
+
+    g_autofree char *expected = build_expected_command(execs[i], info);
+    g_assert_cmpstr(command, ==, expected);
+  }
+}
+
+// Fragments that tend to matter to either path.
+static const char *const fragments[] = {
+    "[Desktop Entry]", "[Desktop Action New]", "[Other]", "[", "]", "Exec=", "TryExec=",
+    "X-Flatpak-Part-Of=", "Actions=", "Icon=", "MimeType=", "=", " ", "\t", "\n", "#",
+    "\"", "'", "\\", "\\s", ";", "New;", "[de]", WRAPPER, "x", "%U",
+};
+
+static void mutate(GRand *rand, GString *contents) {
+  gsize position = g_rand_int_range(rand, 0, contents->len + 1);
+
+  switch (g_rand_int_range(rand, 0, 4)) {
+  case 0:
+    g_string_insert(contents, position,
+                    fragments[g_rand_int_range(rand, 0, G_N_ELEMENTS(fragments))]);
+    break;
+  case 1: {
+    gsize length = g_rand_int_range(rand, 1, 8);
+    g_string_erase(contents, position, MIN(contents->len - position, length));
+    break;
+  }
+  case 2:
+    if (position < contents->len) {
+      contents->str[position] = g_rand_int_range(rand, 1, 256);
+    }
+    break;
+  case 3: {
+    // Duplicate a line, which can repeat keys and groups.
+    const char *start = contents->str + position;
+    while (start > contents->str && start[-1] != '\n') {
+      start--;
+    }
+
+    const char *end = strchr(start, '\n');
+    gsize length = end != NULL ? end - start + 1 : strlen(start);
+    g_autofree char *line = g_strndup(start, length);
+    g_string_insert(contents, start - contents->str, line);
+    break;
+  }
+  }
+}
+
+static void test_mutations() {
+  g_autoptr(FlatpakInfo) info = create_info(TRUE);
+  // A fixed seed keeps failures reproducible.
+  g_autoptr(GRand) rand = g_rand_new_with_seed(20202);
+
+  for (int i = 0; i < 20000; i++) {
+    const char *base = cases[g_rand_int_range(rand, 0, G_N_ELEMENTS(cases))].contents;
+    g_autoptr(GString) contents = g_string_new(base);
+
+    int mutations = g_rand_int_range(rand, 1, 5);
+    for (int j = 0; j < mutations; j++) {
+      mutate(rand, contents);
+    }
+
+    assert_paths_agree(contents->str, contents->len, info);
+  }
+}
+
+int main(int argc, char **argv) {
+  g_test_init(&argc, &argv, NULL);
+
+  // Some GLib versions set GKeyFile's error twice on a value with an invalid
+  // escape followed by one at the end of the line, and warn about it. That's
+  // GLib's bug rather than a disagreement, so warnings aren't fatal here.
+  g_log_set_always_fatal(G_LOG_LEVEL_CRITICAL);
+
+  g_test_add_func("/desktop-rewrite/cases", test_cases);
+  g_test_add_func("/desktop-rewrite/streams", test_streams);
+  g_test_add_func("/desktop-rewrite/exec-quoting", test_exec_quoting);
+  g_test_add_func("/desktop-rewrite/mutations", test_mutations);
+
+  return g_test_run();
+}
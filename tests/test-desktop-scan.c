@@ -0,0 +1,165 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Checks that rejecting desktop files with scan_desktop_entry_exec() never changes
+// which ones delete_maybe_invalid_desktop_file() removes, by running each input
+// through desktop_file_exec_is_wrapper() with and without the scan. The inputs are
+// a set of hand-written cases, plus random mutations of them.
+
+#include "flextop-utils.h"
+
+#include <string.h>
+
+#define WRAPPER "/app/bin/chromium"
+
+// The scan can turn a file GKeyFile fails to load into one that's left alone, but
+// either way it's kept, so only whether the file would be removed is compared.
+static gboolean would_remove(const char *data, gsize length, gboolean allow_scan) {
+  g_autoptr(GError) error = NULL;
+  gboolean is_wrapper;
+  return desktop_file_exec_is_wrapper(data, length, WRAPPER, allow_scan, &is_wrapper,
+                                      &error) &&
+         is_wrapper;
+}
+
+static void assert_scan_agrees(const char *data, gsize length) {
+  gboolean expected = would_remove(data, length, FALSE);
+  gboolean actual = would_remove(data, length, TRUE);
+  if (expected != actual) {
+    g_autofree char *escaped = g_strescape(data, NULL);
+    g_test_message("Disagreement on: \"%s\"", escaped);
+  }
+
+  g_assert_cmpint(actual, ==, expected);
+}
+
+typedef struct {
+  const char *contents;
+  gboolean removed;
+} Case;
+
+static const Case cases[] = {
+    {"[Desktop Entry]\nExec=" WRAPPER " --app-id=abc\n", TRUE},
+    {"[Desktop Entry]\nExec=" WRAPPER "\n", TRUE},
+    {"[Desktop Entry]\nExec=" WRAPPER, TRUE},
+    {"#!/usr/bin/env xdg-open\n[Desktop Entry]\nExec=" WRAPPER " --x\n", TRUE},
+    {"[Desktop Entry]\nExec = " WRAPPER " --x\n", TRUE},
+    {"[Desktop Entry]\n  Exec=" WRAPPER "\n", TRUE},
+    {"[Desktop Entry]\nExec=\"" WRAPPER "\" --x\n", TRUE},
+    {"[Desktop Entry]\nExec='" WRAPPER "' --x\n", TRUE},
+    {"[Desktop Entry]\nExec=" WRAPPER "\\s--x\n", TRUE},
+    {"[Desktop Entry]\r\nExec=" WRAPPER " --x\r\n", TRUE},
+    {"[Desktop Entry]\nName=A\n\n# Comment\nExec=" WRAPPER "\n", TRUE},
+    {"[Desktop Entry]\nExec=/usr/bin/other --x\n", FALSE},
+    {"[Desktop Entry]\nExec=" WRAPPER "-beta --x\n", FALSE},
+    {"[Desktop Entry]\nExec=" WRAPPER "x\n", FALSE},
+    {"[Desktop Entry]\nExec=\"/usr/bin/other\" " WRAPPER "\n", FALSE},
+    {"[Desktop Entry]\nExec[de]=" WRAPPER "\n", FALSE},
+    {"[Desktop Entry]\nExecutable=" WRAPPER "\n", FALSE},
+    {"[Desktop Entry]\nName=A\n", FALSE},
+    {"[Desktop Entry]\nExec=\n", FALSE},
+    {"[Desktop Action New]\nExec=" WRAPPER "\n", FALSE},
+    {"[Desktop Entry]\nExec=/usr/bin/other\n\n[Desktop Action New]\nExec=" WRAPPER "\n",
+     FALSE},
+    {"[Desktop Entry]\nExec=" WRAPPER "\n[Desktop Entry]\nExec=/usr/bin/other\n", FALSE},
+    {"[Desktop Entry]\nExec=/usr/bin/other\nExec=" WRAPPER "\n", TRUE},
+    {"[Desktop Entry]\nExec=#" WRAPPER "\n", FALSE},
+    {"[Desktop Entry\nExec=" WRAPPER "\n", FALSE},
+    {"Exec=" WRAPPER "\n", FALSE},
+    {"[Desktop Entry]]\nExec=" WRAPPER "\n", FALSE},
+    {"[Desktop Entry]\nExec=\"" WRAPPER "\n", FALSE},
+    {"[Desktop Entry]\nNot a key\nExec=" WRAPPER "\n", FALSE},
+    {"", FALSE},
+};
+
+static void test_cases() {
+  for (gsize i = 0; i < G_N_ELEMENTS(cases); i++) {
+    const char *contents = cases[i].contents;
+    gsize length = strlen(contents);
+    g_assert_cmpint(would_remove(contents, length, FALSE), ==, cases[i].removed);
+    assert_scan_agrees(contents, length);
+  }
+}
+
+// Fragments that tend to matter to either parser.
+static const char *const fragments[] = {
+    "[Desktop Entry]", "[Desktop Action New]", "[", "]", "Exec", "Exec=", "=", " ",
+    "\t", "\n", "\r", "#", "\"", "'", "\\", "\\s", ";", "[de]", WRAPPER, "x", "%U",
+};
+
+static void mutate(GRand *rand, GString *contents) {
+  gsize position = g_rand_int_range(rand, 0, contents->len + 1);
+
+  switch (g_rand_int_range(rand, 0, 4)) {
+  case 0:
+    g_string_insert(contents, position,
+                    fragments[g_rand_int_range(rand, 0, G_N_ELEMENTS(fragments))]);
+    break;
+  case 1: {
+    gsize length = g_rand_int_range(rand, 1, 8);
+    g_string_erase(contents, position, MIN(contents->len - position, length));
+    break;
+  }
+  case 2:
+    if (position < contents->len) {
+      contents->str[position] = g_rand_int_range(rand, 1, 256);
+    }
+    break;
+  case 3: {
+    // Duplicate a line, which can repeat keys and groups.
+    const char *start = contents->str + position;
+    while (start > contents->str && start[-1] != '\n') {
+      start--;
+    }
+
+    const char *end = strchr(start, '\n');
+    gsize length = end != NULL ? end - start + 1 : strlen(start);
+    g_autofree char *line = g_strndup(start, length);
+    g_string_insert(contents, start - contents->str, line);
+    break;
+  }
+  }
+}
+
+static void test_mutations() {
+  // A fixed seed keeps failures reproducible.
+  g_autoptr(GRand) rand = g_rand_new_with_seed(20201);
+
+  for (int i = 0; i < 20000; i++) {
+    const char *base = cases[g_rand_int_range(rand, 0, G_N_ELEMENTS(cases))].contents;
+    g_autoptr(GString) contents = g_string_new(base);
+
+    int mutations = g_rand_int_range(rand, 1, 5);
+    for (int j = 0; j < mutations; j++) {
+      mutate(rand, contents);
+    }
+
+    assert_scan_agrees(contents->str, contents->len);
+  }
+}
+
+int main(int argc, char **argv) {
+  g_test_init(&argc, &argv, NULL);
+
+  // Some GLib versions set GKeyFile's error twice on a value with an invalid
+  // escape followed by one at the end of the line, and warn about it. That's
+  // GLib's bug rather than a disagreement, so warnings aren't fatal here.
+  g_log_set_always_fatal(G_LOG_LEVEL_CRITICAL);
+
+  g_test_add_func("/desktop-scan/cases", test_cases);
+  g_test_add_func("/desktop-scan/mutations", test_mutations);
+
+  return g_test_run();
+}
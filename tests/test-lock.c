@@ -0,0 +1,183 @@
+/* Copyright (c) 2020 Endless OS Foundation LLC.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Checks how long lock_fd() waits: that it gives up at its timeout, that it takes
+// the lock as soon as it's released rather than on some later poll, that each
+// waiting thread only gets its own timeout, and that shared holders that keep
+// overlapping can keep an exclusive waiter out for no longer than its timeout.
+
+#include "flextop-lock.h"
+
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// Generous, so that a loaded machine doesn't fail the checks that a wait ended in
+// time.
+#define SLACK_MS 250
+
+static char *lock_path = NULL;
+
+static int open_lock() {
+  int fd = open(lock_path, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+  g_assert_cmpint(fd, !=, -1);
+  return fd;
+}
+
+static gint64 elapsed_ms(gint64 start) {
+  return (g_get_monotonic_time() - start) / G_TIME_SPAN_MILLISECOND;
+}
+
+static void test_timeout() {
+  g_auto(LockFd) holder = open_lock();
+  g_assert_cmpint(flock(holder, LOCK_EX), ==, 0);
+
+  g_auto(LockFd) waiter = open_lock();
+  g_autoptr(GError) error = NULL;
+  gint64 start = g_get_monotonic_time();
+  g_assert_false(lock_fd(waiter, lock_path, LOCK_MODE_EXCLUSIVE, 100, &error));
+  g_assert_error(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+  g_assert_cmpint(elapsed_ms(start), >=, 100);
+  g_assert_cmpint(elapsed_ms(start), <, 100 + SLACK_MS);
+
+  g_clear_error(&error);
+  g_assert_false(lock_fd(waiter, lock_path, LOCK_MODE_SHARED, 0, &error));
+  g_assert_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+}
+
+static gpointer release_after(gpointer data) {
+  int *fd = data;
+  g_usleep(100 * G_TIME_SPAN_MILLISECOND);
+  flock(*fd, LOCK_UN);
+  return NULL;
+}
+
+static void check_wakeup(int timeout_ms) {
+  int holder = open_lock();
+  g_assert_cmpint(flock(holder, LOCK_EX), ==, 0);
+  GThread *thread = g_thread_new("release", release_after, &holder);
+
+  g_auto(LockFd) waiter = open_lock();
+  g_autoptr(GError) error = NULL;
+  gint64 start = g_get_monotonic_time();
+  g_assert_true(lock_fd(waiter, lock_path, LOCK_MODE_EXCLUSIVE, timeout_ms, &error));
+  g_assert_no_error(error);
+  g_assert_cmpint(elapsed_ms(start), <, 100 + SLACK_MS);
+
+  g_thread_join(thread);
+  close(holder);
+}
+
+static void test_wakeup() {
+  check_wakeup(5000);
+  check_wakeup(-1);
+}
+
+typedef struct Waiter {
+  int timeout_ms;
+  gboolean locked;
+  gint64 elapsed_ms;
+} Waiter;
+
+static gpointer wait_for_lock(gpointer data) {
+  Waiter *waiter = data;
+  g_auto(LockFd) fd = open_lock();
+  gint64 start = g_get_monotonic_time();
+  waiter->locked =
+      lock_fd(fd, lock_path, LOCK_MODE_SHARED, waiter->timeout_ms, NULL);
+  waiter->elapsed_ms = elapsed_ms(start);
+  return NULL;
+}
+
+static void test_timeouts_per_thread() {
+  int holder = open_lock();
+  g_assert_cmpint(flock(holder, LOCK_EX), ==, 0);
+
+  // The short timeout firing mustn't cut the long one short.
+  Waiter short_waiter = {.timeout_ms = 100};
+  Waiter long_waiter = {.timeout_ms = 5000};
+  GThread *short_thread = g_thread_new("short", wait_for_lock, &short_waiter);
+  GThread *long_thread = g_thread_new("long", wait_for_lock, &long_waiter);
+
+  g_usleep(300 * G_TIME_SPAN_MILLISECOND);
+  close(holder);
+  g_thread_join(short_thread);
+  g_thread_join(long_thread);
+
+  g_assert_false(short_waiter.locked);
+  g_assert_cmpint(short_waiter.elapsed_ms, <, 100 + SLACK_MS);
+  g_assert_true(long_waiter.locked);
+  g_assert_cmpint(long_waiter.elapsed_ms, >=, 200);
+}
+
+static gboolean stop_readers = FALSE;
+
+// Keeps a shared lock held at all times, by taking the next one before letting go
+// of the last.
+static gpointer hold_shared(gpointer data) {
+  int fds[] = {open_lock(), open_lock()};
+  g_assert_cmpint(flock(fds[0], LOCK_SH), ==, 0);
+  for (int i = 0; !g_atomic_int_get(&stop_readers); i = !i) {
+    g_assert_cmpint(flock(fds[!i], LOCK_SH), ==, 0);
+    flock(fds[i], LOCK_UN);
+    g_usleep(5 * G_TIME_SPAN_MILLISECOND);
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+  return NULL;
+}
+
+static void test_starvation_bound() {
+  g_atomic_int_set(&stop_readers, FALSE);
+  GThread *readers = g_thread_new("readers", hold_shared, NULL);
+  g_usleep(20 * G_TIME_SPAN_MILLISECOND);
+
+  g_auto(LockFd) waiter = open_lock();
+  g_autoptr(GError) error = NULL;
+  gint64 start = g_get_monotonic_time();
+  g_assert_false(lock_fd(waiter, lock_path, LOCK_MODE_EXCLUSIVE, 200, &error));
+  g_assert_error(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+  g_assert_cmpint(elapsed_ms(start), <, 200 + SLACK_MS);
+
+  g_atomic_int_set(&stop_readers, TRUE);
+  g_thread_join(readers);
+
+  g_clear_error(&error);
+  g_assert_true(lock_fd(waiter, lock_path, LOCK_MODE_EXCLUSIVE, 1000, &error));
+  g_assert_no_error(error);
+}
+
+int main(int argc, char **argv) {
+  g_test_init(&argc, &argv, NULL);
+
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = g_dir_make_tmp("flextop-test-lock-XXXXXX", &error);
+  g_assert_no_error(error);
+  lock_path = g_build_filename(dir, "lock", NULL);
+
+  g_test_add_func("/lock/timeout", test_timeout);
+  g_test_add_func("/lock/wakeup", test_wakeup);
+  g_test_add_func("/lock/timeouts-per-thread", test_timeouts_per_thread);
+  g_test_add_func("/lock/starvation-bound", test_starvation_bound);
+
+  int status = g_test_run();
+
+  g_unlink(lock_path);
+  g_rmdir(dir);
+  g_free(lock_path);
+  return status;
+}